@@ -0,0 +1,254 @@
+/* File: bandwidth.c
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+
+#include "bandwidth.h"
+
+#define BURST_TIME 0.25   /* seconds of tokens saved while idle */
+
+static void refill(struct bucket *bucket, double now)
+{
+  if(now > bucket->stamp) {
+    bucket->tokens += (now - bucket->stamp) * bucket->rate;
+    if(bucket->tokens > bucket->burst)
+      bucket->tokens = bucket->burst;
+  }
+  bucket->stamp = now;
+}
+
+void bucket_init(struct bucket *bucket, double rate, double now)
+{
+  bucket->rate   = rate;
+  bucket->burst  = rate * BURST_TIME;
+  bucket->tokens = bucket->burst;
+  bucket->stamp  = now;
+}
+
+/* Change the rate, the tokens and the debt are kept. */
+void bucket_rate(struct bucket *bucket, double rate, double now)
+{
+  if(rate == bucket->rate)
+    return;
+  if(bucket->rate == 0.) {
+    bucket_init(bucket,rate,now);
+    return;
+  }
+  refill(bucket,now);
+  bucket->rate  = rate;
+  bucket->burst = rate * BURST_TIME;
+  if(bucket->tokens > bucket->burst)
+    bucket->tokens = bucket->burst;
+}
+
+bool bucket_ready(struct bucket *bucket, double now)
+{
+  if(bucket->rate == 0.)
+    return true;
+  refill(bucket,now);
+  return bucket->tokens >= 0.;
+}
+
+void bucket_spend(struct bucket *bucket, double bytes)
+{
+  if(bucket->rate != 0.)
+    bucket->tokens -= bytes;
+}
+
+/* Seconds until the debt is paid back. */
+double bucket_wait(const struct bucket *bucket)
+{
+  if(bucket->rate == 0. || bucket->tokens >= 0.)
+    return 0.;
+  return -bucket->tokens / bucket->rate;
+}
+
+/* Bytes per second with an optional k, m or g binary suffix. */
+bool bandwidth_parse(const char *str, double *rate)
+{
+  char *end;
+  double value = strtod(str,&end);
+
+  if(end == str || value < 0.)
+    return false;
+  switch(*end) {
+    case 'g': case 'G':
+      value *= 1024.;
+    case 'm': case 'M':
+      value *= 1024.;
+    case 'k': case 'K':
+      value *= 1024.;
+      end++;
+    default:
+      break;
+  }
+  if(*end)
+    return false;
+  *rate = value;
+  return true;
+}
+
+/* Either a rate for the whole day or "HH:MM=<rate>" entries separated
+   by commas in the order of the day. The last entry goes on past
+   midnight until the first one. */
+bool profile_parse(struct profile *profile, const char *str)
+{
+  char buf[64];
+  const char *p,*next;
+  int hour,min,len;
+  size_t size;
+
+  memset(profile,0,sizeof(struct profile));
+  if(!strchr(str,'=')) {
+    if(!bandwidth_parse(str,&profile->entries[0].rate))
+      return false;
+    profile->count = profile->entries[0].rate > 0.;
+    return true;
+  }
+  for(p = str ; *p ; p = *next ? next + 1 : next) {
+    next = p + strcspn(p,",");
+    size = next - p;
+    if(size >= sizeof(buf) || profile->count == PROFILE_MAX)
+      return false;
+    memcpy(buf,p,size);
+    buf[size] = '\0';
+    if(sscanf(buf,"%d:%d=%n",&hour,&min,&len) != 2 ||
+       hour < 0 || hour > 23 || min < 0 || min > 59 ||
+       !bandwidth_parse(buf + len,&profile->entries[profile->count].rate))
+      return false;
+    profile->entries[profile->count].minute = hour * 60 + min;
+    if(profile->count &&
+       profile->entries[profile->count].minute <=
+       profile->entries[profile->count - 1].minute)
+      return false;
+    profile->count++;
+  }
+  return profile->count > 0;
+}
+
+/* Limit at the local time now, 0 for none. */
+double profile_rate(const struct profile *profile, time_t now)
+{
+  struct tm tm;
+  int minute,i;
+
+  if(!profile->count)
+    return 0.;
+  localtime_r(&now,&tm);
+  minute = tm.tm_hour * 60 + tm.tm_min;
+  for(i = profile->count - 1 ; i > 0 ; i--)
+    if(profile->entries[i].minute <= minute)
+      break;
+  if(profile->entries[i].minute > minute)
+    i = profile->count - 1;
+  return profile->entries[i].rate;
+}
+
+bool bandwidth_init(struct bandwidth *bandwidth, const char *profile,
+                    const char *host_rate, double now)
+{
+  memset(bandwidth,0,sizeof(struct bandwidth));
+  if(profile && !profile_parse(&bandwidth->profile,profile))
+    return false;
+  if(host_rate && !bandwidth_parse(host_rate,&bandwidth->host_rate))
+    return false;
+  bucket_init(&bandwidth->global,
+              profile_rate(&bandwidth->profile,time(NULL)),now);
+  bandwidth->hosts = g_hash_table_new_full(g_str_hash,g_str_equal,
+                                           g_free,g_free);
+  return true;
+}
+
+void bandwidth_free(struct bandwidth *bandwidth)
+{
+  if(bandwidth->hosts)
+    g_hash_table_destroy(bandwidth->hosts);
+  bandwidth->hosts = NULL;
+}
+
+bool bandwidth_on(const struct bandwidth *bandwidth)
+{
+  return bandwidth->profile.count || bandwidth->host_rate > 0.;
+}
+
+/* Bucket of a host for one more job, NULL without a limit per host. */
+struct host_limit *bandwidth_host(struct bandwidth *bandwidth,
+                                  const char *host, double now)
+{
+  struct host_limit *limit;
+
+  if(bandwidth->host_rate <= 0.)
+    return NULL;
+  limit = g_hash_table_lookup(bandwidth->hosts,host);
+  if(!limit) {
+    limit = g_malloc(sizeof(struct host_limit));
+    bucket_init(&limit->bucket,bandwidth->host_rate,now);
+    limit->users  = 0;
+    limit->weight = 0.;
+    g_hash_table_replace(bandwidth->hosts,g_strdup(host),limit);
+  }
+  limit->users++;
+  return limit;
+}
+
+void bandwidth_unhost(struct bandwidth *bandwidth, const char *host)
+{
+  struct host_limit *limit = g_hash_table_lookup(bandwidth->hosts,host);
+  if(limit && !--limit->users)
+    g_hash_table_remove(bandwidth->hosts,host);
+}
+
+/* Weighted max-min fairness: the total is shared by weight, a share
+   above its cap is cut down and what is left over goes to the others.
+   Without a total every share gets its cap. */
+void share_fair(struct share *shares, int n, double total)
+{
+  register struct share *s;
+  double weight,left;
+  bool capped;
+  int i;
+
+  for(i = 0 ; i < n ; i++)
+    shares[i].rate = total > 0. ? -1. : shares[i].cap;
+  if(total <= 0.)
+    return;
+  left = total;
+  do {
+    capped = false;
+    weight = 0.;
+    for(s = shares ; s < shares + n ; s++)
+      if(s->rate < 0.)
+        weight += s->weight;
+    if(weight <= 0.)
+      break;
+    for(s = shares ; s < shares + n ; s++) {
+      if(s->rate >= 0. || s->cap <= 0. || s->cap >= left * s->weight / weight)
+        continue;
+      s->rate  = s->cap;
+      left    -= s->cap;
+      capped   = true;
+    }
+  } while(capped);
+  for(s = shares ; s < shares + n ; s++)
+    if(s->rate < 0.)
+      s->rate = weight > 0. ? left * s->weight / weight : 0.;
+}
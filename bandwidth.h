@@ -0,0 +1,96 @@
+/* File: bandwidth.h
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _BANDWIDTH_H_
+#define _BANDWIDTH_H_
+
+#include <stdbool.h>
+#include <time.h>
+#include <glib.h>
+
+enum bandwidth_max { PROFILE_MAX = 48 };
+
+/* Token bucket. A chunk is let through as long as the bucket is not in
+   debt, so chunks larger than the burst never block for good; the debt
+   is paid back before the next one. A rate of 0 means no limit. */
+struct bucket
+{
+  double rate;     /* bytes per second */
+  double burst;    /* most tokens saved while idle */
+  double tokens;
+  double stamp;    /* seconds, last refill */
+};
+
+/* Limit for the time of the day, from minute to the next entry. */
+struct profile_entry
+{
+  int minute;
+  double rate;
+};
+
+struct profile
+{
+  struct profile_entry entries[PROFILE_MAX];
+  int count;       /* 0 for no limit */
+};
+
+/* Bucket of a host, shared by its jobs. */
+struct host_limit
+{
+  struct bucket bucket;
+  int users;
+  double weight;   /* of its running transfers, for the scheduler */
+};
+
+/* Limits of the whole process. */
+struct bandwidth
+{
+  struct profile profile;
+  struct bucket global;
+  double host_rate;        /* 0 for no limit */
+  GHashTable *hosts;       /* host -> struct host_limit */
+};
+
+/* Share of a transfer given by share_fair. */
+struct share
+{
+  double weight;
+  double cap;      /* most it can use, 0 for no cap */
+  double rate;
+};
+
+void bucket_init(struct bucket *bucket, double rate, double now);
+void bucket_rate(struct bucket *bucket, double rate, double now);
+bool bucket_ready(struct bucket *bucket, double now);
+void bucket_spend(struct bucket *bucket, double bytes);
+double bucket_wait(const struct bucket *bucket);
+
+bool bandwidth_parse(const char *str, double *rate);
+bool profile_parse(struct profile *profile, const char *str);
+double profile_rate(const struct profile *profile, time_t now);
+
+bool bandwidth_init(struct bandwidth *bandwidth, const char *profile,
+                    const char *host_rate, double now);
+void bandwidth_free(struct bandwidth *bandwidth);
+bool bandwidth_on(const struct bandwidth *bandwidth);
+struct host_limit *bandwidth_host(struct bandwidth *bandwidth,
+                                  const char *host, double now);
+void bandwidth_unhost(struct bandwidth *bandwidth, const char *host);
+
+void share_fair(struct share *shares, int n, double total);
+
+#endif /* _BANDWIDTH_H_ */
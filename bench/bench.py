@@ -0,0 +1,404 @@
+#!/usr/bin/env python3
+# File: bench/bench.py
+#
+# Copyright (C) 2010 David Hauweele <david@hauweele.net>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+"""Benchmarks of gdownload against a local server.
+
+Every scenario runs gdownload headless a few times against a stand-in
+HTTP/1.1 server started by this script, which serves files generated
+from their name (so nothing is read from the disk) with ranges and an
+optional rate per connection. When nghttpd is installed and gdownload
+has an --http2 option, the huge and tiny scenarios also run over h2c.
+
+For each scenario the median of the runs is reported: throughput, CPU
+time, peak RSS, the 99th percentile of the data and progress callbacks
+(from -Y) and of the transfers (from -t).
+"""
+
+import argparse
+import hashlib
+import http.server
+import json
+import os
+import random
+import shutil
+import socket
+import socketserver
+import statistics
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+MiB = 1 << 20
+CHUNK = 64 * 1024
+SEED = 20100222
+
+# --- content ---------------------------------------------------------
+
+_block = random.Random(SEED).randbytes(1 * MiB + 7)
+
+
+def content(name, offset, length):
+    """Bytes of a generated file, the same for every run."""
+    key = sum(name.encode()) % len(_block)
+    out = bytearray()
+    pos = (key + offset) % len(_block)
+    while length > 0:
+        n = min(length, len(_block) - pos)
+        out += _block[pos:pos + n]
+        length -= n
+        pos = 0
+    return bytes(out)
+
+
+def digest(name, size):
+    h = hashlib.md5()
+    for off in range(0, size, 4 * MiB):
+        h.update(content(name, off, min(4 * MiB, size - off)))
+    return h.hexdigest()
+
+# --- HTTP/1.1 server -------------------------------------------------
+
+
+class Settings:
+    files = {}        # name -> size
+    rate = 0          # bytes per second and connection, 0 for none
+    tail_from = 1.    # ranges starting past this fraction of a file
+    tail_rate = 0     # are sent at this rate
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, *args):
+        pass
+
+    def do_HEAD(self):
+        self.serve(False)
+
+    def do_GET(self):
+        self.serve(True)
+
+    def serve(self, body):
+        name = self.path.lstrip("/")
+        size = Settings.files.get(name)
+        if size is None:
+            self.send_error(404)
+            return
+        first, last, code = 0, size - 1, 200
+        rng = self.headers.get("Range")
+        if rng and rng.startswith("bytes="):
+            a, _, b = rng[6:].partition("-")
+            first = int(a) if a else size - int(b)
+            last = int(b) if a and b else size - 1
+            last = min(last, size - 1)
+            if first > last:
+                self.send_response(416)
+                self.send_header("Content-Range", "bytes */%d" % size)
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+            code = 206
+        self.send_response(code)
+        self.send_header("Accept-Ranges", "bytes")
+        self.send_header("ETag", '"%s-%d"' % (name, size))
+        self.send_header("Content-Length", str(last - first + 1))
+        if code == 206:
+            self.send_header("Content-Range",
+                             "bytes %d-%d/%d" % (first, last, size))
+        self.end_headers()
+        if not body:
+            return
+        rate = Settings.rate
+        if code == 206 and Settings.tail_rate and \
+           first >= Settings.tail_from * size:
+            rate = Settings.tail_rate
+        start = time.monotonic()
+        sent = 0
+        try:
+            for off in range(first, last + 1, CHUNK):
+                n = min(CHUNK, last + 1 - off)
+                self.wfile.write(content(name, off, n))
+                sent += n
+                if rate:
+                    ahead = sent / rate - (time.monotonic() - start)
+                    if ahead > 0:
+                        time.sleep(ahead)
+        except (BrokenPipeError, ConnectionResetError):
+            # the client stopped a range which was split
+            self.close_connection = True
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+    request_queue_size = 256
+
+    def handle_error(self, request, address):
+        # split ranges and idle pooled connections are closed by the client
+        if not isinstance(sys.exc_info()[1], ConnectionError):
+            super().handle_error(request, address)
+
+
+def start_server():
+    server = Server(("127.0.0.1", 0), Handler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    return server
+
+# --- HTTP/2 server ---------------------------------------------------
+
+
+def start_h2(files, root):
+    """nghttpd serving the files from the disk over h2c, no ranges."""
+    nghttpd = shutil.which("nghttpd")
+    if not nghttpd:
+        return None, None
+    for name, size in files.items():
+        path = os.path.join(root, name)
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        with open(path, "wb") as fp:
+            for off in range(0, size, 4 * MiB):
+                fp.write(content(name, off, min(4 * MiB, size - off)))
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        port = s.getsockname()[1]
+    proc = subprocess.Popen([nghttpd, "--no-tls", "-d", root, str(port)],
+                            stdout=subprocess.DEVNULL,
+                            stderr=subprocess.DEVNULL)
+    for _ in range(50):
+        try:
+            socket.create_connection(("127.0.0.1", port), 0.1).close()
+            return proc, port
+        except OSError:
+            time.sleep(0.1)
+    proc.kill()
+    return None, None
+
+# --- scenarios -------------------------------------------------------
+
+
+def scenarios(args):
+    rnd = random.Random(SEED)
+    tiny = {"tiny/%05d" % i: rnd.randint(1024, 4096)
+            for i in range(args.tiny)}
+    return [
+        {"name": "huge", "files": {"huge.bin": args.huge * MiB},
+         "args": ["-S", "4"], "h2": True},
+        {"name": "tiny", "files": tiny, "list": True,
+         "args": ["-j", "16", "-K", "32"], "h2": True},
+        {"name": "throttled", "files": {"throttled.bin": 32 * MiB},
+         "args": ["-S", "4"], "rate": 4 * MiB},
+        {"name": "slow-tail", "files": {"tail.bin": 32 * MiB},
+         "args": ["-S", "4"], "tail_from": .75, "tail_rate": 512 * 1024},
+        {"name": "slow-disk", "files": {"disk.bin": 64 * MiB},
+         "args": ["-S", "2"], "slowdisk": True},
+    ]
+
+
+def percentile(values, q):
+    if not values:
+        return 0.
+    values = sorted(values)
+    return values[min(len(values) - 1, int(q * len(values)))]
+
+
+def run_once(args, sc, base, out):
+    """One run of gdownload, the metrics of it or None on failure."""
+    cmd = [args.gdownload, "-H", "-T", "0", "-Y",
+           "-t", os.path.join(out, "stats.json")] + sc["args"]
+    cmd += sc.get("extra", [])
+    if sc.get("list"):
+        lst = os.path.join(out, "list")
+        with open(lst, "w") as fp:
+            for name in sc["files"]:
+                fp.write("%s/%s %s\n" % (base, name,
+                                         os.path.join(out, name)))
+        cmd += ["-l", lst]
+    else:
+        name = next(iter(sc["files"]))
+        cmd += ["%s/%s" % (base, name), os.path.join(out, name)]
+    os.makedirs(os.path.join(out, "tiny"), exist_ok=True)
+
+    env = dict(os.environ)
+    if sc.get("slowdisk"):
+        env["LD_PRELOAD"] = args.slowdisk_lib
+        env["SLOWDISK_USEC"] = str(args.disk_latency)
+        env["SLOWDISK_RATE"] = str(args.disk_rate * MiB)
+    start = time.monotonic()
+    # a file, a pipe would fill up and block gdownload before wait4
+    with tempfile.TemporaryFile() as errfp:
+        proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL,
+                                stderr=errfp, env=env)
+        _, status, usage = os.wait4(proc.pid, 0)
+        wall = time.monotonic() - start
+        errfp.seek(0)
+        err = errfp.read().decode(errors="replace")
+    if os.waitstatus_to_exitcode(status) != 0:
+        sys.stderr.write("%s: gdownload failed\n%s" % (sc["name"], err))
+        return None
+
+    size = sum(sc["files"].values())
+    for name, n in sc["files"].items():
+        if os.path.getsize(os.path.join(out, name)) != n:
+            sys.stderr.write("%s: %s has the wrong size\n" % (sc["name"],
+                                                             name))
+            return None
+    if not sc.get("list"):
+        name, n = next(iter(sc["files"].items()))
+        h = hashlib.md5()
+        with open(os.path.join(out, name), "rb") as fp:
+            for block in iter(lambda: fp.read(4 * MiB), b""):
+                h.update(block)
+        if h.hexdigest() != sc["md5"]:
+            sys.stderr.write("%s: %s is corrupt\n" % (sc["name"], name))
+            return None
+
+    totals, transfers = {}, []
+    with open(os.path.join(out, "stats.json")) as fp:
+        for line in fp:
+            rec = json.loads(line)
+            if "totals" in rec and "histograms" in rec["totals"]:
+                totals = rec["totals"]["histograms"]
+            elif "kind" in rec and rec["kind"] != "probe":
+                transfers.append(rec["total"])
+    return {
+        "wall_s": wall,
+        "mib_s": size / MiB / wall,
+        "cpu_s": usage.ru_utime + usage.ru_stime,
+        "rss_kib": usage.ru_maxrss,
+        "data_p99_us": totals.get("data_ns", {}).get("p99", 0) / 1e3,
+        "progress_p99_us": totals.get("progress_ns", {}).get("p99", 0) / 1e3,
+        "transfer_p99_ms": percentile(transfers, .99) * 1e3,
+    }
+
+
+def run(args, sc, base, label):
+    results = []
+    for i in range(args.runs):
+        out = tempfile.mkdtemp(prefix="gdbench-", dir=args.tmp)
+        try:
+            r = run_once(args, sc, base, out)
+        finally:
+            shutil.rmtree(out, ignore_errors=True)
+        if r is None:
+            return None
+        results.append(r)
+    median = {k: statistics.median(r[k] for r in results)
+              for k in results[0]}
+    median["scenario"] = label
+    return median
+
+
+COLUMNS = [("scenario", 14, "%s"), ("wall_s", 8, "%.2f"),
+           ("mib_s", 9, "%.1f"), ("cpu_s", 7, "%.2f"),
+           ("rss_kib", 9, "%d"), ("data_p99_us", 12, "%.1f"),
+           ("progress_p99_us", 16, "%.1f"), ("transfer_p99_ms", 16, "%.1f")]
+
+
+def print_row(r):
+    print("%-14s" % r["scenario"] +
+          "".join("%*s" % (w, fmt % r[k]) for k, w, fmt in COLUMNS[1:]))
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("gdownload", nargs="?",
+                        default=os.path.join(here, "..", "gdownload"))
+    parser.add_argument("--runs", type=int, default=3)
+    parser.add_argument("--only", action="append",
+                        help="run this scenario only (repeatable)")
+    parser.add_argument("--huge", type=int, default=256,
+                        help="size of the huge file in MiB")
+    parser.add_argument("--tiny", type=int, default=10000,
+                        help="number of tiny files")
+    parser.add_argument("--disk-latency", type=int, default=1000,
+                        help="microseconds added to each write (slow-disk)")
+    parser.add_argument("--disk-rate", type=float, default=32,
+                        help="MiB per second of the disk (slow-disk)")
+    parser.add_argument("--slowdisk-lib",
+                        default=os.path.join(here, "slowdisk.so"))
+    parser.add_argument("--tmp", default=None,
+                        help="directory of the downloaded files")
+    parser.add_argument("--json", help="also write the results there")
+    args = parser.parse_args()
+
+    help_text = subprocess.run([args.gdownload, "-h"], capture_output=True,
+                               text=True).stderr
+    http2 = "--http2" in help_text
+
+    server = start_server()
+    base = "http://127.0.0.1:%d" % server.server_address[1]
+    results = []
+    print("# runs: %d, median of each" % args.runs)
+    print("%-14s" % "scenario" +
+          "".join("%*s" % (w, k) for k, w, _ in COLUMNS[1:]))
+    h2_root = tempfile.mkdtemp(prefix="gdbench-h2-", dir=args.tmp)
+    h2 = None
+    try:
+        for sc in scenarios(args):
+            if args.only and sc["name"] not in args.only:
+                continue
+            if sc.get("slowdisk") and not os.path.exists(args.slowdisk_lib):
+                sys.stderr.write("%s: %s not built, skipped\n"
+                                 % (sc["name"], args.slowdisk_lib))
+                continue
+            Settings.files = sc["files"]
+            Settings.rate = sc.get("rate", 0)
+            Settings.tail_from = sc.get("tail_from", 1.)
+            Settings.tail_rate = sc.get("tail_rate", 0)
+            if not sc.get("list"):
+                name, size = next(iter(sc["files"].items()))
+                sc["md5"] = digest(name, size)
+            r = run(args, sc, base, sc["name"])
+            if r:
+                print_row(r)
+                results.append(r)
+            if not sc.get("h2"):
+                continue
+            if not http2:
+                sys.stderr.write("%s/h2: gdownload has no --http2, "
+                                 "skipped\n" % sc["name"])
+                continue
+            h2, port = start_h2(sc["files"], h2_root)
+            if not h2:
+                sys.stderr.write("%s/h2: no nghttpd, skipped\n" % sc["name"])
+                continue
+            sc["extra"] = ["--http2"]
+            r = run(args, sc, "http://127.0.0.1:%d" % port,
+                    sc["name"] + "/h2")
+            h2.kill()
+            h2.wait()
+            h2 = None
+            if r:
+                print_row(r)
+                results.append(r)
+    finally:
+        if h2:
+            h2.kill()
+        shutil.rmtree(h2_root, ignore_errors=True)
+        server.shutdown()
+    if args.json:
+        with open(args.json, "w") as fp:
+            json.dump(results, fp, indent=1)
+    return 0 if results else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
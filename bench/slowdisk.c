@@ -0,0 +1,86 @@
+/* File: bench/slowdisk.c
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Preloaded by the benchmarks to make the disk slow: every write to a
+   regular file waits SLOWDISK_USEC microseconds, plus the time to write
+   its bytes at SLOWDISK_RATE bytes per second, before it is done. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+static void slow(int fd, size_t count)
+{
+  static long usec = -1;
+  static double rate;
+  struct stat st;
+  const char *env;
+
+  if(usec < 0) {
+    env  = getenv("SLOWDISK_USEC");
+    usec = env ? atol(env) : 0;
+    env  = getenv("SLOWDISK_RATE");
+    rate = env ? atof(env) : 0.;
+  }
+  if((usec > 0 || rate > 0.) && !fstat(fd,&st) && S_ISREG(st.st_mode))
+    usleep(usec + (rate > 0. ? (useconds_t)(count / rate * 1E6) : 0));
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+  static ssize_t (*next)(int, const void *, size_t);
+  if(!next)
+    next = dlsym(RTLD_NEXT,"write");
+  slow(fd,count);
+  return next(fd,buf,count);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+  static ssize_t (*next)(int, const void *, size_t, off_t);
+  if(!next)
+    next = dlsym(RTLD_NEXT,"pwrite");
+  slow(fd,count);
+  return next(fd,buf,count,offset);
+}
+
+ssize_t pwrite64(int fd, const void *buf, size_t count, off_t offset)
+{
+  static ssize_t (*next)(int, const void *, size_t, off_t);
+  if(!next)
+    next = dlsym(RTLD_NEXT,"pwrite64");
+  slow(fd,count);
+  return next(fd,buf,count,offset);
+}
+
+ssize_t pwritev(int fd, const struct iovec *iov, int cnt, off_t offset)
+{
+  static ssize_t (*next)(int, const struct iovec *, int, off_t);
+  size_t count = 0;
+  int i;
+
+  if(!next)
+    next = dlsym(RTLD_NEXT,"pwritev");
+  for(i = 0 ; i < cnt ; i++)
+    count += iov[i].iov_len;
+  slow(fd,count);
+  return next(fd,iov,cnt,offset);
+}
@@ -0,0 +1,401 @@
+/* File: cache.c
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif /* __linux__ */
+#include <glib.h>
+
+#include "cache.h"
+
+enum cache_copy { COPY_CHUNK_CACHE = 65536 };
+
+/* Content of the store on disk, for the eviction. */
+struct object
+{
+  const char *name;
+  off_t size;
+  gint64 used;
+};
+
+static void free_entry(gpointer data)
+{
+  g_free(((struct cache_entry *)data)->url);
+  g_free(data);
+}
+
+static void copy_value(char *dst, const char *src, size_t size)
+{
+  strncpy(dst,src,size - 1);
+  dst[size - 1] = '\0';
+}
+
+/* "SHA1:AB..." as "sha1-ab...", which is safe as a file name. */
+void cache_object(char *object, const char *spec)
+{
+  register int i;
+
+  for(i = 0 ; *spec && i < OBJECT_MAX - 1 ; spec++)
+    if(*spec == ':')
+      object[i++] = '-';
+    else if(isalnum((unsigned char)*spec))
+      object[i++] = tolower((unsigned char)*spec);
+  object[i] = '\0';
+}
+
+static void object_path(const struct cache *cache, char *path,
+                        const char *object)
+{
+  snprintf(path,PATH_MAX,"%s/objects/%s",cache->dir,object);
+}
+
+static void load_index(struct cache *cache)
+{
+  char path[PATH_MAX],*line = NULL,**fields;
+  struct cache_entry *entry;
+  size_t size = 0;
+  ssize_t len;
+  FILE *fp;
+
+  snprintf(path,PATH_MAX,"%s/index",cache->dir);
+  if(!(fp = fopen(path,"r")))
+    return;
+  while((len = getline(&line,&size,fp)) != -1) {
+    if(line[0] == '#')
+      continue;
+    if(len && line[len - 1] == '\n')
+      line[len - 1] = '\0';
+    /* used, size, object, etag, last modified and URL */
+    fields = g_strsplit(line,"\t",6);
+    if(g_strv_length(fields) == 6 && *fields[2] && *fields[5]) {
+      entry = g_new0(struct cache_entry,1);
+      entry->used = (gint64)atoll(fields[0]);
+      entry->size = (off_t)atoll(fields[1]);
+      copy_value(entry->object,fields[2],OBJECT_MAX);
+      copy_value(entry->etag,fields[3],VALIDATOR_MAX);
+      copy_value(entry->modified,fields[4],VALIDATOR_MAX);
+      entry->url = g_strdup(fields[5]);
+      g_hash_table_replace(cache->entries,entry->url,entry);
+    }
+    g_strfreev(fields);
+  }
+  free(line);
+  fclose(fp);
+}
+
+bool cache_open(struct cache *cache, const char *dir, off_t limit)
+{
+  char path[PATH_MAX];
+
+  memset(cache,0,sizeof(struct cache));
+  snprintf(path,PATH_MAX,"%s/objects",dir);
+  if(g_mkdir_with_parents(path,0755) == -1) {
+    fprintf(stderr,"Cannot create cache %s: %s\n",dir,strerror(errno));
+    return false;
+  }
+  cache->dir     = g_strdup(dir);
+  cache->limit   = limit;
+  cache->entries = g_hash_table_new_full(g_str_hash,g_str_equal,NULL,
+                                         free_entry);
+  load_index(cache);
+  return true;
+}
+
+void cache_close(struct cache *cache)
+{
+  if(!cache->dir)
+    return;
+  if(cache->dirty)
+    cache_save(cache);
+  g_hash_table_destroy(cache->entries);
+  g_free(cache->dir);
+  memset(cache,0,sizeof(struct cache));
+}
+
+static void save_entry(gpointer key, gpointer value, gpointer data)
+{
+  register const struct cache_entry *entry = value;
+  fprintf((FILE *)data,"%lld\t%lld\t%s\t%s\t%s\t%s\n",
+          (long long)entry->used,(long long)entry->size,entry->object,
+          entry->etag,entry->modified,entry->url);
+}
+
+/* Replaced as a whole like the journal, another run sharing the cache
+   may lose its last entries but never sees half an index. */
+bool cache_save(struct cache *cache)
+{
+  char path[PATH_MAX],tmp[PATH_MAX];
+  FILE *fp;
+
+  snprintf(path,PATH_MAX,"%s/index",cache->dir);
+  snprintf(tmp,PATH_MAX,"%s.%d.tmp",path,(int)getpid());
+  if(!(fp = fopen(tmp,"w"))) {
+    perror("Cannot write cache index");
+    return false;
+  }
+  fprintf(fp,"# gdownload cache\n");
+  g_hash_table_foreach(cache->entries,save_entry,fp);
+  if(fflush(fp) || fsync(fileno(fp)) == -1) {
+    perror("Cannot sync cache index");
+    fclose(fp);
+    unlink(tmp);
+    return false;
+  }
+  fclose(fp);
+  if(rename(tmp,path) == -1) {
+    perror("Cannot replace cache index");
+    unlink(tmp);
+    return false;
+  }
+  cache->dirty = false;
+  return true;
+}
+
+/* The entry of a URL whose content is still in the store. */
+const struct cache_entry *cache_lookup(struct cache *cache, const char *url)
+{
+  register const struct cache_entry *entry;
+  char path[PATH_MAX];
+  struct stat st;
+
+  entry = g_hash_table_lookup(cache->entries,url);
+  if(!entry)
+    return NULL;
+  object_path(cache,path,entry->object);
+  if(stat(path,&st) || st.st_size != entry->size)
+    return NULL;
+  return entry;
+}
+
+static struct cache_entry *remember(struct cache *cache, const char *url,
+                                    const char *object, off_t size)
+{
+  register struct cache_entry *entry;
+
+  entry = g_hash_table_lookup(cache->entries,url);
+  if(!entry) {
+    entry = g_new0(struct cache_entry,1);
+    entry->url = g_strdup(url);
+    g_hash_table_insert(cache->entries,entry->url,entry);
+  }
+  if(strcmp(entry->object,object)) {
+    /* other content, the validators were the ones of the old one */
+    copy_value(entry->object,object,OBJECT_MAX);
+    entry->etag[0]     = '\0';
+    entry->modified[0] = '\0';
+  }
+  entry->size = size;
+  entry->used = g_get_real_time();
+  cache->dirty = true;
+  return entry;
+}
+
+/* Share the extents of the file on filesystems which can. */
+static bool reflink(int from, int to)
+{
+#ifdef FICLONE
+  return ioctl(to,FICLONE,from) != -1;
+#else
+  return false;
+#endif /* FICLONE */
+}
+
+static bool copy(int from, int to)
+{
+  char buf[COPY_CHUNK_CACHE];
+  ssize_t n;
+
+  while((n = copy_file_range(from,NULL,to,NULL,SSIZE_MAX,0)))
+    if(n == -1 && errno != EINTR)
+      break;
+  if(!n)
+    return true;
+  if(errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+     errno != EOPNOTSUPP)
+    return false;
+  while((n = read(from,buf,COPY_CHUNK_CACHE))) {
+    if(n == -1 && errno == EINTR)
+      continue;
+    if(n == -1 || write(to,buf,n) != n)
+      return false;
+  }
+  return true;
+}
+
+/* Put the content of from at to in one step: a reflink when the
+   filesystem has them, else a hard link when the two may share their
+   inode, else a copy. */
+static bool place(const char *from, const char *to, mode_t mode, bool share)
+{
+  char tmp[PATH_MAX];
+  int in,out = -1;
+  bool ok = false;
+
+  snprintf(tmp,PATH_MAX,"%s.%d.tmp",to,(int)getpid());
+  unlink(tmp);
+  if((in = open(from,O_RDONLY)) == -1)
+    return false;
+  if((out = open(tmp,O_WRONLY | O_CREAT | O_EXCL,mode)) != -1)
+    ok = reflink(in,out);
+  if(!ok && out != -1 && share) {
+    close(out);
+    unlink(tmp);
+    out = -1;
+    ok = link(from,tmp) != -1;
+  }
+  if(!ok && out == -1)
+    out = open(tmp,O_WRONLY | O_CREAT | O_EXCL,mode);
+  if(!ok && out != -1)
+    ok = copy(in,out);
+  if(out != -1 && close(out) == -1)
+    ok = false;
+  close(in);
+  ok = ok && rename(tmp,to) != -1;
+  /* rename does nothing between two links of the same file */
+  unlink(tmp);
+  return ok;
+}
+
+/* Materialize the content at path, and remember it for the URL. */
+bool cache_fetch(struct cache *cache, const char *url, const char *object,
+                 const char *path, off_t *size)
+{
+  char from[PATH_MAX];
+  struct stat st;
+
+  object_path(cache,from,object);
+  if(stat(from,&st) || !place(from,path,(mode_t)0600,true))
+    return false;
+  remember(cache,url,object,st.st_size);
+  cache->hits++;
+  cache->served += st.st_size;
+  *size = st.st_size;
+  return true;
+}
+
+static gint compare_objects(gconstpointer a, gconstpointer b)
+{
+  register const struct object *x = a, *y = b;
+  return x->used < y->used ? -1 : x->used > y->used;
+}
+
+static gboolean evicted(gpointer key, gpointer value, gpointer data)
+{
+  return g_hash_table_contains((GHashTable *)data,
+                               ((struct cache_entry *)value)->object);
+}
+
+/* Drop the content used the longest ago until the store fits in its
+   limit. Content no entry points to goes first. */
+static void evict(struct cache *cache)
+{
+  GHashTable *latest = g_hash_table_new(g_str_hash,g_str_equal);
+  GHashTable *gone = g_hash_table_new_full(g_str_hash,g_str_equal,
+                                           g_free,NULL);
+  GArray *objects = g_array_new(false,false,sizeof(struct object));
+  char path[PATH_MAX];
+  struct cache_entry *entry,*last;
+  struct object object;
+  struct dirent *d;
+  struct stat st;
+  GHashTableIter iter;
+  off_t total = 0;
+  register guint i;
+  DIR *dir;
+
+  /* the last use of some content is the last one of its URLs */
+  g_hash_table_iter_init(&iter,cache->entries);
+  while(g_hash_table_iter_next(&iter,NULL,(gpointer *)&entry))
+    if(!(last = g_hash_table_lookup(latest,entry->object)) ||
+       last->used < entry->used)
+      g_hash_table_insert(latest,entry->object,entry);
+  snprintf(path,PATH_MAX,"%s/objects",cache->dir);
+  if((dir = opendir(path))) {
+    while((d = readdir(dir))) {
+      /* the temporary files of the runs have a dot */
+      if(strchr(d->d_name,'.'))
+        continue;
+      object_path(cache,path,d->d_name);
+      if(stat(path,&st) || !S_ISREG(st.st_mode))
+        continue;
+      last = g_hash_table_lookup(latest,d->d_name);
+      object.name = g_strdup(d->d_name);
+      object.size = st.st_size;
+      object.used = last ? last->used : 0;
+      total += st.st_size;
+      g_array_append_val(objects,object);
+    }
+    closedir(dir);
+  }
+  g_array_sort(objects,compare_objects);
+  for(i = 0 ; i < objects->len && total > cache->limit ; i++) {
+    object = g_array_index(objects,struct object,i);
+    object_path(cache,path,object.name);
+    if(unlink(path) == -1)
+      continue;
+    total -= object.size;
+    cache->evicted++;
+    g_hash_table_add(gone,g_strdup(object.name));
+  }
+  if(g_hash_table_foreach_remove(cache->entries,evicted,gone))
+    cache->dirty = true;
+  for(i = 0 ; i < objects->len ; i++)
+    g_free((char *)g_array_index(objects,struct object,i).name);
+  g_array_free(objects,true);
+  g_hash_table_destroy(gone);
+  g_hash_table_destroy(latest);
+}
+
+/* Keep a downloaded file under its hash, the content is only stored
+   once whatever the URLs it came from. */
+bool cache_store(struct cache *cache, const char *url, const char *path,
+                 const char *object, const char *etag,
+                 const char *modified)
+{
+  register struct cache_entry *entry;
+  char to[PATH_MAX];
+  struct stat st;
+
+  object_path(cache,to,object);
+  if(stat(to,&st)) {
+    /* never linked, the output may be edited in place */
+    if(!place(path,to,(mode_t)0644,false) || stat(to,&st)) {
+      fprintf(stderr,"Cannot store %s in the cache: %s\n",path,
+              strerror(errno));
+      return false;
+    }
+    cache->stored++;
+  }
+  entry = remember(cache,url,object,st.st_size);
+  copy_value(entry->etag,etag,VALIDATOR_MAX);
+  copy_value(entry->modified,modified,VALIDATOR_MAX);
+  if(cache->limit)
+    evict(cache);
+  return cache_save(cache);
+}
@@ -0,0 +1,69 @@
+/* File: cache.h
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <glib.h>
+
+#include "journal.h"
+
+enum cache_max { OBJECT_MAX = 144 };   /* "sha512-" and its hex digest */
+
+/* What the last download of a URL gave. */
+struct cache_entry
+{
+  char *url;
+  char object[OBJECT_MAX];   /* name of the content in the store */
+  char etag[VALIDATOR_MAX];
+  char modified[VALIDATOR_MAX];
+  off_t size;
+  gint64 used;               /* last stored or served in microseconds
+                                since the epoch, for the LRU */
+};
+
+/* Files downloaded before, kept in a directory shared by the runs. The
+   content is stored once under its hash in objects/ and the index maps
+   each URL to its content and the validators it came with. */
+struct cache
+{
+  char *dir;
+  off_t limit;            /* bytes of the store, 0 for no limit */
+  GHashTable *entries;    /* by URL */
+  bool dirty;             /* the index changed since it was saved */
+  long hits;              /* files served from the store */
+  long revalidated;       /* of them after a 304 */
+  long misses;
+  long stored;
+  long evicted;
+  off_t served;           /* bytes of the hits */
+};
+
+bool cache_open(struct cache *cache, const char *dir, off_t limit);
+void cache_close(struct cache *cache);
+void cache_object(char *object, const char *spec);
+const struct cache_entry *cache_lookup(struct cache *cache, const char *url);
+bool cache_fetch(struct cache *cache, const char *url, const char *object,
+                 const char *path, off_t *size);
+bool cache_store(struct cache *cache, const char *url, const char *path,
+                 const char *object, const char *etag,
+                 const char *modified);
+bool cache_save(struct cache *cache);
+
+#endif /* _CACHE_H_ */
@@ -0,0 +1,209 @@
+/* File: digest.c
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "digest.h"
+
+#define DIGEST_T(ptr) ((struct digest *)ptr)
+
+struct algorithm
+{
+  const char *name;
+  GChecksumType type;
+};
+
+/* Compute only, nothing to compare: the result is all the caller wants
+   and match stays false. */
+void digest_init(struct digest *digest, GChecksumType type)
+{
+  memset(digest,0,sizeof(struct digest));
+  digest->fd   = -1;
+  digest->type = type;
+}
+
+bool digest_parse(struct digest *digest, const char *spec)
+{
+  const struct algorithm algorithms[] =
+    {
+      { "md5", G_CHECKSUM_MD5 },
+      { "sha1", G_CHECKSUM_SHA1 },
+      { "sha256", G_CHECKSUM_SHA256 },
+      { "sha512", G_CHECKSUM_SHA512 },
+      { NULL, 0 }
+    };
+  register const struct algorithm *a;
+  register const char *hex = strchr(spec,':');
+  register int i;
+
+  digest_init(digest,0);
+  if(!hex)
+    return false;
+  for(a = algorithms ; a->name ; a++)
+    if(strlen(a->name) == (size_t)(hex - spec) &&
+       !strncasecmp(spec,a->name,hex - spec))
+      break;
+  if(!a->name)
+    return false;
+  digest->type = a->type;
+  for(hex++, i = 0 ; hex[i] ; i++) {
+    if(!isxdigit((unsigned char)hex[i]) || i == DIGEST_HEX_MAX - 1)
+      return false;
+    digest->expected[i] = tolower((unsigned char)hex[i]);
+  }
+  digest->expected[i] = '\0';
+  return i == g_checksum_type_get_length(a->type) * 2;
+}
+
+static gpointer proceed_digest(gpointer data)
+{
+  register struct digest *digest = DIGEST_T(data);
+  GChecksum *sum = g_checksum_new(digest->type);
+  char *buf = malloc(DIGEST_BLOCK);
+  off_t done = 0,avail;
+  ssize_t rd = 0;
+
+  g_mutex_lock(&digest->lock);
+  while(buf) {
+    while(digest->avail <= done && !digest->end && !digest->stop)
+      g_cond_wait(&digest->cond,&digest->lock);
+    if(digest->stop || (digest->end && digest->avail <= done))
+      break;
+    avail = digest->avail;
+    g_mutex_unlock(&digest->lock);
+
+    for( ; done < avail ; done += rd) {
+      rd = pread(digest->fd,buf,
+                 avail - done < DIGEST_BLOCK ? avail - done : DIGEST_BLOCK,
+                 done);
+      if(rd == -1 && errno == EINTR) {
+        rd = 0;
+        continue;
+      }
+      if(rd <= 0)
+        break;
+      g_checksum_update(sum,(const guchar *)buf,rd);
+    }
+
+    g_mutex_lock(&digest->lock);
+    digest->done = done;
+    if(rd <= 0 && done < avail) {
+      perror("Cannot read back output file");
+      break;
+    }
+  }
+  if(!digest->stop && buf) {
+    strncpy(digest->result,g_checksum_get_string(sum),DIGEST_HEX_MAX - 1);
+    digest->match = digest->done == digest->avail && *digest->expected &&
+                    !strcmp(digest->result,digest->expected);
+  }
+  if(!digest->stop)
+    g_idle_add(digest->verified,digest->data);
+  g_mutex_unlock(&digest->lock);
+  g_checksum_free(sum);
+  free(buf);
+  return NULL;
+}
+
+bool digest_start(struct digest *digest, const char *path,
+                  GSourceFunc verified, gpointer data)
+{
+  digest->fd = open(path,O_RDONLY);
+  if(digest->fd == -1)
+    return false;
+  posix_fadvise(digest->fd,0,0,POSIX_FADV_SEQUENTIAL);
+  digest->verified = verified;
+  digest->data     = data;
+  g_mutex_init(&digest->lock);
+  g_cond_init(&digest->cond);
+  digest->thread = g_thread_new("digest",proceed_digest,digest);
+  return true;
+}
+
+/* Publish the length of the prefix of the file now on disk. */
+void digest_feed(struct digest *digest, off_t avail)
+{
+  g_mutex_lock(&digest->lock);
+  if(avail > digest->avail) {
+    digest->avail = avail;
+    g_cond_signal(&digest->cond);
+  }
+  g_mutex_unlock(&digest->lock);
+}
+
+void digest_end(struct digest *digest, off_t length)
+{
+  g_mutex_lock(&digest->lock);
+  digest->avail = length;
+  digest->end   = true;
+  g_cond_signal(&digest->cond);
+  g_mutex_unlock(&digest->lock);
+}
+
+void digest_free(struct digest *digest)
+{
+  if(digest->fd == -1)
+    return;
+  g_mutex_lock(&digest->lock);
+  digest->stop = true;
+  g_cond_signal(&digest->cond);
+  g_mutex_unlock(&digest->lock);
+  g_thread_join(digest->thread);
+  g_mutex_clear(&digest->lock);
+  g_cond_clear(&digest->cond);
+  close(digest->fd);
+  digest->fd = -1;
+}
+
+/* Hash a range of a file against "<type>:<hex digest>" right away, for
+   the pieces of a metalink which are small enough to stay in the page
+   cache since they were written. */
+bool digest_check(const char *spec, int fd, off_t offset, off_t length)
+{
+  struct digest digest;
+  GChecksum *sum;
+  char *buf;
+  ssize_t rd = 0;
+  bool match;
+
+  if(!digest_parse(&digest,spec) || !(buf = malloc(DIGEST_BLOCK)))
+    return false;
+  sum = g_checksum_new(digest.type);
+  for( ; length > 0 ; offset += rd, length -= rd) {
+    rd = pread(fd,buf,length < DIGEST_BLOCK ? length : DIGEST_BLOCK,offset);
+    if(rd == -1 && errno == EINTR) {
+      rd = 0;
+      continue;
+    }
+    if(rd <= 0)
+      break;
+    g_checksum_update(sum,(const guchar *)buf,rd);
+  }
+  match = !length && !strcmp(g_checksum_get_string(sum),digest.expected);
+  g_checksum_free(sum);
+  free(buf);
+  return match;
+}
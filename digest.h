@@ -0,0 +1,59 @@
+/* File: digest.h
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _DIGEST_H_
+#define _DIGEST_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <glib.h>
+
+enum digest_max { DIGEST_HEX_MAX = 129,
+                  DIGEST_BLOCK = 1048576 };
+
+/* Hashing stage. A thread reads the output back as soon as a prefix of
+   it is written, from the page cache most of the time, so the receive
+   path never waits for the hash. The verified callback is scheduled on
+   the main loop once the whole file went through. */
+struct digest
+{
+  GChecksumType type;
+  char expected[DIGEST_HEX_MAX];
+  char result[DIGEST_HEX_MAX];
+  bool match;
+  int fd;
+  off_t done;      /* bytes hashed */
+  off_t avail;     /* bytes written from the beginning of the file */
+  bool end;        /* avail is the final length */
+  bool stop;
+  GSourceFunc verified;
+  gpointer data;
+  GThread *thread;
+  GMutex lock;
+  GCond cond;
+};
+
+void digest_init(struct digest *digest, GChecksumType type);
+bool digest_parse(struct digest *digest, const char *spec);
+bool digest_start(struct digest *digest, const char *path,
+                  GSourceFunc verified, gpointer data);
+void digest_feed(struct digest *digest, off_t avail);
+void digest_end(struct digest *digest, off_t length);
+void digest_free(struct digest *digest);
+bool digest_check(const char *spec, int fd, off_t offset, off_t length);
+
+#endif /* _DIGEST_H_ */
@@ -0,0 +1,258 @@
+/* File: engine.c
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <glib.h>
+#include <curl/curl.h>
+
+#include "engine.h"
+
+#define ENGINE_T(ptr) ((struct engine *)ptr)
+
+struct sock
+{
+  GIOChannel *channel;
+  guint watch;
+};
+
+/* Report finished transfers. */
+static void check_info(struct engine *engine)
+{
+  CURLMsg *msg;
+  CURLcode result;
+  CURL *curl;
+  void *data;
+  long connects;
+  int left;
+
+  while((msg = curl_multi_info_read(engine->multi,&left))) {
+    if(msg->msg != CURLMSG_DONE)
+      continue;
+    curl   = msg->easy_handle;
+    result = msg->data.result;
+    curl_easy_getinfo(curl,CURLINFO_PRIVATE,(char **)&data);
+    if(result == CURLE_OK) {
+      curl_easy_getinfo(curl,CURLINFO_NUM_CONNECTS,&connects);
+      engine->transfers++;
+      engine->connects += connects;
+      if(!connects)
+        engine->reused++;
+    }
+    curl_multi_remove_handle(engine->multi,curl);
+    engine->done(data,curl,result);
+  }
+}
+
+static gboolean callback_event(GIOChannel *channel, GIOCondition cond,
+                               gpointer data)
+{
+  int action = 0;
+  if(cond & (G_IO_IN | G_IO_PRI))
+    action |= CURL_CSELECT_IN;
+  if(cond & G_IO_OUT)
+    action |= CURL_CSELECT_OUT;
+  if(cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+    action |= CURL_CSELECT_ERR;
+  curl_multi_socket_action(ENGINE_T(data)->multi,
+                           g_io_channel_unix_get_fd(channel),
+                           action,&ENGINE_T(data)->running);
+  check_info(ENGINE_T(data));
+  return true;
+}
+
+static gboolean callback_timeout(gpointer data)
+{
+  ENGINE_T(data)->timer = 0;
+  curl_multi_socket_action(ENGINE_T(data)->multi,CURL_SOCKET_TIMEOUT,0,
+                           &ENGINE_T(data)->running);
+  check_info(ENGINE_T(data));
+  return false;
+}
+
+static int callback_timer(CURLM *multi, long timeout_ms, void *userp)
+{
+  if(ENGINE_T(userp)->timer)
+    g_source_remove(ENGINE_T(userp)->timer);
+  ENGINE_T(userp)->timer = 0;
+  if(timeout_ms >= 0)
+    ENGINE_T(userp)->timer = g_timeout_add(timeout_ms,callback_timeout,userp);
+  return 0;
+}
+
+static int callback_socket(CURL *curl, curl_socket_t s, int what,
+                           void *userp, void *socketp)
+{
+  register struct sock *sock = socketp;
+  GIOCondition cond = 0;
+
+  if(what == CURL_POLL_REMOVE) {
+    if(sock) {
+      g_source_remove(sock->watch);
+      g_io_channel_unref(sock->channel);
+      free(sock);
+    }
+    return 0;
+  }
+
+  if(!sock) {
+    sock = malloc(sizeof(struct sock));
+    if(!sock) {
+      fprintf(stderr,"Out of memory\n");
+      return -1;
+    }
+    sock->channel = g_io_channel_unix_new(s);
+    sock->watch   = 0;
+    curl_multi_assign(ENGINE_T(userp)->multi,s,sock);
+  }
+  if(sock->watch)
+    g_source_remove(sock->watch);
+  if(what & CURL_POLL_IN)
+    cond |= G_IO_IN | G_IO_PRI;
+  if(what & CURL_POLL_OUT)
+    cond |= G_IO_OUT;
+  sock->watch = g_io_add_watch(sock->channel,cond | G_IO_ERR | G_IO_HUP,
+                               callback_event,userp);
+  return 0;
+}
+
+/* With streams the transfers to a host are multiplexed, at most streams
+   of them on one connection. The comma separated h2c hosts are known to
+   speak HTTP/2 over plain http. */
+bool engine_init(struct engine *engine, engine_done_t done, long pool,
+                 long streams, const char *h2c)
+{
+  engine->timer     = 0;
+  engine->running   = 0;
+  engine->done      = done;
+  engine->transfers = 0;
+  engine->connects  = 0;
+  engine->reused    = 0;
+  engine->multiplex = streams > 0;
+  engine->h2c       = h2c ? g_strsplit(h2c,",",0) : NULL;
+  engine->multi     = curl_multi_init();
+  engine->share     = curl_share_init();
+  if(!engine->multi || !engine->share) {
+    curl_multi_cleanup(engine->multi);
+    curl_share_cleanup(engine->share);
+    return false;
+  }
+  /* everything runs from the main loop, no lock is needed */
+  curl_share_setopt(engine->share,CURLSHOPT_SHARE,CURL_LOCK_DATA_DNS);
+  curl_share_setopt(engine->share,CURLSHOPT_SHARE,CURL_LOCK_DATA_SSL_SESSION);
+  curl_share_setopt(engine->share,CURLSHOPT_SHARE,CURL_LOCK_DATA_COOKIE);
+  /* the connections themselves are pooled by the multi handle */
+  if(pool > 0)
+    curl_multi_setopt(engine->multi,CURLMOPT_MAXCONNECTS,pool);
+  if(engine->multiplex) {
+    curl_multi_setopt(engine->multi,CURLMOPT_PIPELINING,CURLPIPE_MULTIPLEX);
+#if LIBCURL_VERSION_NUM >= 0x074300
+    curl_multi_setopt(engine->multi,CURLMOPT_MAX_CONCURRENT_STREAMS,streams);
+#endif
+  }
+  curl_multi_setopt(engine->multi,CURLMOPT_SOCKETFUNCTION,callback_socket);
+  curl_multi_setopt(engine->multi,CURLMOPT_SOCKETDATA,engine);
+  curl_multi_setopt(engine->multi,CURLMOPT_TIMERFUNCTION,callback_timer);
+  curl_multi_setopt(engine->multi,CURLMOPT_TIMERDATA,engine);
+  return true;
+}
+
+void engine_free(struct engine *engine)
+{
+  if(engine->timer)
+    g_source_remove(engine->timer);
+  engine->timer = 0;
+  /* the remaining sockets are removed through callback_socket */
+  curl_multi_cleanup(engine->multi);
+  engine->multi = NULL;
+  /* no easy handle may use it anymore */
+  curl_share_cleanup(engine->share);
+  engine->share = NULL;
+  g_strfreev(engine->h2c);
+  engine->h2c = NULL;
+}
+
+/* Whether the host of an http URL is one of the h2c hosts. */
+static bool prior_knowledge(struct engine *engine, const char *url)
+{
+  register gchar **h;
+  register bool found = false;
+  CURLU *u;
+  char *host = NULL;
+
+  if(!engine->h2c)
+    return false;
+  u = curl_url();
+  if(u && !curl_url_set(u,CURLUPART_URL,url,0) &&
+     !curl_url_get(u,CURLUPART_HOST,&host,0))
+    for(h = engine->h2c ; *h && !found ; h++)
+      found = !strcasecmp(*h,host);
+  curl_free(host);
+  curl_url_cleanup(u);
+  return found;
+}
+
+/* A new transfer waits for a connection it can share rather than
+   opening its own. Plain http goes straight to h2c only for the hosts
+   said to speak it, the others are asked to upgrade and may stay on
+   HTTP/1.1. */
+void engine_http2(struct engine *engine, CURL *curl, const char *url)
+{
+  register long version = CURL_HTTP_VERSION_2TLS;
+
+  if(!engine->multiplex)
+    return;
+  if(!g_ascii_strncasecmp(url,"http:",5))
+    version = prior_knowledge(engine,url) ?
+              CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE : CURL_HTTP_VERSION_2_0;
+  curl_easy_setopt(curl,CURLOPT_PIPEWAIT,1L);
+  curl_easy_setopt(curl,CURLOPT_HTTP_VERSION,version);
+}
+
+void engine_add(struct engine *engine, CURL *curl, void *data)
+{
+  curl_easy_setopt(curl,CURLOPT_PRIVATE,data);
+  curl_easy_setopt(curl,CURLOPT_SHARE,engine->share);
+  /* this will set the timer and start the transfer from the main loop */
+  curl_multi_add_handle(engine->multi,curl);
+}
+
+void engine_remove(struct engine *engine, CURL *curl)
+{
+  curl_multi_remove_handle(engine->multi,curl);
+}
+
+/* The data of a transfer moved while it runs. */
+void engine_rebind(struct engine *engine, CURL *curl, void *data)
+{
+  curl_easy_setopt(curl,CURLOPT_PRIVATE,data);
+}
+
+/* Valid until the handle is reset or added again. */
+void engine_timing(CURL *curl, struct timing *timing)
+{
+  curl_easy_getinfo(curl,CURLINFO_NAMELOOKUP_TIME,&timing->namelookup);
+  curl_easy_getinfo(curl,CURLINFO_CONNECT_TIME,&timing->connect);
+  curl_easy_getinfo(curl,CURLINFO_APPCONNECT_TIME,&timing->appconnect);
+  curl_easy_getinfo(curl,CURLINFO_STARTTRANSFER_TIME,&timing->starttransfer);
+  curl_easy_getinfo(curl,CURLINFO_TOTAL_TIME,&timing->total);
+  curl_easy_getinfo(curl,CURLINFO_SIZE_DOWNLOAD_T,&timing->size);
+  curl_easy_getinfo(curl,CURLINFO_SPEED_DOWNLOAD_T,&timing->speed);
+  curl_easy_getinfo(curl,CURLINFO_REDIRECT_COUNT,&timing->redirects);
+  curl_easy_getinfo(curl,CURLINFO_NUM_CONNECTS,&timing->connects);
+}
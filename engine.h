@@ -0,0 +1,73 @@
+/* File: engine.h
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _ENGINE_H_
+#define _ENGINE_H_
+
+#include <stdbool.h>
+#include <glib.h>
+#include <curl/curl.h>
+
+/* Called from the main loop once a transfer is over. The easy handle
+   is already removed from the engine and may be added again. */
+typedef void (*engine_done_t)(void *data, CURL *curl, CURLcode result);
+
+/* Where the time of a transfer went, as curl measured it. The times are
+   in seconds from the start of the transfer, each one includes the
+   previous ones. */
+struct timing
+{
+  double namelookup;
+  double connect;
+  double appconnect;    /* TLS handshake, 0 without */
+  double starttransfer; /* first byte of the response */
+  double total;
+  curl_off_t size;      /* bytes received */
+  curl_off_t speed;     /* bytes per second */
+  long redirects;
+  long connects;        /* new connections, 0 when one was reused */
+};
+
+/* Event driven transfer engine. The sockets and the timer of a curl
+   multi handle are watched from the GLib main loop so that any number of
+   transfers run in the GUI thread without blocking it. Every transfer
+   also goes through one share handle, so the DNS cache, the TLS
+   sessions and the cookies outlive the easy handles. */
+struct engine
+{
+  CURLM *multi;
+  CURLSH *share;
+  guint timer;
+  int running;
+  engine_done_t done;
+  long transfers;   /* over without error */
+  long connects;    /* connections they opened */
+  long reused;      /* transfers without a new connection */
+  bool multiplex;   /* transfers to a host share an HTTP/2 connection */
+  gchar **h2c;      /* hosts spoken to in HTTP/2 over plain http */
+};
+
+bool engine_init(struct engine *engine, engine_done_t done, long pool,
+                 long streams, const char *h2c);
+void engine_http2(struct engine *engine, CURL *curl, const char *url);
+void engine_free(struct engine *engine);
+void engine_add(struct engine *engine, CURL *curl, void *data);
+void engine_remove(struct engine *engine, CURL *curl);
+void engine_rebind(struct engine *engine, CURL *curl, void *data);
+void engine_timing(CURL *curl, struct timing *timing);
+
+#endif /* _ENGINE_H_ */
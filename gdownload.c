@@ -16,24 +16,45 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <getopt.h>
 #include <string.h>
+#include <strings.h>
 #include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/time.h>
 #include <time.h>
 #include <math.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <glib.h>
 #include <gtk/gtk.h>
 #include <curl/curl.h>
 
+#include <glib-unix.h>
+
+#include "journal.h"
+#include "engine.h"
+#include "progress.h"
+#include "rate.h"
+#include "writer.h"
+#include "digest.h"
+#include "queue.h"
+#include "server.h"
+#include "bandwidth.h"
+#include "metalink.h"
+#include "histogram.h"
+#include "zsync.h"
+#include "multipart.h"
+#include "cache.h"
+
 #define VERSION "0.1-git"
 #define PACKAGE "gdownload"
 #ifndef ARCH
@@ -51,11 +72,54 @@
 
 enum defopt  { WIDTH_DEF = 0,
                HEIGHT_DEF = 0,
+               LIST_WIDTH_DEF = 640,
+               LIST_HEIGHT_DEF = 320,
                POSITION_DEF = GTK_WIN_POS_CENTER };
-enum max     { STRLEN_MAX = 1024 };
-enum delta   { STATUS_DELTA = 100 };
+enum max     { STRLEN_MAX = 1024,
+               RANGELEN_MAX = 64 };
+enum delta   { STATUS_DELTA = 100,
+               FRAME_DELTA = 40,
+               REPORT_DELTA = 1000,
+               SCHED_DELTA = 250,
+               CHECK_DELTA = 50,
+               TEE_DELTA = 250,
+               RETRY_DELTA = 1000,
+               RETRY_DELTA_MAX = 60000 };
+enum state   { STATE_WAIT,
+               STATE_RUN,
+               STATE_VERIFY,
+               STATE_DONE,
+               STATE_FAIL,
+               STATE_ABORT };
+enum column  { COL_JOB,
+               COL_FILE,
+               COL_PCT,
+               COL_SIZE,
+               COL_SPEED,
+               COL_ETA,
+               COL_STATE,
+               COL_N };
+enum seg     { SEGMENT_MIN = 65536,
+               JOURNAL_DELTA = 5000,
+               BUFFER_DEF = 4096,
+               BUFFER_MIN = 64,
+               PARALLEL_DEF = 4,
+               RETRIES_DEF = 5,
+               STALL_DEF = 60,
+               STREAMS_DEF = 100,
+               DONE_ROWS_MAX = 1000,
+               PRIORITY_MAX = 8,
+               PIECES_PER_CONN = 4,
+               STEAL_MIN = 262144,
+               MULTIRANGE_MAX = 24,
+               TEE_CHUNK = 65536 };
 
 #define PCT_EPS .01
+#define RATE_WINDOW 5.
+#define SHARE_MIN 4096.     /* bytes per second */
+#define DEMAND_RATIO .8     /* of its share a transfer must use */
+#define DEMAND_HEADROOM 1.5 /* over what it used when it did not */
+#define DEMAND_DECAY .5     /* most a share loses at once */
 
 #ifndef timersub
 # define timersub(a, b, result) \
@@ -70,6 +134,9 @@ if ((result)->tv_usec < 0) { \
 #endif /* timersub */
 
 #define CTX_T(ptr) ((struct ctx *)ptr)
+#define OPTS_T(ptr) ((struct opts *)ptr)
+#define JOB_T(ptr) ((struct job *)ptr)
+#define SEG_T(ptr) ((struct segment *)ptr)
 
 struct unit
 {
@@ -91,48 +158,269 @@ struct s_list
   struct s_list *next;
 };
 
-struct ctx
+/* A server of the file and how fast it has been so far. */
+struct mirror
 {
-  const char *name;
   const char *url;
-  const char *output;
+  struct rate rate;
+  double received;   /* bytes */
+  int active;        /* transfers on it */
+  bool dropped;
+};
+
+/* Where the time of the receive path goes, with -Y. The times are in
+   nanoseconds. */
+struct hot
+{
+  struct histogram data;     /* in callback_data */
+  struct histogram bytes;    /* given to one call of callback_data */
+  struct histogram gap;      /* between two calls on a transfer */
+  struct histogram progress; /* in callback_progress */
+  struct histogram stall;    /* paused for room in the writer stage */
+};
+
+/* Small holes asked in a single request, the parts of the answer are
+   written as they come without the writer stage. */
+struct batch
+{
+  struct range parts[MULTIRANGE_MAX];
+  off_t got[MULTIRANGE_MAX];   /* bytes of each part received */
+  int nparts;
+  bool multipart;              /* the answer is one of byte ranges */
+  struct multipart mp;
+};
+
+struct segment
+{
+  struct job *job;
+  CURL *curl;
+  struct mirror *mirror; /* NULL for the URL of the job */
+  off_t begin;    /* first byte not yet in the journal */
+  off_t offset;   /* next byte to write */
+  off_t mark;     /* offset when the writer stage was last marked */
+  off_t end;      /* last byte of the range, -1 for a single stream */
+  off_t from;     /* first byte of the range */
+  bool checked;   /* response code checked against the range */
+  bool cut;       /* the end was taken, the transfer stops there */
+  bool paused;    /* waiting for room in the writer stage */
+  bool over;
+  bool checking;  /* waiting for the writer before the hash of its pieces */
+  uint64_t pushed;       /* writer position at the end of the transfer */
+  const char *reject;    /* why its mirror cannot be trusted */
+  double dlnow;
+  double carry;          /* bytes before the transfer was suspended */
+  double connected;      /* time of the connection */
+  struct bucket bucket;  /* share given by the scheduler */
+  guint throttle;        /* paused until its buckets are paid back */
+  bool starved;          /* held back by its own share */
+  off_t sched_mark;      /* offset at the last schedule */
+  uint64_t last_data;    /* end of the last call of callback_data */
+  uint64_t paused_at;
+  struct batch *batch;   /* NULL for a single range */
+  off_t teed;            /* offset taken at the last tee */
+  int failures;          /* in a row without receiving anything */
+  double retry_at;       /* connected again then, 0 when not waiting */
+};
+
+/* Settings of a download. The ones of the command line are the
+   defaults, the ones forwarded by another instance come with their
+   record. */
+struct opts
+{
   const char *referer;
   const char *http_crd;
   const char *proxy;
   const char *proxy_crd;
   const char *intf;
+  const char *checksum;
+  const char *limit;
+  const char *metalink;
+  const char *zsync;
+  const char *seed;
   char *user_agent;
+  struct s_list *mirrors;
   struct s_list *cookies;
   struct s_list *cks_path;
-  struct s_list *cmd_args;
+  struct s_list *args;
   int dns;
+  bool verbose;
+  bool resume;
+  bool prealloc;
+  int buffer;
+  int segments;
+  int priority;
+  int retries;
+  int stall;            /* seconds without data before a transfer fails */
+};
+
+/* One download, from a record of the queue to its output file. */
+struct job
+{
+  struct ctx *ctx;
+  const struct opts *opts;
+  struct record *record;
+  const char *url;
+  const char *checksum; /* of the options or else of the metalink */
+  enum state state;
+  CURLcode err;
+  struct progress snapshot;
+  struct rate rate;
+  struct timeval dl_begin;
+  int o_desc;
+  char path[STRLEN_MAX];
+  char jrn_path[STRLEN_MAX];
+  char title[STRLEN_MAX];
+  off_t length;
+  bool accept_ranges;
+  bool changed;
+  char etag[VALIDATOR_MAX];
+  char modified[VALIDATOR_MAX];
+  struct curl_slist *headers;
+  struct journal journal;
+  bool journal_on;
+  bool writer_on;
+  struct writer writer;
+  uint64_t mark;
+  struct digest digest;
+  bool digest_stream;   /* hashed while the file is written */
+  bool mismatch;
+  guint jrn_timer;
+  struct metalink metalink;
+  struct mirror *mirrors; /* NULL with a single server */
+  int nmirrors;
+  int alive;            /* mirrors not dropped */
+  off_t piece;          /* size of the ranges, 0 for one per connection */
+  bool hashed;          /* ranges checked against the metalink pieces */
+  guint check_timer;
+  int checking;
+  struct zsync zsync;   /* blocks of the file, none without -Z */
+  char seed_path[STRLEN_MAX];
+  bool seed_aside;      /* the old output was moved there */
+  int seed_fd;
+  GThread *scanner;
+  volatile bool scan_stop;
+  bool scanned;
+  GArray *found;        /* ranges copied from the seed */
+  off_t saved;          /* bytes of them */
+  off_t fetched;        /* bytes received */
+  bool multirange;      /* the small holes are asked together */
+  char object[OBJECT_MAX]; /* content of the URL in the cache */
+  struct curl_slist *conditions; /* the probe asks if it changed since */
+  bool served;          /* from the cache */
+  struct job *leader;   /* whose transfer this one follows, NULL for its
+                           own */
+  struct job *followers;
+  struct job *next_follower;
+  struct journal disk;  /* ranges on disk, for the followers */
+  struct journal copied;  /* ranges a follower took from its leader */
+  uint64_t tee_mark;    /* writer position at the last tee */
+  int tee_fd;           /* the output read back for the followers */
+  guint tee_timer;
+  int retries;          /* transfers tried again */
+  double lost;          /* seconds stalled or waiting to try them */
+  guint retry_timer;
+  double retry_next;    /* when it fires */
+  struct segment probe;
+  struct segment *segs;
+  int nsegs;
+  int capacity;
+  int running;          /* segments not over */
+  int conns;            /* most transfers at once */
+  int active;           /* transfers now */
+  bool finished;
+  bool suspended;       /* to let a job of higher priority run */
+  double weight;        /* share of the bandwidth, from the priority */
+  struct bucket bucket; /* limit of the job */
+  struct host_limit *host;
+  GtkTreeIter iter;     /* row in the list */
+  bool row;
+  int shown_pct;
+  double shown_now;
+  double shown_speed;
+  struct hot hot;
+  struct job *next;
+};
+
+struct ctx
+{
+  const char *name;
+  const char *url;
+  const char *output;
+  const char *input;
+  struct opts opts;
+  struct s_list *cmd_args;
   gint width;
   gint height;
-  bool verbose;
   bool status;
   bool progress;
   bool interactive;
   bool fixed;
   bool close_on_finish;
   bool binary;
+  bool headless;
+  bool single;
+  int report_fd;
+  int interval;
+  int parallel;
+  int per_host;
+  int pool;
+  bool http2;
+  int streams;
+  const char *h2c;
+  const char *max_rate;
+  const char *host_rate;
+  const char *stats_path;
+  bool histograms;
+  const char *cache_dir;
+  const char *cache_size;
   struct unit unit;
 
   int timer;
-  double dlnow;
-  double dltot;
-  struct timeval dl_begin;
+  int frames;
+  GMainLoop *loop;
+  FILE *report;
+  FILE *stats;          /* timing of the transfers, NULL without */
+  struct timing sum;    /* of the transfers over */
+  long stats_count;
+  long stats_failed;
+  long stats_reused;
+  struct hot hot;       /* of the jobs over */
   gdouble pct;
-  int o_desc;
-  CURL *curl;
-  GThread *curl_thread;
+  struct engine engine;
+  struct queue queue;
+  struct server server;
+  struct bandwidth bandwidth;
+  struct cache cache;   /* none without a directory */
+  bool shaping;         /* some limit is set */
+  guint sched;
+  double sched_stamp;
+  guint filler;
+  struct job *jobs;
+  int njobs;
+  int nsuspended;
+  int nfollowing;       /* jobs following another one */
+  long joined;          /* requests which took part in another one */
+  long retries;         /* of the jobs over */
+  double lost;
+  int nfailed;
+  double done_now;      /* bytes of the jobs already over */
+  double done_tot;
+  bool stopped;
   bool abort_transfer;
+  GtkWidget *window;
+  bool list;
+  GtkListStore *store;
+  GtkWidget *view;
+  GtkTreeIter done_rows[DONE_ROWS_MAX];   /* oldest first */
+  int done_first;
+  int done_count;
   GtkWidget *gui_progress;
   GtkWidget *gui_status;
   char *pct_progress;
   char *speed_status;
   char *dlnow_status;
   char *dltot_status;
-  char *title;
+  char *eta_status;
   char *txt_status;
 };
 
@@ -142,12 +430,18 @@ struct prefix
   double value;
 };
 
-static struct ctx *global_ctx; /* we just use that for signal handler */
-/* any other way ? */
+static const char *states[] = { "waiting", "running", "verifying", "done",
+                                "failed", "aborted" };
 
 /* TODO: use a header */
-static void user_agent(struct ctx *ctx);
-static void unload(const struct ctx *ctx);
+static void user_agent(struct opts *opts);
+static size_t callback_data(void *buffer, size_t size,
+                            size_t nmemb, void *userp);
+static int callback_progress(void *clientp, double dltotal,
+                             double dlnow, double ultotal,
+                             double ulnow);
+static gboolean callback_timer(gpointer data);
+static gboolean callback_throttle(gpointer data);
 
 static void *_xmalloc(size_t size, unsigned int line)
 {
@@ -160,30 +454,46 @@ static void *_xmalloc(size_t size, unsigned int line)
 }
 #define xmalloc(size) _xmalloc(size,__LINE__)
 
+static void init_opts(struct opts *opts)
+{
+  memset(opts,0,sizeof(struct opts));
+  opts->dns  = CURL_IPRESOLVE_WHATEVER;
+  opts->segments = 1;
+  opts->buffer = BUFFER_DEF;
+  opts->prealloc = true;
+  opts->retries = RETRIES_DEF;
+  opts->stall = STALL_DEF;
+  opts->user_agent = xmalloc(STRLEN_MAX);
+  user_agent(opts);
+}
+
 static void init_ctx(struct ctx *ctx, const char *name)
 {
   memset(ctx,0,sizeof(struct ctx));
-  ctx->dns  = CURL_IPRESOLVE_WHATEVER;
+  init_opts(&ctx->opts);
   ctx->name = name;
   ctx->width = WIDTH_DEF;
   ctx->height = HEIGHT_DEF;
+  ctx->parallel = PARALLEL_DEF;
+  ctx->streams = STREAMS_DEF;
+  ctx->server.fd = -1;
+  ctx->report_fd = STDOUT_FILENO;
+  ctx->interval = REPORT_DELTA;
   ctx->unit.repr = "B";
   ctx->unit.factor = 1.;
-  ctx->user_agent   = xmalloc(STRLEN_MAX);
   ctx->txt_status   = xmalloc(STRLEN_MAX);
   ctx->pct_progress = xmalloc(STRLEN_MAX);
   ctx->speed_status = xmalloc(STRLEN_MAX);
   ctx->dlnow_status = xmalloc(STRLEN_MAX);
   ctx->dltot_status = xmalloc(STRLEN_MAX);
-  ctx->title        = xmalloc(STRLEN_MAX);
-  user_agent(ctx);
+  ctx->eta_status   = xmalloc(STRLEN_MAX);
 }
 
 static struct s_list * add_str(struct s_list *list, const char * str)
 {
   register struct s_list *old = list;
   register struct s_list *new = xmalloc(sizeof(struct s_list));
-  new->string = xmalloc(strlen(str));
+  new->string = xmalloc(strlen(str) + 1);
   strcpy(new->string,str);
   new->next = old;
   return new;
@@ -191,25 +501,49 @@ static struct s_list * add_str(struct s_list *list, const char * str)
 
 static void free_s_list(struct s_list *list)
 {
-  register struct s_list *l;
-  for(l = list ; l ; l = l->next) {
+  register struct s_list *l,*next;
+  for(l = list ; l ; l = next) {
+    next = l->next;
     free(l->string);
     free(l);
   }
 }
 
+static void free_opts(gpointer data)
+{
+  free_s_list(OPTS_T(data)->mirrors);
+  free_s_list(OPTS_T(data)->cookies);
+  free_s_list(OPTS_T(data)->cks_path);
+  free_s_list(OPTS_T(data)->args);
+  free(OPTS_T(data)->user_agent);
+}
+
+/* Options forwarded by another instance. */
+static void destroy_opts(gpointer data)
+{
+  free_opts(data);
+  g_free(data);
+}
+
 static void free_ctx(struct ctx *ctx)
 {
-  free_s_list(ctx->cookies);
-  free_s_list(ctx->cks_path);
+  free_opts(&ctx->opts);
   free_s_list(ctx->cmd_args);
-  free(ctx->user_agent);
   free(ctx->pct_progress);
   free(ctx->speed_status);
   free(ctx->dlnow_status);
   free(ctx->dltot_status);
+  free(ctx->eta_status);
   free(ctx->txt_status);
-  free(ctx->title);
+  queue_free(&ctx->queue);
+  if(ctx->stats && ctx->stats != stdout)
+    fclose(ctx->stats);
+  ctx->stats = NULL;
+  if(ctx->sched)
+    g_source_remove(ctx->sched);
+  ctx->sched = 0;
+  bandwidth_free(&ctx->bandwidth);
+  cache_close(&ctx->cache);
 }
 
 static void format_nbr(struct ctx *ctx,char *buf, const char *dim, double nbr)
@@ -252,6 +586,32 @@ static void format_nbr(struct ctx *ctx,char *buf, const char *dim, double nbr)
   }
 }
 
+static void format_eta(char *buf, double eta)
+{
+  register long sec = (long)eta;
+  if(eta < 0.)
+    snprintf(buf,STRLEN_MAX,"--:--");
+  else if(sec >= 3600)
+    snprintf(buf,STRLEN_MAX,"%ld:%02ld:%02ld",
+             sec / 3600,(sec / 60) % 60,sec % 60);
+  else
+    snprintf(buf,STRLEN_MAX,"%02ld:%02ld",sec / 60,sec % 60);
+}
+
+static double monotonic(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1E9;
+}
+
+static uint64_t nanotime(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
 static bool is_directory(const char *path)
 {
   register DIR *fd;
@@ -288,6 +648,36 @@ static void cmdline(int argc, char *argv[], struct ctx *ctx)
       {"ipv6", no_argument, 0, '6'},
       {"intf", required_argument, 0, 'i'},
       {"interactive", no_argument, 0, 'I'},
+      {"segments", required_argument, 0, 'S'},
+      {"continue", no_argument, 0, 'R'},
+      {"headless", no_argument, 0, 'H'},
+      {"report-fd", required_argument, 0, 'J'},
+      {"interval", required_argument, 0, 'T'},
+      {"buffer", required_argument, 0, 'B'},
+      {"no-prealloc", no_argument, 0, 'N'},
+      {"checksum", required_argument, 0, 'k'},
+      {"input-file", required_argument, 0, 'l'},
+      {"parallel", required_argument, 0, 'j'},
+      {"per-host", required_argument, 0, 'Q'},
+      {"pool", required_argument, 0, 'K'},
+      {"http2", no_argument, 0, '2'},
+      {"streams", required_argument, 0, 'n'},
+      {"h2c", required_argument, 0, 'q'},
+      {"retries", required_argument, 0, 'w'},
+      {"stall", required_argument, 0, 'm'},
+      {"single-instance", no_argument, 0, 'D'},
+      {"limit", required_argument, 0, 'L'},
+      {"host-limit", required_argument, 0, 'X'},
+      {"rate", required_argument, 0, 'W'},
+      {"priority", required_argument, 0, 'O'},
+      {"mirror", required_argument, 0, 'g'},
+      {"metalink", required_argument, 0, 'G'},
+      {"stats-json", required_argument, 0, 't'},
+      {"histograms", no_argument, 0, 'Y'},
+      {"zsync", required_argument, 0, 'Z'},
+      {"seed", required_argument, 0, 'z'},
+      {"cache", required_argument, 0, 'e'},
+      {"cache-size", required_argument, 0, 'E'},
       {NULL,0,0,0}
     };
   const char *opts_help[] = {
@@ -312,7 +702,47 @@ static void cmdline(int argc, char *argv[], struct ctx *ctx)
     "Resolve to IPv4 addresses only.",
     "Resolve to IPv6 only and inhibits IPv4 addresses.",
     "Set outgoing network interface.",
-    "Read options from stdin."
+    "Read options from stdin.",
+    "Download with several connections when the server accepts ranges.",
+    "Continue a partial download from its journal.",
+    "Run without GUI and report progress as JSON lines.",
+    "File descriptor for the JSON progress records (default stdout).",
+    "Interval between two progress records in milliseconds.",
+    "Size of the writer buffer in KiB, 0 to write from the receive path.",
+    "Do not check and reserve the disk space beforehand.",
+    "Verify the file against <md5|sha1|sha256|sha512>:<hex digest>.",
+    "Read \"<url> [output]\" lines from a file, - for stdin.",
+    "Number of files downloaded at the same time.",
+    "Number of files downloaded at the same time from one host.",
+    "Number of idle connections kept open for reuse.",
+    "Multiplex the downloads from one host over an HTTP/2 connection, "
+    "http URLs are upgraded when the server agrees.",
+    "Number of downloads at the same time on one HTTP/2 connection.",
+    "Hosts spoken to in h2c without upgrade with -2 (<host1>,<host2>,...).",
+    "Times a transfer which failed for a passing reason is tried again, "
+    "from where it stopped and waiting longer each time.",
+    "Seconds without data before a transfer is taken as failed, 0 to "
+    "wait forever.",
+    "Hand the download to a running instance, or take the next ones.",
+    "Bandwidth of all downloads in bytes per second (<rate>[k|m|g]), or "
+    "HH:MM=<rate>,... for the time of the day.",
+    "Bandwidth of the downloads from one host.",
+    "Bandwidth of each download.",
+    "Priority of the download, it starts before and may suspend the "
+    "lower ones; each step doubles its share of bandwidth.",
+    "Another URL of the same file, ranges are taken from every mirror.",
+    "Download the file described by a Metalink from its mirrors.",
+    "Write the network timing of each transfer and the totals as JSON "
+    "lines to a file, - for stdout.",
+    "Keep histograms of the time spent receiving, written with the stats "
+    "or to stderr when each file is over, on exit and on SIGUSR1.",
+    "Only fetch the blocks of a zsync control file not found in an older "
+    "copy of the file.",
+    "Older copy of the file for -Z, by default the output.",
+    "Keep the files in a cache directory, a file which did not change "
+    "since is linked from there.",
+    "Size of the cache (<bytes>[k|m|g]), the files used the longest ago "
+    "are dropped."
   };
   struct unit units[] =
     {
@@ -326,7 +756,7 @@ static void cmdline(int argc, char *argv[], struct ctx *ctx)
   const char **hlp;
   int i,c,max,size;
   while(1) {
-    c = getopt_long(argc,argv,"Vhvspu:bcx:y:fU:r:a:C:F:P:A:46i:I",opts,NULL);
+    c = getopt_long(argc,argv,"Vhvspu:bcx:y:fU:r:a:C:F:P:A:46i:IS:RHJ:T:B:Nk:l:j:Q:K:DL:X:W:O:g:G:t:YZ:z:e:E:2n:q:w:m:",opts,NULL);
     if(c == -1)
       break;
     switch(c) {
@@ -335,7 +765,7 @@ static void cmdline(int argc, char *argv[], struct ctx *ctx)
         free_ctx(ctx);
         exit(EXIT_SUCCESS);
       case 'v':
-        ctx->verbose = true;
+        ctx->opts.verbose = true;
         break;
       case 's':
         ctx->status = true;
@@ -383,41 +813,134 @@ static void cmdline(int argc, char *argv[], struct ctx *ctx)
         ctx->fixed = true;
         break;
       case 'U':
-        strncpy(ctx->user_agent,optarg,STRLEN_MAX);
+        strncpy(ctx->opts.user_agent,optarg,STRLEN_MAX - 1);
         break;
       case 'r':
-        ctx->referer = optarg;
+        ctx->opts.referer = optarg;
         break;
       case 'a':
-        ctx->http_crd = optarg;
+        ctx->opts.http_crd = optarg;
         break;
       case 'C':
-        ctx->cookies = add_str(ctx->cookies,optarg);
+        ctx->opts.cookies = add_str(ctx->opts.cookies,optarg);
         break;
       case 'F':
-        ctx->cks_path = add_str(ctx->cks_path,optarg);
+        ctx->opts.cks_path = add_str(ctx->opts.cks_path,optarg);
         break;
       case 'P':
-        ctx->proxy = optarg;
+        ctx->opts.proxy = optarg;
         break;
       case 'A':
-        ctx->proxy_crd = optarg;
+        ctx->opts.proxy_crd = optarg;
         break;
       case '4':
-        ctx->dns = CURL_IPRESOLVE_V4;
+        ctx->opts.dns = CURL_IPRESOLVE_V4;
         break;
       case '6':
-        ctx->dns = CURL_IPRESOLVE_V6;
+        ctx->opts.dns = CURL_IPRESOLVE_V6;
         break;
       case 'i':
-        ctx->intf = optarg;
+        ctx->opts.intf = optarg;
         break;
       case 'I':
         ctx->interactive = true;
         break;
+      case 'S':
+        ctx->opts.segments = atoi(optarg);
+        break;
+      case 'R':
+        ctx->opts.resume = true;
+        break;
+      case 'H':
+        ctx->headless = true;
+        break;
+      case 'J':
+        ctx->report_fd = atoi(optarg);
+        break;
+      case 'T':
+        ctx->interval = atoi(optarg);
+        break;
+      case 'B':
+        ctx->opts.buffer = atoi(optarg);
+        break;
+      case 'N':
+        ctx->opts.prealloc = false;
+        break;
+      case 'k':
+        ctx->opts.checksum = optarg;
+        break;
+      case 'l':
+        ctx->input = optarg;
+        break;
+      case 'j':
+        ctx->parallel = atoi(optarg);
+        break;
+      case 'Q':
+        ctx->per_host = atoi(optarg);
+        break;
+      case 'K':
+        ctx->pool = atoi(optarg);
+        break;
+      case '2':
+        ctx->http2 = true;
+        break;
+      case 'n':
+        ctx->streams = atoi(optarg);
+        break;
+      case 'q':
+        ctx->h2c = optarg;
+        break;
+      case 'w':
+        ctx->opts.retries = atoi(optarg);
+        break;
+      case 'm':
+        ctx->opts.stall = atoi(optarg);
+        break;
+      case 'D':
+        ctx->single = true;
+        break;
+      case 'L':
+        ctx->max_rate = optarg;
+        break;
+      case 'X':
+        ctx->host_rate = optarg;
+        break;
+      case 'W':
+        ctx->opts.limit = optarg;
+        break;
+      case 'O':
+        ctx->opts.priority = atoi(optarg);
+        break;
+      case 'g':
+        ctx->opts.mirrors = add_str(ctx->opts.mirrors,optarg);
+        break;
+      case 'G':
+        ctx->opts.metalink = optarg;
+        break;
+      case 't':
+        ctx->stats_path = optarg;
+        break;
+      case 'Y':
+        ctx->histograms = true;
+        break;
+      case 'Z':
+        ctx->opts.zsync = optarg;
+        break;
+      case 'z':
+        ctx->opts.seed = optarg;
+        break;
+      case 'e':
+        ctx->cache_dir = optarg;
+        break;
+      case 'E':
+        ctx->cache_size = optarg;
+        break;
       case 'h':
       default:
         fprintf(stderr,"Usage: %s [OPTIONS] [URL] [OUTPUT]\n",ctx->name);
+        fprintf(stderr,"       %s [OPTIONS] -l LIST [OUTPUT]\n",ctx->name);
+        fprintf(stderr,"       %s [OPTIONS] -G METALINK [OUTPUT]\n",ctx->name);
+        fprintf(stderr,"       %s [OPTIONS] -Z ZSYNC [OUTPUT]\n",ctx->name);
         max = 0;
         for(opt = opts ; opt->name; opt++) {
           size = strlen(opt->name);
@@ -439,8 +962,18 @@ static void cmdline(int argc, char *argv[], struct ctx *ctx)
         exit(EXIT_FAILURE);
     }
   }
+  if((ctx->input || ctx->opts.metalink || ctx->opts.zsync) &&
+     argc-optind <= 1) {
+    /* the files of the list go to the output directory, the one of a
+       metalink or of a zsync file is named after its URL unless given */
+    ctx->output = (argc - optind) ? argv[optind] : ".";
+    return;
+  }
   if(!(argc-optind) || argc-optind > 2) {
     fprintf(stderr,"Usage: %s [OPTIONS] [URL] [OUTPUT]\n",ctx->name);
+    fprintf(stderr,"       %s [OPTIONS] -l LIST [OUTPUT]\n",ctx->name);
+    fprintf(stderr,"       %s [OPTIONS] -G METALINK [OUTPUT]\n",ctx->name);
+    fprintf(stderr,"       %s [OPTIONS] -Z ZSYNC [OUTPUT]\n",ctx->name);
     free_ctx(ctx);
     exit(EXIT_FAILURE);
   }
@@ -448,13 +981,13 @@ static void cmdline(int argc, char *argv[], struct ctx *ctx)
   ctx->output = (argc - optind) ? argv[optind] : ".";
 }
 
-static void user_agent(struct ctx *ctx)
+static void user_agent(struct opts *opts)
 {
   /* FIXME: use strncpy instead and strncat */
-  strcpy(ctx->user_agent,"Mozilla/5.0 "
+  strcpy(opts->user_agent,"Mozilla/5.0 "
          "(X11 ; U; " ARCH "; commit:" COMMIT "; rv:" VERSION ") (");
-  strcat(ctx->user_agent,curl_version());
-  strcat(ctx->user_agent,") " PACKAGE "/" VERSION);
+  strcat(opts->user_agent,curl_version());
+  strcat(opts->user_agent,") " PACKAGE "/" VERSION);
 }
 
 static const char *extract_path(const char *url)
@@ -465,281 +998,3212 @@ static const char *extract_path(const char *url)
   return n_path;
 }
 
-static void load(struct ctx *ctx)
+/* The blocks of a zsync file are looked for in an older copy of the
+   file, the one given or else the output which is moved aside until
+   the download is over. What a failed run moved aside is older than
+   what it left in the output, which is only resumed with its
+   journal. */
+static bool set_seed(struct job *job)
 {
-  register char * n_path = xmalloc(STRLEN_MAX);
-  if(!is_directory(ctx->output))
-    strncpy(n_path,ctx->output,STRLEN_MAX);
+  struct stat seed,output;
+
+  if(job->opts->seed &&
+     (stat(job->opts->seed,&seed) || stat(job->path,&output) ||
+      seed.st_dev != output.st_dev || seed.st_ino != output.st_ino)) {
+    strncpy(job->seed_path,job->opts->seed,STRLEN_MAX - 1);
+    return true;
+  }
+  snprintf(job->seed_path,STRLEN_MAX,"%s.seed",job->path);
+  job->seed_aside = true;
+  if(!stat(job->seed_path,&seed) ||
+     (job->opts->resume && !stat(job->jrn_path,&output)))
+    return true;
+  if(rename(job->path,job->seed_path) == -1 && errno != ENOENT) {
+    fprintf(stderr,"Cannot move %s aside: %s\n",job->path,strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+static void set_path(struct job *job)
+{
+  register char * n_path = job->path;
+  const char *output = job->record->output ? job->record->output
+                                           : job->ctx->output;
+  if(!is_directory(output))
+    strncpy(n_path,output,STRLEN_MAX - 1);
   else
-    snprintf(n_path,STRLEN_MAX,"%s/%s",ctx->output,extract_path(ctx->url));
-  snprintf(ctx->title,STRLEN_MAX,"%s - %s",n_path,PACKAGE "-" VERSION);
-  ctx->o_desc = creat(n_path,(mode_t)0600);
-  free(n_path);
-  if(ctx->o_desc != -1)
-    return;
-  perror("Cannot create output file");
-  free_ctx(ctx);
-  exit(EXIT_FAILURE);
+    snprintf(n_path,STRLEN_MAX,"%s/%s",output,extract_path(job->url));
+  snprintf(job->title,STRLEN_MAX,"%s - %s",n_path,PACKAGE "-" VERSION);
+  if(job->opts->resume)
+    snprintf(job->jrn_path,STRLEN_MAX,"%s." PACKAGE,n_path);
 }
 
-static void *proceed_curl(void *ptr)
+static bool load(struct job *job)
 {
-  int timer = CTX_T(ptr)->timer;
-  CURLcode err;
-  gettimeofday(&CTX_T(ptr)->dl_begin,NULL); /* FIXME: use a mutex */
-  err = curl_easy_perform(CTX_T(ptr)->curl);
-  if(timer) {
-    gdk_threads_enter();
-    g_source_remove(timer);
-    gdk_threads_leave();
-  }
-  if(CTX_T(ptr)->close_on_finish) {
-    gdk_threads_enter();
-    gtk_main_quit();
-    gdk_threads_leave();
+  register char * n_path = job->path;
+  struct stat st;
+
+  if(job->zsync.sums && !set_seed(job))
+    return false;
+  /* a file linked from the cache is replaced, not written through */
+  if(!stat(n_path,&st) && st.st_nlink > 1 && unlink(n_path) == -1) {
+    fprintf(stderr,"Cannot replace %s: %s\n",n_path,strerror(errno));
+    return false;
   }
-  if(err && err != CURLE_ABORTED_BY_CALLBACK)
-    fprintf(stderr,"%s\n",curl_easy_strerror(err));
-  CTX_T(ptr)->curl_thread = NULL;
-  return NULL;
+  if(job->opts->resume)
+    /* keep what we already have, the journal tells what is valid */
+    job->o_desc = open(n_path,O_WRONLY | O_CREAT,(mode_t)0600);
+  else
+    job->o_desc = creat(n_path,(mode_t)0600);
+  if(job->o_desc != -1)
+    return true;
+  fprintf(stderr,"Cannot create %s: %s\n",n_path,strerror(errno));
+  return false;
 }
 
-static void sigterm(int signal)
+static void setup_easy(const struct job *job, CURL *curl, const char *url)
 {
-  register int timer = global_ctx->timer;
-  global_ctx->abort_transfer = true;
-  if(timer) {
-    gdk_threads_enter();
-    g_source_remove(timer);
-    gdk_threads_leave();
+  register const struct opts *opts = job->opts;
+  register struct s_list * l;
+
+  curl_easy_setopt(curl,CURLOPT_USERAGENT,opts->user_agent);
+  if(opts->referer)
+    curl_easy_setopt(curl,CURLOPT_REFERER,opts->referer);
+  if(opts->http_crd)
+    curl_easy_setopt(curl,CURLOPT_USERPWD,opts->http_crd);
+  for(l = opts->cookies ; l ; l = l->next)
+    curl_easy_setopt(curl,CURLOPT_COOKIE,l->string);
+  for(l = opts->cks_path ; l ; l = l->next)
+    curl_easy_setopt(curl,CURLOPT_COOKIEFILE,l->string);
+  if(opts->proxy)
+    curl_easy_setopt(curl,CURLOPT_PROXY,opts->proxy);
+  if(opts->proxy_crd)
+    curl_easy_setopt(curl,CURLOPT_PROXYUSERPWD,opts->proxy_crd);
+  if(opts->intf)
+    curl_easy_setopt(curl,CURLOPT_INTERFACE,opts->intf);
+  curl_easy_setopt(curl,CURLOPT_AUTOREFERER,true);
+  curl_easy_setopt(curl,CURLOPT_FOLLOWLOCATION,true);
+  curl_easy_setopt(curl,CURLOPT_FAILONERROR,true);
+  curl_easy_setopt(curl,CURLOPT_IPRESOLVE,opts->dns);
+  if(opts->stall > 0) {
+    curl_easy_setopt(curl,CURLOPT_LOW_SPEED_LIMIT,1L);
+    curl_easy_setopt(curl,CURLOPT_LOW_SPEED_TIME,(long)opts->stall);
   }
-  gdk_threads_enter();
-  gtk_main_quit();
-  gdk_threads_leave();
+  curl_easy_setopt(curl,CURLOPT_VERBOSE,(long)opts->verbose);
+  curl_easy_setopt(curl,CURLOPT_URL,url);
+  engine_http2(&job->ctx->engine,curl,url);
 }
 
-static gboolean callback_init(gpointer data)
+/* Copy the value of a header line if it matches name. */
+static bool header_value(const char *buffer, size_t len, const char *name,
+                         char *value, size_t size)
 {
-  CTX_T(data)->curl_thread = g_thread_create(proceed_curl,
-                                             (void *)data,
-                                             true,
-                                             NULL);
-  if (!CTX_T(data)->curl_thread) {
-    fprintf(stderr,"Cannot create thread\n");
-    gtk_main_quit();
+  register size_t n = strlen(name);
+  if(len <= n || strncasecmp(buffer,name,n))
+    return false;
+  for(buffer += n, len -= n ; len && *buffer == ' ' ; buffer++, len--);
+  while(len && (buffer[len-1] == '\n' || buffer[len-1] == '\r'))
+    len--;
+  if(len >= size)
+    len = size - 1;
+  memcpy(value,buffer,len);
+  value[len] = '\0';
+  return true;
+}
+
+static size_t callback_header(char *buffer, size_t size,
+                              size_t nmemb, void *userp)
+{
+  register size_t len = size*nmemb;
+  char value[RANGELEN_MAX];
+  /* reset on each response as we may follow redirections */
+  if(len > 5 && !strncmp(buffer,"HTTP/",5)) {
+    JOB_T(userp)->accept_ranges = false;
+    JOB_T(userp)->etag[0] = '\0';
+    JOB_T(userp)->modified[0] = '\0';
   }
+  else if(header_value(buffer,len,"Accept-Ranges:",value,RANGELEN_MAX))
+    JOB_T(userp)->accept_ranges = !strncasecmp(value,"bytes",5);
+  else if(!header_value(buffer,len,"ETag:",
+                        JOB_T(userp)->etag,VALIDATOR_MAX))
+    header_value(buffer,len,"Last-Modified:",
+                 JOB_T(userp)->modified,VALIDATOR_MAX);
+  return len;
 }
 
-static size_t callback_data(void *buffer, size_t size,
-                            size_t nmemb, void *userp)
+/* A mirror must have the same file, at least of the same size. The
+   parts of a batch come in a body of byte ranges. */
+static size_t callback_range(char *buffer, size_t size,
+                             size_t nmemb, void *userp)
+{
+  register struct segment *seg = SEG_T(userp);
+  register size_t len = size*nmemb;
+  char value[RANGELEN_MAX],type[STRLEN_MAX];
+  const char *total;
+
+  if(seg->batch) {
+    if(len > 5 && !strncmp(buffer,"HTTP/",5))
+      seg->batch->multipart = false;
+    else if(header_value(buffer,len,"Content-Type:",type,STRLEN_MAX))
+      seg->batch->multipart = multipart_init(&seg->batch->mp,type);
+  }
+  if(header_value(buffer,len,"Content-Range:",value,RANGELEN_MAX) &&
+     (total = strchr(value,'/')) && strcmp(total + 1,"*") &&
+     strtoll(total + 1,NULL,10) != seg->job->length)
+    seg->reject = "not the same size";
+  return len;
+}
+
+/* Fail early when the file cannot fit and reserve its extents in one
+   go to avoid fragmentation. Blocks already on disk from a previous
+   run are not counted twice. */
+static bool allocate(struct job *job, off_t length)
 {
-  register ssize_t wt = write(CTX_T(userp)->o_desc,buffer,size*nmemb);
-  if(wt == -1) {
-    perror("Cannot write");
-    return size-1;
+  char need_str[STRLEN_MAX],avail_str[STRLEN_MAX];
+  struct statvfs vfs;
+  struct stat st;
+  off_t need = length;
+
+  if(!job->opts->prealloc || length <= 0)
+    return true;
+  if(!fstat(job->o_desc,&st))
+    need -= (off_t)st.st_blocks * 512;
+  if(!fstatvfs(job->o_desc,&vfs) &&
+     need > (off_t)vfs.f_bavail * (off_t)vfs.f_frsize) {
+    format_nbr(job->ctx,need_str,"",(double)need);
+    format_nbr(job->ctx,avail_str,"",(double)vfs.f_bavail * vfs.f_frsize);
+    fprintf(stderr,"Not enough space left on device (%s needed, %s free)\n",
+            need_str,avail_str);
+    return false;
+  }
+  /* unsupported by the filesystem, the file just stays sparse */
+  if(fallocate(job->o_desc,0,0,length) == -1 &&
+     errno != EOPNOTSUPP && errno != ENOSYS) {
+    perror("Cannot preallocate output file");
+    return false;
   }
-  return (size_t)wt;
+  return true;
 }
 
-static int callback_progress(void *clientp, double dltotal,
-                             double dlnow, double ultotal,
-                             double ulnow)
+/* After a failure without journal only the bytes written from the
+   beginning of the file are worth keeping. */
+static void truncate_back(struct job *job)
 {
-  /* FIXME: dltotal is quit buggy use wrote byte instead ?*/
-  gdouble pct;
-  if(dlnow > dltotal)
-    pct = 1.;
-  else
-    pct = dlnow / dltotal;
+  register struct segment *seg;
+  off_t valid = 0;
 
-  if(CTX_T(clientp)->abort_transfer)
-    return -1;
-  else if(CTX_T(clientp)->progress &&
-          fabs(pct - CTX_T(clientp)->pct) > PCT_EPS) {
-    CTX_T(clientp)->pct = pct;
-    snprintf(CTX_T(clientp)->pct_progress,STRLEN_MAX,"%3.0f%%",100.*pct);
-    gdk_threads_enter();
-    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(CTX_T(clientp)->gui_progress),
-                                  pct);
-    gtk_progress_bar_set_text(GTK_PROGRESS_BAR(CTX_T(clientp)->gui_progress),
-                              CTX_T(clientp)->pct_progress);
-    gdk_threads_leave();
+  for(seg = job->segs ; seg < job->segs + job->nsegs ; seg++) {
+    if(seg->begin != valid || seg->batch)
+      break;
+    valid = seg->offset;
+    if(seg->end < 0 || seg->offset <= seg->end)
+      break;
   }
-  CTX_T(clientp)->dlnow = dlnow;
-  CTX_T(clientp)->dltot = dltotal;
-  return 0;
+  if(ftruncate(job->o_desc,valid) == -1)
+    perror("Cannot truncate output file");
 }
 
-static gboolean callback_delete(GtkWidget *widget, GdkEvent *event,
-                                gpointer data)
+/* Mirror for the next transfer. One which sent nothing yet is tried
+   when it is idle, else the one which would give the most for one more
+   connection, the least busy between equals. */
+static struct mirror *pick_mirror(struct job *job)
 {
-  register int timer = CTX_T(data)->timer;
-  CTX_T(data)->abort_transfer = true;
-  if(timer)
-    g_source_remove(timer);
-  gtk_main_quit();
-  return false;
+  register struct mirror *m,*best = NULL;
+  double now = monotonic(),score,best_score = -1.;
+
+  for(m = job->mirrors ; m < job->mirrors + job->nmirrors ; m++) {
+    if(m->dropped)
+      continue;
+    /* a mirror which stalled has no sample of its own */
+    rate_sample(&m->rate,now,m->received);
+    if(!m->received)
+      score = m->active ? 0. : HUGE_VAL;
+    else
+      score = m->rate.smooth / (m->active + 1);
+    if(score > best_score ||
+       (score == best_score && m->active < best->active)) {
+      best       = m;
+      best_score = score;
+    }
+  }
+  return best;
 }
 
-static gboolean callback_timer(gpointer data)
+static void drop(struct job *job, struct mirror *mirror, const char *why)
 {
-  double delta;
-  struct timeval t_now,t_delta;
+  if(mirror->dropped)
+    return;
+  mirror->dropped = true;
+  job->alive--;
+  fprintf(stderr,"%s: dropping mirror %s: %s\n",job->path,mirror->url,why);
+}
 
-  gettimeofday(&t_now,NULL);
-  timersub(&t_now,&CTX_T(data)->dl_begin,&t_delta);
-  delta = (double)t_delta.tv_sec + (double)t_delta.tv_usec / 1000000;
-  format_nbr(CTX_T(data),CTX_T(data)->speed_status, "ps",
-             CTX_T(data)->dlnow / delta);
-  format_nbr(CTX_T(data),CTX_T(data)->dlnow_status, "",
-             CTX_T(data)->dlnow);
-  format_nbr(CTX_T(data),CTX_T(data)->dltot_status, "",
-             CTX_T(data)->dltot);
-  snprintf(CTX_T(data)->txt_status,STRLEN_MAX,"%s (%s/%s)",
-           CTX_T(data)->speed_status,
-           CTX_T(data)->dlnow_status,
-           CTX_T(data)->dltot_status);
-  gtk_label_set_text(GTK_LABEL(CTX_T(data)->gui_status),
-                     CTX_T(data)->txt_status);
+/* A transfer which failed on a mirror goes on from the others. Our own
+   failures are final, and so are the ones of a single stream which
+   cannot start over where it stopped. */
+static bool retry(struct job *job, struct segment *seg, CURLcode result)
+{
+  if(!seg->mirror || seg->end < 0 || job->changed ||
+     job->ctx->abort_transfer || result == CURLE_ABORTED_BY_CALLBACK ||
+     (result == CURLE_WRITE_ERROR && !seg->reject))
+    return false;
+  drop(job,seg->mirror,seg->reject ? seg->reject : curl_easy_strerror(result));
+  seg->reject = NULL;
+  return job->alive > 0;
 }
 
-static void setup_curl(struct ctx *ctx)
+/* Seconds the server asked to wait after a failure which may not
+   happen again, 0 when it did not say, -1 for one which would. */
+static double transient(CURL *curl, CURLcode result)
 {
-  register struct s_list * l;
+  curl_off_t after = 0;
+  long code = 0;
 
-  curl_global_init(CURL_GLOBAL_ALL);
-  ctx->curl = curl_easy_init();
-
-  curl_easy_setopt(ctx->curl,CURLOPT_USERAGENT,ctx->user_agent);
-  if(ctx->referer)
-    curl_easy_setopt(ctx->curl,CURLOPT_REFERER,ctx->referer);
-  if(ctx->http_crd)
-    curl_easy_setopt(ctx->curl,CURLOPT_USERPWD,ctx->http_crd);
-  for(l = ctx->cookies ; l ; l = l->next)
-    curl_easy_setopt(ctx->curl,CURLOPT_COOKIE,l->string);
-  for(l = ctx->cks_path ; l ; l = l->next)
-    curl_easy_setopt(ctx->curl,CURLOPT_COOKIEFILE,l->string);
-  if(ctx->proxy)
-    curl_easy_setopt(ctx->curl,CURLOPT_PROXY,ctx->proxy);
-  if(ctx->proxy_crd)
-    curl_easy_setopt(ctx->curl,CURLOPT_PROXYUSERPWD,ctx->proxy_crd);
-  if(ctx->intf)
-    curl_easy_setopt(ctx->curl,CURLOPT_INTERFACE,ctx->intf);
-  curl_easy_setopt(ctx->curl,CURLOPT_AUTOREFERER,true);
-  curl_easy_setopt(ctx->curl,CURLOPT_FOLLOWLOCATION,true);
-  curl_easy_setopt(ctx->curl,CURLOPT_FAILONERROR,true);
-  curl_easy_setopt(ctx->curl,CURLOPT_IPRESOLVE,ctx->dns);
-  curl_easy_setopt(ctx->curl,CURLOPT_VERBOSE,(long)ctx->verbose);
-  curl_easy_setopt(ctx->curl,CURLOPT_URL,ctx->url);
-  curl_easy_setopt(ctx->curl,CURLOPT_WRITEDATA,ctx);
-  curl_easy_setopt(ctx->curl,CURLOPT_WRITEFUNCTION,callback_data);
-  if(ctx->progress || ctx->status) {
-    curl_easy_setopt(ctx->curl,CURLOPT_NOPROGRESS,0L);
-    curl_easy_setopt(ctx->curl,CURLOPT_PROGRESSDATA,ctx);
-    curl_easy_setopt(ctx->curl,CURLOPT_PROGRESSFUNCTION,callback_progress);
+  switch(result) {
+    case CURLE_HTTP_RETURNED_ERROR:
+      curl_easy_getinfo(curl,CURLINFO_RESPONSE_CODE,&code);
+      if(code != 408 && code != 429 && code != 500 && code != 502 &&
+         code != 503 && code != 504)
+        return -1.;
+#if LIBCURL_VERSION_NUM >= 0x074200
+      curl_easy_getinfo(curl,CURLINFO_RETRY_AFTER,&after);
+#endif
+      return after > 0 ? (double)after : 0.;
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+      return 0.;
+    default:
+      return -1.;
   }
 }
 
-static void setup_gui(struct ctx *ctx)
+static gboolean callback_retry(gpointer data);
+
+/* Wake the job up at that time unless it is already sooner. */
+static void schedule_retry(struct job *job, double at)
 {
-  GtkWidget *window,*vbox;
+  double delay;
 
-  g_thread_init(NULL);
-  gdk_threads_init();
+  if(job->retry_timer && job->retry_next <= at)
+    return;
+  if(job->retry_timer)
+    g_source_remove(job->retry_timer);
+  delay = at - monotonic();
+  job->retry_next  = at;
+  job->retry_timer = g_timeout_add(delay > 0. ? (guint)ceil(delay * 1E3) : 0,
+                                   callback_retry,job);
+}
 
-  gtk_init_add(callback_init,ctx);
+/* A transfer which failed for a passing reason is connected again
+   later, from where it stopped. The delay doubles with each failure in
+   a row, half of it at random so that the transfers which failed
+   together do not come back together, unless the server asked for more.
+   A range is rather taken from another mirror while one is alive. */
+static bool again(struct job *job, struct segment *seg, CURLcode result,
+                  double after)
+{
+  double delay;
 
-  window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-  g_signal_connect(G_OBJECT(window),"delete_event",
-                   G_CALLBACK(callback_delete),ctx);
-  gtk_window_set_role(GTK_WINDOW(window),"gdownload");
-  gtk_window_set_title(GTK_WINDOW(window),ctx->title);
-  if(ctx->width && ctx->height)
-    gtk_window_set_default_size(GTK_WINDOW(window),ctx->width,ctx->height);
-  gtk_window_set_position(GTK_WINDOW(window),POSITION_DEF);
-  gtk_window_set_resizable(GTK_WINDOW(window),!ctx->fixed);
-  gtk_window_set_icon_from_file(GTK_WINDOW(window),ICON_PATH,NULL);
-  vbox = gtk_vbox_new(false,0);
-  gtk_container_add(GTK_CONTAINER(window),vbox);
+  if(after < 0. || seg->reject || job->changed ||
+     job->ctx->abort_transfer || (seg->end >= 0 && seg->offset > seg->end) ||
+     (job->nmirrors && !job->alive) ||
+     (seg->mirror && seg->end >= 0 &&
+      job->alive > (seg->mirror->dropped ? 0 : 1)))
+    return false;
+  /* a transfer which received something starts a new series */
+  if(seg->offset - seg->from > (off_t)seg->carry)
+    seg->failures = 0;
+  if(seg->failures >= job->opts->retries)
+    return false;
+  delay = ldexp(RETRY_DELTA / 1E3,seg->failures);
+  delay = delay < RETRY_DELTA_MAX / 1E3 ? delay : RETRY_DELTA_MAX / 1E3;
+  delay = delay / 2. + g_random_double_range(0.,delay / 2.);
+  delay = after > delay ? after : delay;
+  seg->failures++;
+  seg->retry_at = monotonic() + delay;
+  job->retries++;
+  job->lost += delay;
+  if(result == CURLE_OPERATION_TIMEDOUT)
+    job->lost += job->opts->stall;
+  fprintf(stderr,"%s: %s, trying again in %.1f s (%d/%d)\n",job->path,
+          curl_easy_strerror(result),delay,seg->failures,job->opts->retries);
+  schedule_retry(job,seg->retry_at);
+  return true;
+}
 
-  if(ctx->progress) {
-    ctx->gui_progress = gtk_progress_bar_new();
-    gtk_box_pack_start(GTK_BOX(vbox),ctx->gui_progress,true,true,0);
-    gtk_widget_show(ctx->gui_progress);
-  }
+/* Ask for the headers only to know if we can split the download. */
+static void probe(struct job *job)
+{
+  CURL *curl = curl_easy_init();
 
-  if(ctx->status) {
-    ctx->timer = g_timeout_add(STATUS_DELTA,callback_timer,ctx);
-    ctx->gui_status = gtk_label_new("waiting");
-    gtk_label_set_justify(GTK_LABEL(ctx->gui_status),GTK_JUSTIFY_CENTER);
-    gtk_box_pack_start(GTK_BOX(vbox),ctx->gui_status,true,true,0);
-    gtk_widget_show(ctx->gui_status);
-  }
+  job->probe.job    = job;
+  job->probe.mirror = job->nmirrors ? pick_mirror(job) : NULL;
+  job->probe.reject = NULL;
+  setup_easy(job,curl,job->probe.mirror ? job->probe.mirror->url : job->url);
+  /* the validators in the cache are the ones of the URL */
+  if(job->conditions &&
+     (!job->probe.mirror || !strcmp(job->probe.mirror->url,job->url)))
+    curl_easy_setopt(curl,CURLOPT_HTTPHEADER,job->conditions);
+  curl_easy_setopt(curl,CURLOPT_NOBODY,1L);
+  curl_easy_setopt(curl,CURLOPT_HEADERDATA,job);
+  curl_easy_setopt(curl,CURLOPT_HEADERFUNCTION,callback_header);
+  job->probe.curl = curl;
+  engine_add(&job->ctx->engine,curl,&job->probe);
+}
 
-  gtk_widget_show(vbox);
-  gtk_widget_show(window);
+static bool probed(struct job *job, CURLcode err)
+{
+  curl_off_t length = -1;
+
+  if(!err)
+    curl_easy_getinfo(job->probe.curl,CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                      &length);
+  curl_easy_cleanup(job->probe.curl);
+  job->probe.curl = NULL;
+  if(err || length <= 0)
+    return false;
+  job->length = (off_t)length;
+  return job->accept_ranges;
 }
 
-static void unload(const struct ctx *ctx)
+/* "<begin>-<end>,..." of the parts of a batch, which starts over. */
+static void batch_range(struct segment *seg)
 {
-  if(close(ctx->o_desc) == -1)
-    perror("Cannot close");
+  register struct batch *batch = seg->batch;
+  GString *range = g_string_new(NULL);
+  register int i;
+
+  for(i = 0 ; i < batch->nparts ; i++) {
+    g_string_append_printf(range,i ? ",%lld-%lld" : "%lld-%lld",
+                           (long long)batch->parts[i].begin,
+                           (long long)batch->parts[i].end);
+    batch->got[i] = 0;
+  }
+  batch->multipart = false;
+  curl_easy_setopt(seg->curl,CURLOPT_RANGE,range->str);
+  g_string_free(range,true);
 }
 
-static void proceed(struct ctx *ctx)
+/* The ranges asked again are only valid for the same file. */
+static void if_range(struct job *job)
 {
-  gdk_threads_enter();
-  gtk_main();
-  gdk_threads_leave();
+  char header[STRLEN_MAX];
+
+  /* a weak ETag cannot be used as a range validator */
+  if(job->etag[0] && strncmp(job->etag,"W/",2))
+    snprintf(header,STRLEN_MAX,"If-Range: %s",job->etag);
+  else if(job->modified[0])
+    snprintf(header,STRLEN_MAX,"If-Range: %s",job->modified);
+  else
+    return;
+  job->headers = curl_slist_append(job->headers,header);
 }
 
-static void handle_signal(struct ctx *ctx)
+/* Transfer the rest of a segment. */
+static void connect_segment(struct job *job, struct segment *seg)
 {
-  const int sig[] = { SIGTERM,
-                      SIGINT,
-                      SIGQUIT,
-                      SIGUNUSED };
-  const register int * signum;
-  global_ctx = ctx;
-  for(signum = sig ; *signum != SIGUNUSED ; signum++) {
-    if(signal(*signum,sigterm) == SIG_ERR) {
-      perror("Cannot handle signal");
-      free_ctx(ctx);
-      exit(EXIT_FAILURE);
+  register struct ctx *ctx = job->ctx;
+  char range[RANGELEN_MAX];
+
+  if(seg->batch)
+    seg->offset  = seg->from;
+  seg->checked   = false;
+  seg->cut       = false;
+  seg->reject    = NULL;
+  seg->carry     = (double)(seg->offset - seg->from);
+  seg->connected = monotonic();
+  seg->last_data = 0;
+  seg->curl      = curl_easy_init();
+  setup_easy(job,seg->curl,seg->mirror ? seg->mirror->url : job->url);
+  if(seg->batch)
+    batch_range(seg);
+  else if(seg->end >= 0) {
+    snprintf(range,RANGELEN_MAX,"%lld-%lld",
+             (long long)seg->offset,(long long)seg->end);
+    curl_easy_setopt(seg->curl,CURLOPT_RANGE,range);
+  }
+  if(seg->end >= 0) {
+    /* the validators are the ones of the server which was probed */
+    if(job->headers && seg->mirror == job->probe.mirror)
+      curl_easy_setopt(seg->curl,CURLOPT_HTTPHEADER,job->headers);
+    if(seg->mirror || seg->batch) {
+      curl_easy_setopt(seg->curl,CURLOPT_HEADERDATA,seg);
+      curl_easy_setopt(seg->curl,CURLOPT_HEADERFUNCTION,callback_range);
+    }
+  }
+  else {
+    /* there was no probe for the validators, they are needed by the
+       cache and to go on after a failure */
+    curl_easy_setopt(seg->curl,CURLOPT_HEADERDATA,job);
+    curl_easy_setopt(seg->curl,CURLOPT_HEADERFUNCTION,callback_header);
+    if(seg->offset) {
+      if(!job->headers)
+        if_range(job);
+      curl_easy_setopt(seg->curl,CURLOPT_HTTPHEADER,job->headers);
+      curl_easy_setopt(seg->curl,CURLOPT_RESUME_FROM_LARGE,
+                       (curl_off_t)seg->offset);
     }
   }
+  curl_easy_setopt(seg->curl,CURLOPT_WRITEDATA,seg);
+  curl_easy_setopt(seg->curl,CURLOPT_WRITEFUNCTION,callback_data);
+  if(ctx->progress || ctx->status || ctx->list || ctx->headless) {
+    curl_easy_setopt(seg->curl,CURLOPT_NOPROGRESS,0L);
+    curl_easy_setopt(seg->curl,CURLOPT_PROGRESSDATA,seg);
+    curl_easy_setopt(seg->curl,CURLOPT_PROGRESSFUNCTION,callback_progress);
+  }
+  if(seg->mirror)
+    seg->mirror->active++;
+  job->active++;
+  engine_add(&ctx->engine,seg->curl,seg);
 }
 
-static void null_cmd(const char *arg, void *ptr) { return; }
-static void true_cmd(const char *arg, void *ptr) { *(bool *)ptr = true; }
-static void false_cmd(const char *arg, void *ptr) { *(bool *)ptr = false; }
-static void arg_cmd(const char *arg, void *ptr) { *(const char **)ptr = arg; }
-static void int_cmd(const char *arg, void *ptr) { *(int *)ptr = atoi(arg); }
-static void copy_cmd(const char *arg, void *ptr)
+static void add_segment(struct job *job, struct segment *seg,
+                        off_t begin, off_t end)
 {
-  strncpy(*(char **)ptr, arg, STRLEN_MAX);
+  seg->job    = job;
+  seg->begin  = begin;
+  seg->offset = begin;
+  seg->mark   = begin;
+  seg->from   = begin;
+  seg->end    = end;
 }
-static void append_cmd(const char *arg, void *ptr)
+
+/* Room for one more segment. The transfers and the timers point into
+   the array so they follow it when it moves. */
+static struct segment *new_segment(struct job *job)
 {
-*(struct s_list **)ptr = add_str(*(struct s_list **)ptr,arg);
+  register struct segment *seg,*segs = job->segs;
+
+  if(job->nsegs == job->capacity) {
+    segs = realloc(segs,2 * job->capacity * sizeof(struct segment));
+    if(!segs)
+      return NULL;
+    job->segs      = segs;
+    job->capacity *= 2;
+    for(seg = segs ; seg < segs + job->nsegs ; seg++) {
+      if(seg->throttle) {
+        g_source_remove(seg->throttle);
+        seg->throttle = g_timeout_add(1,callback_throttle,seg);
+      }
+      if(!seg->curl)
+        continue;
+      engine_rebind(&job->ctx->engine,seg->curl,seg);
+      curl_easy_setopt(seg->curl,CURLOPT_WRITEDATA,seg);
+      curl_easy_setopt(seg->curl,CURLOPT_PROGRESSDATA,seg);
+      if((seg->mirror || seg->batch) && seg->end >= 0)
+        curl_easy_setopt(seg->curl,CURLOPT_HEADERDATA,seg);
+    }
+  }
+  seg = job->segs + job->nsegs++;
+  memset(seg,0,sizeof(struct segment));
+  return seg;
 }
-static void ipv4_cmd(const char *arg, void *ptr)
+
+/* A connection without work takes the upper half of the range which
+   looks like it would end last. The cut is above the next byte to
+   write and whatever the other transfer receives past it is dropped,
+   so each byte is written once. Pieces of the metalink stay whole. */
+static struct segment *steal(struct job *job)
 {
-  *(int *)ptr = CURL_IPRESOLVE_V4;
+  register struct segment *seg,*victim = NULL;
+  off_t unit = job->hashed ? job->metalink.piece_length : 1;
+  double now = monotonic(),left,speed,worst = -1.;
+  off_t mid,end;
+  int i;
+
+  for(seg = job->segs ; seg < job->segs + job->nsegs ; seg++) {
+    if(!seg->curl || seg->end < 0 || seg->batch ||
+       seg->end + 1 - seg->offset < 2 * STEAL_MIN)
+      continue;
+    speed = (seg->offset - seg->from - seg->carry) / (now - seg->connected);
+    left  = (seg->end + 1 - seg->offset) / (speed > 0. ? speed : 1.);
+    if(left > worst) {
+      victim = seg;
+      worst  = left;
+    }
+  }
+  if(!victim)
+    return NULL;
+  mid = victim->offset + (victim->end + 1 - victim->offset) / 2;
+  mid = (mid + unit - 1) / unit * unit;
+  end = victim->end;
+  if(end + 1 - mid < STEAL_MIN)
+    return NULL;
+  i = victim - job->segs;
+  if(!(seg = new_segment(job)))
+    return NULL;
+  victim = job->segs + i;
+  victim->end = mid - 1;
+  victim->cut = true;
+  add_segment(job,seg,mid,end);
+  job->running++;
+  return seg;
 }
-static void ipv6_cmd(const char *arg, void *ptr)
+
+/* The server cannot send several ranges at once, the batches left are
+   split when they connect or end. */
+static void single_ranges(struct job *job)
 {
-  *(int *)ptr = CURL_IPRESOLVE_V6;
+  if(job->multirange && job->opts->verbose)
+    fprintf(stderr,"%s: no multiple ranges, asking them one by one\n",
+            job->path);
+  job->multirange = false;
 }
 
-static void parse_stdin(struct ctx *ctx)
+static bool batch_over(const struct segment *seg)
 {
-  char buf[STRLEN_MAX];
-  const char *cmd,*arg;
-  struct cmd cmds[] =
+  register const struct batch *batch = seg->batch;
+  register int i;
+
+  for(i = 0 ; i < batch->nparts ; i++)
+    if(batch->got[i] != batch->parts[i].end + 1 - batch->parts[i].begin)
+      return false;
+  return true;
+}
+
+/* Each part of a batch becomes a segment of its own. */
+static void unbatch(struct job *job, int i)
+{
+  struct batch *batch = job->segs[i].batch;
+  register struct segment *seg;
+  register int k;
+
+  job->segs[i].batch = NULL;
+  job->segs[i].dlnow = 0.;
+  add_segment(job,job->segs + i,batch->parts[0].begin,batch->parts[0].end);
+  for(k = 1 ; k < batch->nparts ; k++) {
+    if(!(seg = new_segment(job)))
+      break;
+    add_segment(job,seg,batch->parts[k].begin,batch->parts[k].end);
+    job->running++;
+  }
+  free(batch);
+}
+
+/* Connect the ranges left while the job has connections to spare, each
+   to the mirror which looks the best by now, then let the idle ones
+   share the work of the others. */
+static void dispatch(struct job *job)
+{
+  register struct segment *seg;
+  register int i;
+
+  if(job->suspended)
+    return;
+  for(i = 0 ; i < job->nsegs && job->active < job->conns ; i++) {
+    if(job->segs[i].batch && !job->multirange && !job->segs[i].curl)
+      unbatch(job,i);
+    seg = job->segs + i;
+    if(seg->over || seg->curl || seg->checking || seg->retry_at)
+      continue;
+    if(job->nmirrors)
+      seg->mirror = pick_mirror(job);
+    connect_segment(job,seg);
+  }
+  while(job->active < job->conns && (seg = steal(job))) {
+    if(job->nmirrors)
+      seg->mirror = pick_mirror(job);
+    connect_segment(job,seg);
+  }
+}
+
+/* The transfers whose delay is over are connected again. */
+static gboolean callback_retry(gpointer data)
+{
+  register struct job *job = JOB_T(data);
+  register struct segment *seg;
+  double now = monotonic(),next = 0.;
+
+  job->retry_timer = 0;
+  if(job->probe.retry_at && job->probe.retry_at <= now) {
+    job->probe.retry_at = 0.;
+    probe(job);
+  }
+  else if(job->probe.retry_at)
+    next = job->probe.retry_at;
+  for(seg = job->segs ; seg < job->segs + job->nsegs ; seg++) {
+    if(seg->retry_at && seg->retry_at <= now)
+      seg->retry_at = 0.;
+    else if(seg->retry_at && (!next || seg->retry_at < next))
+      next = seg->retry_at;
+  }
+  if(job->segs)
+    dispatch(job);
+  if(next)
+    schedule_retry(job,next);
+  return false;
+}
+
+/* Open the journal of a previous run. It is only trusted when the
+   remote file still has the same size and validators. */
+static void resume(struct job *job)
+{
+  register struct journal *jrn = &job->journal;
+
+  if(journal_load(jrn) &&
+     (jrn->length != job->length ||
+      strcmp(jrn->etag,job->etag) ||
+      strcmp(jrn->modified,job->modified))) {
+    fprintf(stderr,"Remote file changed, restarting from scratch\n");
+    journal_clear(jrn);
+  }
+  else if(job->opts->verbose && jrn->nranges)
+    fprintf(stderr,"Resuming with %lld bytes already on disk\n",
+            (long long)journal_done(jrn));
+  jrn->length = job->length;
+  strcpy(jrn->etag,job->etag);
+  strcpy(jrn->modified,job->modified);
+  job->journal_on = true;
+  if_range(job);
+}
+
+/* With mirrors the file is cut in more ranges than connections so that
+   the fast ones take more of them. The ranges are aligned on the pieces
+   of the metalink to check them as they end. */
+static void setup_pieces(struct job *job)
+{
+  register const struct metalink *ml = &job->metalink;
+  int conns = job->opts->segments;
+  off_t piece;
+
+  conns = conns > job->nmirrors ? conns : job->nmirrors;
+  conns = conns > 1 ? conns : 1;
+  job->hashed = ml->pieces && ml->pieces->len && ml->size == job->length;
+  /* the ranges of a batch would not be whole pieces */
+  job->multirange = job->zsync.sums && !job->hashed;
+  if(!job->nmirrors && !job->hashed && !job->zsync.sums)
+    return;
+  piece = job->length / ((off_t)conns * PIECES_PER_CONN);
+  piece = piece > SEGMENT_MIN ? piece : SEGMENT_MIN;
+  if(job->hashed)
+    piece = (piece + ml->piece_length - 1) / ml->piece_length *
+            ml->piece_length;
+  job->piece = piece;
+  job->conns = conns;
+}
+
+/* One more part in a batch, the first one is a plain range. */
+static void add_part(struct job *job, struct segment *seg,
+                     off_t begin, off_t end)
+{
+  register struct batch *batch = seg->batch;
+
+  if(!seg->job) {
+    add_segment(job,seg,begin,end);
+    return;
+  }
+  if(!batch) {
+    batch = seg->batch = xmalloc(sizeof(struct batch));
+    memset(batch,0,sizeof(struct batch));
+    batch->parts[0].begin = seg->from;
+    batch->parts[0].end   = seg->end;
+    batch->nparts = 1;
+  }
+  batch->parts[batch->nparts].begin = begin;
+  batch->parts[batch->nparts].end   = end;
+  batch->nparts++;
+  seg->end = end;
+}
+
+/* Split the missing bytes of the file in ranges, one per connection,
+   largest holes getting more connections, or in pieces of the same size
+   handed out to the connections as they go. The holes left between the
+   blocks of a seed go by batches. */
+static int split_holes(struct job *job, bool add)
+{
+  register struct journal *jrn = &job->journal;
+  register int i,n = 0;
+  off_t begin,end,from,chunk,missing,at,next;
+  int pieces,parts = 0,batch = 0;
+
+  missing = jrn->length - journal_done(jrn);
+  for(from = 0 ; journal_hole(jrn,from,&begin,&end) ; from = end + 1) {
+    if(job->multirange && end - begin + 1 < SEGMENT_MIN) {
+      if(!parts || parts == MULTIRANGE_MAX) {
+        parts = 0;
+        batch = n++;
+      }
+      if(add)
+        add_part(job,job->segs + batch,begin,end);
+      parts++;
+      continue;
+    }
+    if(job->piece) {
+      for(at = begin ; at <= end ; at = next, n++) {
+        next = (at / job->piece + 1) * job->piece;
+        if(add)
+          add_segment(job,job->segs + n,at,next - 1 < end ? next - 1 : end);
+      }
+      continue;
+    }
+    pieces = (int)((double)job->opts->segments * (end - begin + 1) / missing);
+    if(pieces < 1)
+      pieces = 1;
+    chunk = (end - begin + 1) / pieces;
+    if(chunk < SEGMENT_MIN) {
+      pieces = (end - begin + 1) / SEGMENT_MIN ? (end - begin + 1) / SEGMENT_MIN : 1;
+      chunk  = (end - begin + 1) / pieces;
+    }
+    if(add) {
+      for(i = 0 ; i < pieces - 1 ; i++)
+        add_segment(job,job->segs + n + i,
+                    begin + i * chunk,begin + (i + 1) * chunk - 1);
+      add_segment(job,job->segs + n + i,begin + i * chunk,end);
+    }
+    n += pieces;
+  }
+  return n;
+}
+
+/* Remember the offsets the next checkpoint may trust. */
+static void mark(struct job *job)
+{
+  register struct segment *seg;
+  if(job->writer_on)
+    job->mark = writer_pushed(&job->writer);
+  for(seg = job->segs ; seg < job->segs + job->nsegs ; seg++)
+    seg->mark = seg->offset;
+}
+
+/* Sync the output and then record in the journal what is now safe.
+   With the writer stage the offsets are only known to be on disk once
+   the writer went past the mark taken at the previous checkpoint, so
+   the journal lags one checkpoint behind. */
+static void checkpoint(struct job *job)
+{
+  register struct segment *seg;
+  register int i;
+
+  if(!job->journal_on)
+    return;
+  if(!job->writer_on)
+    mark(job);
+  else if(writer_done(&job->writer) < job->mark)
+    return;
+  if(fdatasync(job->o_desc) == -1) {
+    perror("Cannot sync output file");
+    return;
+  }
+  for(seg = job->segs ; seg < job->segs + job->nsegs ; seg++) {
+    /* a piece is only trusted once its hash matched */
+    if(job->hashed && !seg->over)
+      continue;
+    /* the parts of a batch are written right away but not in order */
+    if(seg->batch) {
+      for(i = 0 ; seg->over && i < seg->batch->nparts ; i++)
+        journal_add(&job->journal,seg->batch->parts[i].begin,
+                    seg->batch->parts[i].end);
+      continue;
+    }
+    journal_add(&job->journal,seg->begin,seg->mark - 1);
+    seg->begin = seg->mark;
+  }
+  journal_save(&job->journal);
+  mark(job);
+}
+
+static gboolean callback_checkpoint(gpointer data)
+{
+  checkpoint(JOB_T(data));
+  return true;
+}
+
+static void free_segments(struct job *job)
+{
+  register struct engine *engine = &job->ctx->engine;
+  register int i;
+  if(job->scanner) {
+    job->scan_stop = true;
+    g_thread_join(job->scanner);
+    job->scanner = NULL;
+  }
+  if(job->probe.curl) {
+    engine_remove(engine,job->probe.curl);
+    curl_easy_cleanup(job->probe.curl);
+    job->probe.curl = NULL;
+  }
+  if(job->check_timer)
+    g_source_remove(job->check_timer);
+  job->check_timer = 0;
+  if(job->retry_timer)
+    g_source_remove(job->retry_timer);
+  job->retry_timer = 0;
+  for(i = 0 ; i < job->nsegs ; i++) {
+    if(job->segs[i].throttle)
+      g_source_remove(job->segs[i].throttle);
+    free(job->segs[i].batch);
+    /* none for the segments waiting for a connection */
+    if(!job->segs[i].curl)
+      continue;
+    engine_remove(engine,job->segs[i].curl);
+    curl_easy_cleanup(job->segs[i].curl);
+  }
+  free(job->segs);
+  job->segs  = NULL;
+  job->nsegs = 0;
+}
+
+static void quit(struct ctx *ctx)
+{
+  if(ctx->headless)
+    g_main_loop_quit(ctx->loop);
+  else
+    gtk_main_quit();
+}
+
+static void json_string(FILE *fp, const char *str)
+{
+  fputc('"',fp);
+  for( ; *str ; str++) {
+    if(*str == '"' || *str == '\\')
+      fprintf(fp,"\\%c",*str);
+    else if((unsigned char)*str < 0x20)
+      fprintf(fp,"\\u%04x",*str);
+    else
+      fputc(*str,fp);
+  }
+  fputc('"',fp);
+}
+
+/* Write one JSON record on a line from the progress snapshot. */
+static void report(struct job *job)
+{
+  register FILE *fp = job->ctx->report;
+  struct progress_data snap;
+
+  progress_read(&job->snapshot,&snap);
+  fprintf(fp,"{\"output\":");
+  json_string(fp,job->path);
+  fprintf(fp,",\"bytes\":%.0f,\"total\":%.0f,\"rate\":%.1f,"
+          "\"smooth\":%.1f,",snap.dlnow,snap.dltot,snap.speed,snap.smooth);
+  if(snap.eta < 0.)
+    fprintf(fp,"\"eta\":null,");
+  else
+    fprintf(fp,"\"eta\":%.1f,",snap.eta);
+  fprintf(fp,"\"state\":\"%s\"",states[job->state]);
+  if(job->served)
+    fprintf(fp,",\"cached\":true");
+  if(job->zsync.sums)
+    fprintf(fp,",\"saved\":%lld,\"fetched\":%lld",
+            (long long)job->saved,(long long)job->fetched);
+  if(job->retries)
+    fprintf(fp,",\"retries\":%d,\"lost\":%.1f",job->retries,job->lost);
+  if(job->state == STATE_FAIL) {
+    fprintf(fp,",\"error\":");
+    json_string(fp,job->mismatch ? "Checksum mismatch" :
+                curl_easy_strerror(job->err));
+  }
+  fprintf(fp,"}\n");
+}
+
+/* One record per running job. */
+static gboolean callback_report(gpointer data)
+{
+  register struct job *job;
+  for(job = CTX_T(data)->jobs ; job ; job = job->next)
+    report(job);
+  fflush(CTX_T(data)->report);
+  return true;
+}
+
+static void merge_hot(struct hot *to, const struct hot *from)
+{
+  histogram_merge(&to->data,&from->data);
+  histogram_merge(&to->bytes,&from->bytes);
+  histogram_merge(&to->gap,&from->gap);
+  histogram_merge(&to->progress,&from->progress);
+  histogram_merge(&to->stall,&from->stall);
+}
+
+/* One JSON record on a line, for a file or for the totals. */
+static void dump_hot(struct ctx *ctx, const char *path, const struct hot *hot)
+{
+  register FILE *fp = ctx->stats ? ctx->stats : stderr;
+
+  if(path) {
+    fprintf(fp,"{\"output\":");
+    json_string(fp,path);
+    fprintf(fp,",\"histograms\":{");
+  }
+  else
+    fprintf(fp,"{\"totals\":{\"histograms\":{");
+  fprintf(fp,"\"data_ns\":");
+  histogram_json(fp,&hot->data);
+  fprintf(fp,",\"data_bytes\":");
+  histogram_json(fp,&hot->bytes);
+  fprintf(fp,",\"gap_ns\":");
+  histogram_json(fp,&hot->gap);
+  fprintf(fp,",\"progress_ns\":");
+  histogram_json(fp,&hot->progress);
+  fprintf(fp,",\"stall_ns\":");
+  histogram_json(fp,&hot->stall);
+  fprintf(fp,path ? "}}\n" : "}}}\n");
+  fflush(fp);
+}
+
+static void add_row(struct job *job)
+{
+  register struct ctx *ctx = job->ctx;
+  if(!ctx->store)
+    return;
+  gtk_list_store_append(ctx->store,&job->iter);
+  gtk_list_store_set(ctx->store,&job->iter,
+                     COL_JOB,job,
+                     COL_FILE,job->path,
+                     COL_PCT,0,
+                     COL_STATE,states[STATE_RUN],
+                     -1);
+  job->row = true;
+  job->shown_pct = 0;
+  job->shown_now = -1.;
+}
+
+static void show_state(struct job *job)
+{
+  if(job->row)
+    gtk_list_store_set(job->ctx->store,&job->iter,
+                       COL_STATE,states[job->state],-1);
+}
+
+/* Format the figures of a row, only done for the visible ones. */
+static void row_text(struct ctx *ctx, struct job *job)
+{
+  char now[STRLEN_MAX],tot[STRLEN_MAX],size[STRLEN_MAX];
+  char speed[STRLEN_MAX],eta[STRLEN_MAX];
+  struct progress_data snap;
+
+  progress_read(&job->snapshot,&snap);
+  if(snap.dlnow == job->shown_now && snap.smooth == job->shown_speed)
+    return;
+  job->shown_now   = snap.dlnow;
+  job->shown_speed = snap.smooth;
+  format_nbr(ctx,now,"",snap.dlnow);
+  format_nbr(ctx,tot,"",snap.dltot);
+  snprintf(size,STRLEN_MAX,"%s / %s",now,tot);
+  format_nbr(ctx,speed,"ps",snap.smooth);
+  format_eta(eta,snap.eta);
+  gtk_list_store_set(ctx->store,&job->iter,
+                     COL_SIZE,size,
+                     COL_SPEED,speed,
+                     COL_ETA,eta,
+                     -1);
+}
+
+/* Batch the row updates of a frame. The progress of every job is a
+   plain integer, the text is only formatted for the visible rows at
+   the pace of the status. */
+static void update_rows(struct ctx *ctx, bool text)
+{
+  register struct job *job;
+  struct progress_data snap;
+  GtkTreePath *first,*last;
+  GtkTreeIter iter;
+  gpointer data;
+  int pct,n;
+
+  for(job = ctx->jobs ; job ; job = job->next) {
+    if(!job->row)
+      continue;
+    progress_read(&job->snapshot,&snap);
+    pct = snap.dltot > 0. ? (int)(100. * snap.dlnow / snap.dltot) : 0;
+    pct = pct > 100 ? 100 : pct;
+    if(pct == job->shown_pct)
+      continue;
+    job->shown_pct = pct;
+    gtk_list_store_set(ctx->store,&job->iter,COL_PCT,pct,-1);
+  }
+  if(!text || !gtk_tree_view_get_visible_range(GTK_TREE_VIEW(ctx->view),
+                                                &first,&last))
+    return;
+  n = gtk_tree_path_get_indices(last)[0] - gtk_tree_path_get_indices(first)[0];
+  if(gtk_tree_model_get_iter(GTK_TREE_MODEL(ctx->store),&iter,first)) {
+    do {
+      gtk_tree_model_get(GTK_TREE_MODEL(ctx->store),&iter,COL_JOB,&data,-1);
+      if(data)
+        row_text(ctx,JOB_T(data));
+    } while(n-- > 0 &&
+            gtk_tree_model_iter_next(GTK_TREE_MODEL(ctx->store),&iter));
+  }
+  gtk_tree_path_free(first);
+  gtk_tree_path_free(last);
+}
+
+/* The row of a job over keeps its final figures. Only the last
+   DONE_ROWS_MAX ones are kept so that the list does not grow with the
+   queue. */
+static void end_row(struct job *job)
+{
+  register struct ctx *ctx = job->ctx;
+  int last;
+
+  if(!job->row)
+    return;
+  job->shown_now = -1.;
+  row_text(ctx,job);
+  gtk_list_store_set(ctx->store,&job->iter,
+                     COL_JOB,NULL,
+                     COL_PCT,job->state == STATE_DONE ? 100 : job->shown_pct,
+                     COL_STATE,job->mismatch ? "checksum mismatch" :
+                               states[job->state],
+                     -1);
+  if(ctx->done_count == DONE_ROWS_MAX) {
+    gtk_list_store_remove(ctx->store,ctx->done_rows + ctx->done_first);
+    ctx->done_first = (ctx->done_first + 1) % DONE_ROWS_MAX;
+    ctx->done_count--;
+  }
+  last = (ctx->done_first + ctx->done_count) % DONE_ROWS_MAX;
+  ctx->done_rows[last] = job->iter;
+  ctx->done_count++;
+  job->row = false;
+}
+
+/* Leave once the queue is over, the jobs stopped by a signal or by the
+   window are only freed on exit. */
+static void stop(struct ctx *ctx)
+{
+  if(ctx->stopped)
+    return;
+  /* an open window keeps taking the downloads of other instances */
+  if(ctx->server.fd != -1 && !ctx->headless && !ctx->close_on_finish &&
+     !ctx->abort_transfer)
+    return;
+  server_free(&ctx->server);
+  ctx->stopped = true;
+  if(ctx->timer) {
+    /* show the final state before the GUI stops sampling */
+    ctx->frames = 0;
+    if(!ctx->headless)
+      callback_timer(ctx);
+    g_source_remove(ctx->timer);
+    ctx->timer = 0;
+  }
+  if(ctx->headless)
+    quit(ctx);
+  else if(ctx->close_on_finish)
+    gtk_main_quit();
+}
+
+static gboolean callback_fill(gpointer data);
+
+/* Start the next jobs from the main loop, never from the callbacks of
+   the job which just ended. */
+static void refill(struct ctx *ctx)
+{
+  if(!ctx->filler)
+    ctx->filler = g_idle_add(callback_fill,ctx);
+}
+
+static void release(struct job *job)
+{
+  register struct ctx *ctx = job->ctx;
+  register struct job **j,**f,*l;
+  struct progress_data snap;
+
+  free_segments(job);
+  if(job->writer_on)
+    writer_free(&job->writer);
+  digest_free(&job->digest);
+  /* the threads are over, drop what they scheduled for this job */
+  while(g_idle_remove_by_data(job));
+  if(job->o_desc != -1 && close(job->o_desc) == -1)
+    perror("Cannot close");
+  journal_free(&job->journal);
+  curl_slist_free_all(job->headers);
+  curl_slist_free_all(job->conditions);
+  metalink_free(&job->metalink);
+  free(job->mirrors);
+  zsync_free(&job->zsync);
+  if(job->seed_fd != -1)
+    close(job->seed_fd);
+  if(job->found)
+    g_array_free(job->found,true);
+  if(job->leader) {
+    for(f = &job->leader->followers ; *f != job ; f = &(*f)->next_follower);
+    *f = job->next_follower;
+    ctx->nfollowing--;
+  }
+  /* only on exit, a job over hands its followers over before */
+  for(l = job->followers ; l ; l = l->next_follower) {
+    l->leader = NULL;
+    ctx->nfollowing--;
+  }
+  if(job->tee_timer)
+    g_source_remove(job->tee_timer);
+  if(job->tee_fd != -1)
+    close(job->tee_fd);
+  journal_free(&job->disk);
+  journal_free(&job->copied);
+
+  progress_read(&job->snapshot,&snap);
+  ctx->done_now += snap.dlnow;
+  ctx->done_tot += snap.dltot > snap.dlnow ? snap.dltot : snap.dlnow;
+  if(job->state != STATE_DONE)
+    ctx->nfailed++;
+  for(j = &ctx->jobs ; *j != job ; j = &(*j)->next);
+  *j = job->next;
+  ctx->njobs--;
+  if(job->suspended)
+    ctx->nsuspended--;
+  if(job->host)
+    bandwidth_unhost(&ctx->bandwidth,job->record->host);
+  queue_done(&ctx->queue,job->record);
+  free(job);
+}
+
+/* Give the file from the cache, nothing is transferred. */
+static bool serve(struct job *job, const char *object)
+{
+  struct progress_data data;
+  off_t size;
+
+  if(!cache_fetch(&job->ctx->cache,job->url,object,job->path,&size))
+    return false;
+  job->served = true;
+  job->length = size;
+  memset(&data,0,sizeof(struct progress_data));
+  data.dlnow = (double)size;
+  data.dltot = (double)size;
+  progress_publish(&job->snapshot,&data);
+  if(job->opts->verbose)
+    fprintf(stderr,"%s: served from the cache\n",job->path);
+  return true;
+}
+
+/* A file whose hash is known may be in the cache whatever its URL. */
+static bool cached(struct job *job)
+{
+  char object[OBJECT_MAX];
+
+  if(!job->ctx->cache.dir || !job->checksum)
+    return false;
+  cache_object(object,job->checksum);
+  return serve(job,object);
+}
+
+/* Keep a file which was downloaded in the cache, named after its hash.
+   The validators are the ones of the URL, not of a mirror. */
+static void keep(struct job *job)
+{
+  register struct cache *cache = &job->ctx->cache;
+  register const struct mirror *m = job->probe.mirror;
+  char spec[STRLEN_MAX],object[OBJECT_MAX];
+  bool own = !m || !strcmp(m->url,job->url);
+
+  if(job->served || job->state == STATE_ABORT)
+    return;
+  cache->misses++;
+  if(job->state != STATE_DONE || !job->digest.result[0])
+    return;
+  if(job->checksum)
+    cache_object(object,job->checksum);
+  else {
+    snprintf(spec,STRLEN_MAX,"sha256:%s",job->digest.result);
+    cache_object(object,spec);
+  }
+  cache_store(cache,job->url,job->path,object,own ? job->etag : "",
+              own ? job->modified : "");
+}
+
+static void hand_over(struct job *job);
+
+/* Report the outcome once everything is settled. */
+static void conclude(struct job *job, CURLcode err)
+{
+  register struct ctx *ctx = job->ctx;
+  register const struct mirror *m;
+  char saved[STRLEN_MAX],fetched[STRLEN_MAX];
+
+  job->err = err;
+  if(job->mismatch)
+    job->state = STATE_FAIL;
+  else if(!err)
+    job->state = STATE_DONE;
+  else if(err == CURLE_ABORTED_BY_CALLBACK)
+    job->state = STATE_ABORT;
+  else
+    job->state = STATE_FAIL;
+  if(ctx->headless) {
+    report(job);
+    fflush(ctx->report);
+  }
+  if(job->mismatch)
+    fprintf(stderr,"%s: Checksum mismatch: expected %s, got %s\n",
+            job->path,job->digest.expected,job->digest.result);
+  else if(err && err != CURLE_ABORTED_BY_CALLBACK)
+    fprintf(stderr,"%s: %s\n",job->path,curl_easy_strerror(err));
+  if(job->opts->verbose)
+    for(m = job->mirrors ; m < job->mirrors + job->nmirrors ; m++)
+      fprintf(stderr,"%s: %.0f bytes from %s%s\n",job->path,m->received,
+              m->url,m->dropped ? " (dropped)" : "");
+  if(job->retries) {
+    fprintf(stderr,"%s: tried again %d times, %.1f s lost\n",job->path,
+            job->retries,job->lost);
+    ctx->retries += job->retries;
+    ctx->lost    += job->lost;
+  }
+  if(job->found && job->state != STATE_ABORT) {
+    format_nbr(ctx,saved,"",(double)job->saved);
+    format_nbr(ctx,fetched,"",(double)job->fetched);
+    fprintf(stderr,"%s: %s reused from %s, %s fetched\n",job->path,saved,
+            job->seed_path,fetched);
+  }
+  /* the older copy moved aside is only needed until the file is over */
+  if(job->state == STATE_DONE && job->seed_aside &&
+     unlink(job->seed_path) == -1 && errno != ENOENT)
+    perror("Cannot remove the older copy");
+  if(ctx->cache.dir)
+    keep(job);
+  if(job->followers)
+    hand_over(job);
+  if(ctx->histograms) {
+    dump_hot(ctx,job->path,&job->hot);
+    merge_hot(&ctx->hot,&job->hot);
+  }
+  end_row(job);
+  release(job);
+  refill(ctx);
+}
+
+static gboolean callback_verified(gpointer data)
+{
+  /* without a checksum the hash was only for the cache */
+  JOB_T(data)->mismatch = JOB_T(data)->checksum &&
+                          !JOB_T(data)->digest.match;
+  conclude(JOB_T(data),CURLE_OK);
+  return false;
+}
+
+/* The delays still running when the job ends were not lost in full. */
+static void cut_delays(struct job *job)
+{
+  register struct segment *seg;
+  double now = monotonic();
+
+  if(job->probe.retry_at > now)
+    job->lost -= job->probe.retry_at - now;
+  for(seg = job->segs ; seg < job->segs + job->nsegs ; seg++)
+    if(seg->retry_at > now)
+      job->lost -= seg->retry_at - now;
+}
+
+/* Stop every remaining transfer and settle the journal. */
+static void finish(struct job *job, CURLcode err)
+{
+  struct stat st;
+  int werr;
+
+  if(job->finished)
+    return;
+  job->finished = true;
+  if(job->writer_on) {
+    /* the file is only complete once the writer stage is empty */
+    werr = writer_flush(&job->writer);
+    if(werr && (!err || err == CURLE_WRITE_ERROR)) {
+      fprintf(stderr,"Cannot write: %s\n",strerror(werr));
+      err = CURLE_WRITE_ERROR;
+    }
+    mark(job);
+  }
+  if(job->jrn_timer)
+    g_source_remove(job->jrn_timer);
+  job->jrn_timer = 0;
+  if(job->retry_timer)
+    cut_delays(job);
+  if(job->changed)
+    job->journal_on = false;
+  if(err && !job->journal_on)
+    truncate_back(job);
+  if(job->journal_on && err)
+    checkpoint(job);
+  else if(job->opts->resume)
+    journal_remove(&job->journal);
+  free_segments(job);
+
+  if(!err && job->digest.fd != -1 && !fstat(job->o_desc,&st)) {
+    /* the rest of the file goes through the hash in one pass */
+    job->state = STATE_VERIFY;
+    digest_end(&job->digest,st.st_size);
+    return;
+  }
+  conclude(job,err);
+}
+
+static gboolean callback_scan(gpointer data);
+
+/* Look for the blocks of the file in the seed and copy them in place,
+   off the main loop which takes it back in callback_scan. */
+static gpointer proceed_scan(gpointer data)
+{
+  register struct job *job = JOB_T(data);
+  off_t *map;
+
+  map = zsync_match(&job->zsync,job->seed_fd,&job->scan_stop);
+  if(map)
+    job->saved = zsync_copy(&job->zsync,map,job->seed_fd,job->o_desc,
+                            job->found,&job->scan_stop);
+  g_free(map);
+  if(!job->scan_stop)
+    g_idle_add(callback_scan,job);
+  return NULL;
+}
+
+/* Start the scan of the seed, false without one. */
+static bool scan(struct job *job)
+{
+  job->scanned = true;
+  job->seed_fd = open(job->seed_path,O_RDONLY);
+  if(job->seed_fd == -1) {
+    /* the output moved aside may just not be there yet */
+    if(errno != ENOENT || !job->seed_aside)
+      fprintf(stderr,"Cannot open %s: %s\n",job->seed_path,strerror(errno));
+    return false;
+  }
+  posix_fadvise(job->seed_fd,0,0,POSIX_FADV_SEQUENTIAL);
+  /* the blocks are copied at their own offset */
+  if(ftruncate(job->o_desc,job->length) == -1) {
+    perror("Cannot resize output file");
+    return false;
+  }
+  job->found   = g_array_new(false,false,sizeof(struct range));
+  job->scanner = g_thread_new("scan",proceed_scan,job);
+  return true;
+}
+
+/* Split the file in byte ranges, one per connection. When the server
+   does not accept ranges we fall back to a single stream. With a zsync
+   file the ranges are only the ones missing from the seed. */
+static void split(struct job *job, bool ranged)
+{
+  register guint i;
+  int n = 1;
+
+  if(ranged && job->zsync.sums && !job->scanned && scan(job))
+    return;
+  if(ranged) {
+    if(job->opts->resume)
+      resume(job);
+    else
+      job->journal.length = job->length;
+    for(i = 0 ; job->found && i < job->found->len ; i++)
+      journal_add(&job->journal,g_array_index(job->found,struct range,i).begin,
+                  g_array_index(job->found,struct range,i).end);
+    setup_pieces(job);
+    n = split_holes(job,false);
+  }
+  else if(job->opts->resume) {
+    /* nothing we have on disk can be trusted */
+    if(ftruncate(job->o_desc,0) == -1)
+      perror("Cannot truncate output file");
+    journal_remove(&job->journal);
+  }
+  if(ranged && !allocate(job,job->length)) {
+    finish(job,CURLE_WRITE_ERROR);
+    return;
+  }
+
+  job->segs     = xmalloc((n ? n : 1) * sizeof(struct segment));
+  job->nsegs    = n;
+  job->capacity = n ? n : 1;
+  job->running  = n;
+  if(!job->piece)
+    job->conns = n;
+  memset(job->segs,0,(n ? n : 1) * sizeof(struct segment));
+  if(!job->journal.length) {
+    /* a single stream from the start can be hashed on the fly */
+    job->digest_stream = job->digest.fd != -1;
+    add_segment(job,job->segs,0,-1);
+    dispatch(job);
+    return;
+  }
+
+  /* segments write at their own offset so the file must be sized */
+  if(ftruncate(job->o_desc,job->length) == -1)
+    perror("Cannot resize output file");
+  split_holes(job,true);
+  dispatch(job);
+  if(job->journal_on)
+    job->jrn_timer = g_timeout_add(JOURNAL_DELTA,callback_checkpoint,job);
+  if(!n)
+    finish(job,CURLE_OK);
+}
+
+static gboolean callback_scan(gpointer data)
+{
+  register struct job *job = JOB_T(data);
+
+  g_thread_join(job->scanner);
+  job->scanner = NULL;
+  if(job->opts->verbose)
+    fprintf(stderr,"%s: %lld bytes found in %s\n",job->path,
+            (long long)job->saved,job->seed_path);
+  split(job,true);
+  return false;
+}
+
+/* Hash the pieces of the metalink within a range of the file. Only the
+   pieces which are whole in the range are checked, the ranges are
+   aligned on them unless they come from the journal of another run. */
+static bool check_range(struct job *job, const struct segment *seg)
+{
+  register const struct metalink *ml = &job->metalink;
+  off_t i,begin,end;
+  bool ok = true;
+  int fd = open(job->path,O_RDONLY);
+
+  if(fd == -1) {
+    perror("Cannot open output file for verification");
+    return false;
+  }
+  for(i = (seg->from + ml->piece_length - 1) / ml->piece_length ;
+      ok && i < ml->pieces->len ; i++) {
+    begin = i * ml->piece_length;
+    end   = begin + ml->piece_length < ml->size ?
+            begin + ml->piece_length - 1 : ml->size - 1;
+    if(end > seg->end)
+      break;
+    ok = digest_check(g_ptr_array_index(ml->pieces,i),fd,begin,
+                      end - begin + 1);
+  }
+  close(fd);
+  return ok;
+}
+
+static gboolean callback_check(gpointer data);
+
+/* Check the ranges whose bytes all left the writer stage. A range which
+   does not match is taken again from another mirror. */
+static void verify_pieces(struct job *job)
+{
+  register struct segment *seg;
+  uint64_t done = job->writer_on ? writer_done(&job->writer) : 0;
+
+  for(seg = job->segs ; seg < job->segs + job->nsegs ; seg++) {
+    if(!seg->checking || seg->pushed > done)
+      continue;
+    seg->checking = false;
+    job->checking--;
+    if(check_range(job,seg)) {
+      seg->over = true;
+      job->running--;
+      continue;
+    }
+    if(!seg->mirror) {
+      fprintf(stderr,"%s: bytes %lld-%lld do not match the metalink\n",
+              job->path,(long long)seg->from,(long long)seg->end);
+      finish(job,CURLE_RECV_ERROR);
+      return;
+    }
+    drop(job,seg->mirror,"pieces do not match the metalink");
+    if(!job->alive) {
+      finish(job,CURLE_RECV_ERROR);
+      return;
+    }
+    seg->begin  = seg->from;
+    seg->offset = seg->from;
+    seg->mark   = seg->from;
+    seg->dlnow  = 0.;
+  }
+  if(job->writer_on && writer_error(&job->writer)) {
+    finish(job,CURLE_WRITE_ERROR);
+    return;
+  }
+  if(!job->running) {
+    finish(job,CURLE_OK);
+    return;
+  }
+  dispatch(job);
+  if(job->checking && !job->check_timer)
+    job->check_timer = g_timeout_add(CHECK_DELTA,callback_check,job);
+}
+
+static gboolean callback_check(gpointer data)
+{
+  JOB_T(data)->check_timer = 0;
+  verify_pieces(JOB_T(data));
+  return false;
+}
+
+/* One JSON record on a line with the timing of a transfer. */
+static void stats(struct segment *seg, CURL *curl, CURLcode result)
+{
+  register struct job *job = seg->job;
+  register FILE *fp = job->ctx->stats;
+  register struct timing *sum = &job->ctx->sum;
+  struct timing timing;
+  bool reused;
+
+  engine_timing(curl,&timing);
+  /* a transfer which could not connect did not open a connection either */
+  reused = !timing.connects && timing.starttransfer > 0.;
+  job->ctx->stats_count++;
+  if(result)
+    job->ctx->stats_failed++;
+  if(reused)
+    job->ctx->stats_reused++;
+  sum->namelookup    += timing.namelookup;
+  sum->connect       += timing.connect;
+  sum->appconnect    += timing.appconnect;
+  sum->starttransfer += timing.starttransfer;
+  sum->total         += timing.total;
+  sum->size          += timing.size;
+  sum->redirects     += timing.redirects;
+  sum->connects      += timing.connects;
+
+  fprintf(fp,"{\"output\":");
+  json_string(fp,job->path);
+  fprintf(fp,",\"url\":");
+  json_string(fp,seg->mirror ? seg->mirror->url : job->url);
+  fprintf(fp,",\"kind\":\"%s\",\"error\":",
+          seg == &job->probe ? "probe" : seg->end >= 0 ? "range" : "stream");
+  if(result)
+    json_string(fp,curl_easy_strerror(result));
+  else
+    fprintf(fp,"null");
+  fprintf(fp,",\"namelookup\":%.6f,\"connect\":%.6f,"
+          "\"appconnect\":%.6f,\"starttransfer\":%.6f,\"total\":%.6f,"
+          "\"size\":%lld,\"speed\":%lld,\"redirects\":%ld,"
+          "\"reused\":%s}\n",
+          timing.namelookup,timing.connect,timing.appconnect,
+          timing.starttransfer,timing.total,(long long)timing.size,
+          (long long)timing.speed,
+          timing.redirects,reused ? "true" : "false");
+  fflush(fp);
+}
+
+/* Answer of a probe which asked whether the file in the cache is still
+   the one of the URL. */
+static bool unchanged(struct job *job)
+{
+  long code = 0;
+
+  curl_easy_getinfo(job->probe.curl,CURLINFO_RESPONSE_CODE,&code);
+  if(code != 304)
+    return false;
+  curl_easy_cleanup(job->probe.curl);
+  job->probe.curl = NULL;
+  curl_slist_free_all(job->conditions);
+  job->conditions = NULL;
+  if(!serve(job,job->object)) {
+    /* dropped from the cache since, the file is asked again */
+    probe(job);
+    return true;
+  }
+  job->ctx->cache.revalidated++;
+  if(job->opts->resume)
+    journal_remove(&job->journal);
+  conclude(job,CURLE_OK);
+  return true;
+}
+
+static void callback_done(void *data, CURL *curl, CURLcode result)
+{
+  register struct segment *seg = SEG_T(data);
+  register struct job *job = seg->job;
+  double after;
+  bool ranged;
+
+  /* stopped at the end of a range which was cut */
+  if(result == CURLE_WRITE_ERROR && seg->cut && seg->offset == seg->end + 1)
+    result = CURLE_OK;
+  if(job->ctx->stats)
+    stats(seg,curl,result);
+  after = result ? transient(curl,result) : -1.;
+  if(seg == &job->probe) {
+    if(!result && job->conditions && unchanged(job))
+      return;
+    ranged = probed(job,result);
+    if(!result && ranged && seg->mirror && job->metalink.size >= 0 &&
+       job->length != job->metalink.size)
+      seg->reject = "not the size of the metalink";
+    if(!result && ranged && job->zsync.sums &&
+       job->length != job->zsync.length)
+      seg->reject = "not the size of the zsync file";
+    if(result && again(job,seg,result,after))
+      return;
+    if((result || seg->reject) && retry(job,seg,result))
+      probe(job);
+    else if(seg->reject) {
+      if(!seg->mirror)
+        fprintf(stderr,"%s: %s\n",job->path,seg->reject);
+      finish(job,CURLE_RECV_ERROR);
+    }
+    else
+      split(job,ranged);
+    return;
+  }
+  if(seg->throttle)
+    g_source_remove(seg->throttle);
+  seg->throttle = 0;
+  seg->paused   = false;
+  curl_easy_cleanup(seg->curl);
+  seg->curl = NULL;
+  if(seg->mirror)
+    seg->mirror->active--;
+  job->active--;
+  /* some servers fail rather than ignore a request of several ranges */
+  if(seg->batch && !job->changed && result != CURLE_ABORTED_BY_CALLBACK &&
+     (result || !batch_over(seg)))
+    single_ranges(job);
+  if(seg->batch && !job->multirange) {
+    /* the parts are asked again one by one */
+    unbatch(job,seg - job->segs);
+    dispatch(job);
+    return;
+  }
+  if(result && again(job,seg,result,after))
+    return;
+  if(result && retry(job,seg,result)) {
+    dispatch(job);
+    return;
+  }
+  /* one failed segment makes the whole file useless */
+  if(result) {
+    finish(job,result);
+    return;
+  }
+  if(job->hashed) {
+    seg->checking = true;
+    seg->pushed   = job->writer_on ? writer_pushed(&job->writer) : 0;
+    job->checking++;
+    verify_pieces(job);
+    return;
+  }
+  seg->over = true;
+  job->running--;
+  if(!job->running)
+    finish(job,CURLE_OK);
+  else
+    dispatch(job);
+}
+
+/* Ask the server for the file only if it changed since it went in the
+   cache. */
+static void conditions(struct job *job)
+{
+  register const struct cache_entry *entry;
+  char header[STRLEN_MAX];
+
+  if(!job->ctx->cache.dir ||
+     !(entry = cache_lookup(&job->ctx->cache,job->url)))
+    return;
+  strcpy(job->object,entry->object);
+  if(entry->etag[0]) {
+    snprintf(header,STRLEN_MAX,"If-None-Match: %s",entry->etag);
+    job->conditions = curl_slist_append(job->conditions,header);
+  }
+  if(entry->modified[0]) {
+    snprintf(header,STRLEN_MAX,"If-Modified-Since: %s",entry->modified);
+    job->conditions = curl_slist_append(job->conditions,header);
+  }
+}
+
+static void start(struct job *job)
+{
+  gettimeofday(&job->dl_begin,NULL);
+  job->state = STATE_RUN;
+  conditions(job);
+  if(job->opts->segments > 1 || job->opts->resume || job->nmirrors ||
+     job->metalink.urls || job->zsync.sums || job->conditions)
+    probe(job);
+  else
+    split(job,false);
+}
+
+/* The writer stage has room again. */
+static gboolean callback_resume(gpointer data)
+{
+  register struct segment *seg;
+  for(seg = JOB_T(data)->segs ;
+      seg < JOB_T(data)->segs + JOB_T(data)->nsegs ;
+      seg++) {
+    if(!seg->paused || !seg->curl)
+      continue;
+    seg->paused = false;
+    if(JOB_T(data)->ctx->histograms)
+      histogram_add(&JOB_T(data)->hot.stall,nanotime() - seg->paused_at);
+    curl_easy_pause(seg->curl,CURLPAUSE_CONT);
+  }
+  return false;
+}
+
+/* Called from the writer thread. */
+static void callback_written(gpointer data, uint64_t done)
+{
+  if(JOB_T(data)->digest_stream)
+    digest_feed(&JOB_T(data)->digest,(off_t)done);
+}
+
+/* Share the bandwidth between the running transfers by the weight of
+   their job, a job gets the same share whatever its number of segments.
+   A transfer which did not use its share, because of the server or of
+   the limit of its host or job, is capped to a bit more than what it
+   used so that the others get the rest. */
+static gboolean callback_schedule(gpointer data)
+{
+  register struct ctx *ctx = CTX_T(data);
+  register struct job *job;
+  register struct segment *seg;
+  register struct share *share;
+  struct share *shares;
+  double now,delta,total,used,cap;
+  int n = 0;
+
+  now   = monotonic();
+  delta = now - ctx->sched_stamp;
+  ctx->sched_stamp = now;
+  total = profile_rate(&ctx->bandwidth.profile,time(NULL));
+  bucket_rate(&ctx->bandwidth.global,total,now);
+
+  /* the segments of a job are freed as soon as it is over */
+  for(job = ctx->jobs ; job ; job = job->next) {
+    if(job->host)
+      job->host->weight = 0.;
+    if(job->nsegs && !job->suspended)
+      n += job->active;
+  }
+  if(!n)
+    return true;
+  for(job = ctx->jobs ; job ; job = job->next)
+    if(job->host && job->nsegs && job->active && !job->suspended)
+      job->host->weight += job->weight;
+
+  share = shares = xmalloc(n * sizeof(struct share));
+  for(job = ctx->jobs ; job ; job = job->next) {
+    for(seg = job->segs ; seg < job->segs + job->nsegs ; seg++) {
+      if(!seg->curl)
+        continue;
+      share->weight = job->weight / job->active;
+      share->cap    = job->bucket.rate / job->active;
+      if(job->host) {
+        cap = ctx->bandwidth.host_rate * share->weight / job->host->weight;
+        share->cap = share->cap > 0. && share->cap < cap ? share->cap : cap;
+      }
+      used = (seg->offset - seg->sched_mark) / delta;
+      if(total > 0. && seg->bucket.rate > 0. && !seg->starved &&
+         used < seg->bucket.rate * DEMAND_RATIO) {
+        /* bursty servers send nothing for a while */
+        cap = used * DEMAND_HEADROOM;
+        cap = cap > seg->bucket.rate * DEMAND_DECAY ?
+              cap : seg->bucket.rate * DEMAND_DECAY;
+        cap = cap > SHARE_MIN ? cap : SHARE_MIN;
+        share->cap = share->cap > 0. && share->cap < cap ? share->cap : cap;
+      }
+      seg->starved    = false;
+      seg->sched_mark = seg->offset;
+      share++;
+    }
+  }
+  share_fair(shares,n,total);
+  share = shares;
+  for(job = ctx->jobs ; job ; job = job->next)
+    for(seg = job->segs ; seg < job->segs + job->nsegs ; seg++)
+      if(seg->curl)
+        bucket_rate(&seg->bucket,(share++)->rate,now);
+  free(shares);
+  return true;
+}
+
+/* Some limit is set, the transfers go through the buckets from now on. */
+static void shape(struct ctx *ctx)
+{
+  if(ctx->shaping)
+    return;
+  ctx->shaping     = true;
+  ctx->sched_stamp = monotonic();
+  ctx->sched       = g_timeout_add(SCHED_DELTA,callback_schedule,ctx);
+}
+
+static bool setup_digest(struct job *job)
+{
+  if(job->checksum) {
+    if(!digest_parse(&job->digest,job->checksum)) {
+      fprintf(stderr,"Invalid checksum \"%s\"\n",job->checksum);
+      return false;
+    }
+  }
+  else if(job->ctx->cache.dir)
+    /* nothing to check, the hash only names the file in the cache */
+    digest_init(&job->digest,G_CHECKSUM_SHA256);
+  else
+    return true;
+  if(digest_start(&job->digest,job->path,callback_verified,job))
+    return true;
+  perror("Cannot open output file for verification");
+  return false;
+}
+
+static bool setup_writer(struct job *job)
+{
+  register int size = job->opts->buffer;
+
+  if(!size)
+    return true;
+  if(size < BUFFER_MIN)
+    size = BUFFER_MIN;
+  if(!writer_init(&job->writer,job->o_desc,(size_t)size * 1024,
+                  callback_resume,job)) {
+    fprintf(stderr,"Cannot allocate writer buffer\n");
+    return false;
+  }
+  job->writer.written = callback_written;
+  job->writer_on = true;
+  return true;
+}
+
+static void add_mirror(struct job *job, const char *url)
+{
+  register struct mirror *m;
+
+  for(m = job->mirrors ; m < job->mirrors + job->nmirrors ; m++)
+    if(!strcmp(m->url,url))
+      return;
+  memset(m,0,sizeof(struct mirror));
+  m->url = url;
+  rate_init(&m->rate,RATE_WINDOW);
+  job->nmirrors++;
+  job->alive++;
+}
+
+/* The servers of the file: the URL of the record first, then the
+   mirrors of the options and of the metalink. */
+static bool setup_mirrors(struct job *job)
+{
+  register const struct opts *opts = job->opts;
+  register const struct s_list *l;
+  register guint i;
+  int n = 1;
+
+  if(opts->metalink && !metalink_load(&job->metalink,opts->metalink))
+    return false;
+  job->checksum = opts->checksum ? opts->checksum :
+                  job->metalink.checksum[0] ? job->metalink.checksum : NULL;
+  for(l = opts->mirrors ; l ; l = l->next)
+    n++;
+  if(job->metalink.urls)
+    n += job->metalink.urls->len;
+  if(n == 1)
+    return true;
+  job->mirrors = xmalloc(n * sizeof(struct mirror));
+  add_mirror(job,job->url);
+  for(l = opts->mirrors ; l ; l = l->next)
+    add_mirror(job,l->string);
+  for(i = 0 ; job->metalink.urls && i < job->metalink.urls->len ; i++)
+    add_mirror(job,g_ptr_array_index(job->metalink.urls,i));
+  if(job->nmirrors == 1) {
+    free(job->mirrors);
+    job->mirrors  = NULL;
+    job->nmirrors = 0;
+    job->alive    = 0;
+  }
+  return true;
+}
+
+/* The blocks of the file and its hash unless one is given. */
+static bool setup_delta(struct job *job)
+{
+  if(!job->opts->zsync)
+    return true;
+  if(!zsync_load(&job->zsync,job->opts->zsync))
+    return false;
+  if(!job->checksum && job->zsync.checksum[0])
+    job->checksum = job->zsync.checksum;
+  return true;
+}
+
+static bool same_string(const char *a, const char *b)
+{
+  return a == b || (a && b && !strcmp(a,b));
+}
+
+static bool same_list(const struct s_list *a, const struct s_list *b)
+{
+  for( ; a && b ; a = a->next, b = b->next)
+    if(strcmp(a->string,b->string))
+      return false;
+  return !a && !b;
+}
+
+/* Two jobs send the same request when they have the same URL and the
+   options which go in its headers. */
+static bool same_request(const struct job *a, const struct job *b)
+{
+  register const struct opts *x = a->opts, *y = b->opts;
+
+  if(strcmp(a->url,b->url))
+    return false;
+  return x == y ||
+         (!strcmp(x->user_agent,y->user_agent) &&
+          same_string(x->referer,y->referer) &&
+          same_string(x->http_crd,y->http_crd) &&
+          same_string(x->proxy,y->proxy) &&
+          same_string(x->proxy_crd,y->proxy_crd) &&
+          same_string(x->intf,y->intf) && x->dns == y->dns &&
+          same_list(x->cookies,y->cookies) &&
+          same_list(x->cks_path,y->cks_path));
+}
+
+/* A transfer of the same file to follow rather than starting one. */
+static struct job *in_flight(const struct job *job)
+{
+  register struct job *j;
+
+  for(j = job->ctx->jobs ; j ; j = j->next)
+    if(j != job && !j->leader && !j->served && j->o_desc != -1 &&
+       j->state <= STATE_VERIFY && strcmp(j->path,job->path) &&
+       same_request(j,job))
+      return j;
+  return NULL;
+}
+
+/* Without going through user space when the kernel can. */
+static bool copy_out(int from, int to, off_t offset, off_t len)
+{
+  static bool plain = false;
+  char buf[TEE_CHUNK];
+  off_t src = offset,dst = offset;
+  ssize_t n;
+
+  while(len && !plain) {
+    n = copy_file_range(from,&src,to,&dst,len,0);
+    if(n == -1 && errno == EINTR)
+      continue;
+    if(n == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                   errno == EOPNOTSUPP))
+      plain = true;
+    else if(n <= 0)
+      return false;
+    else
+      len -= n;
+  }
+  for(offset = src ; len ; offset += n, len -= n) {
+    n = pread(from,buf,len < TEE_CHUNK ? len : TEE_CHUNK,offset);
+    if(n == -1 && errno == EINTR) {
+      n = 0;
+      continue;
+    }
+    if(n <= 0 || pwrite(to,buf,n,offset) != n)
+      return false;
+  }
+  return true;
+}
+
+/* Add what the transfers of a job put on disk since the last tee. With
+   the writer stage the offsets are only known to be there once the
+   writer went past the mark of the previous tee, as for the journal.
+   Pieces of the metalink only count once their hash matched. */
+static void settled(struct job *job)
+{
+  register struct segment *seg;
+  register int i;
+
+  if(job->writer_on && writer_done(&job->writer) < job->tee_mark)
+    return;
+  for(seg = job->segs ; seg < job->segs + job->nsegs ; seg++) {
+    if(!job->writer_on)
+      seg->teed = seg->offset;
+    if(seg->batch) {
+      /* the parts are written right away */
+      for(i = 0 ; i < seg->batch->nparts ; i++)
+        journal_add(&job->disk,seg->batch->parts[i].begin,
+                    seg->batch->parts[i].begin + seg->batch->got[i] - 1);
+    }
+    else if(!job->hashed || seg->over)
+      journal_add(&job->disk,seg->from,seg->teed - 1);
+    seg->teed = seg->offset;
+  }
+  if(job->writer_on)
+    job->tee_mark = writer_pushed(&job->writer);
+  /* from a previous run or from the seed of a zsync file */
+  for(i = 0 ; i < job->journal.nranges ; i++)
+    journal_add(&job->disk,job->journal.ranges[i].begin,
+                job->journal.ranges[i].end);
+}
+
+/* Copy what the leader has on disk and the follower does not, a late
+   follower first catches up with everything so far. */
+static bool catch_up(struct job *job, struct job *leader)
+{
+  register const struct journal *disk = &leader->disk;
+  struct progress_data data,snap;
+  off_t from,begin,end;
+  register int i;
+
+  if(leader->tee_fd == -1)
+    leader->tee_fd = open(leader->path,O_RDONLY);
+  if(leader->tee_fd == -1)
+    return false;
+  job->copied.length = disk->nranges ?
+                       disk->ranges[disk->nranges - 1].end + 1 : 0;
+  for(i = 0 ; i < disk->nranges ; i++)
+    for(from = disk->ranges[i].begin ;
+        journal_hole(&job->copied,from,&begin,&end) &&
+        begin <= disk->ranges[i].end ;
+        from = end + 1) {
+      end = end < disk->ranges[i].end ? end : disk->ranges[i].end;
+      if(!copy_out(leader->tee_fd,job->o_desc,begin,end - begin + 1))
+        return false;
+      journal_add(&job->copied,begin,end);
+    }
+  progress_read(&leader->snapshot,&snap);
+  data.dlnow  = (double)journal_done(&job->copied);
+  data.dltot  = snap.dltot;
+  rate_sample(&job->rate,monotonic(),data.dlnow);
+  data.speed  = job->rate.instant;
+  data.smooth = job->rate.smooth;
+  data.eta    = snap.eta;
+  progress_publish(&job->snapshot,&data);
+  return true;
+}
+
+static gboolean callback_tee(gpointer data)
+{
+  register struct job *job = JOB_T(data),*f,*next;
+
+  if(!job->followers) {
+    job->tee_timer = 0;
+    return false;
+  }
+  settled(job);
+  for(f = job->followers ; f ; f = next) {
+    next = f->next_follower;
+    if(!catch_up(f,job)) {
+      fprintf(stderr,"%s: Cannot copy from %s: %s\n",f->path,job->path,
+              strerror(errno));
+      finish(f,CURLE_WRITE_ERROR);
+    }
+  }
+  return true;
+}
+
+/* Take the file from the transfer of another job as it comes instead of
+   asking for it again. */
+static void follow(struct job *job, struct job *leader)
+{
+  job->leader        = leader;
+  job->next_follower = leader->followers;
+  leader->followers  = job;
+  job->ctx->nfollowing++;
+  job->ctx->joined++;
+  gettimeofday(&job->dl_begin,NULL);
+  job->state = STATE_RUN;
+  if(!leader->tee_timer)
+    leader->tee_timer = g_timeout_add(TEE_DELTA,callback_tee,leader);
+  if(job->opts->verbose)
+    fprintf(stderr,"%s: following the transfer of %s\n",job->path,
+            leader->path);
+}
+
+/* A follower whose leader failed starts over, after another follower
+   of the same file when there is one. */
+static void rejoin(struct job *job)
+{
+  register struct job *leader = in_flight(job);
+
+  journal_clear(&job->copied);
+  if(leader) {
+    follow(job,leader);
+    return;
+  }
+  if(ftruncate(job->o_desc,0) == -1)
+    perror("Cannot truncate output file");
+  if(!setup_writer(job)) {
+    finish(job,CURLE_WRITE_ERROR);
+    return;
+  }
+  start(job);
+}
+
+/* The followers of a job which is over copy the rest of its file, or
+   start on their own when it failed. The ones of an aborted job are
+   aborted with the others. */
+static void hand_over(struct job *job)
+{
+  register struct job *f;
+  struct stat st;
+  bool done = job->state == STATE_DONE;
+
+  if(done) {
+    /* the file of the cache replaced the one which was open */
+    if(job->tee_fd != -1)
+      close(job->tee_fd);
+    job->tee_fd = open(job->path,O_RDONLY);
+    done = job->tee_fd != -1 && !fstat(job->tee_fd,&st);
+  }
+  if(done) {
+    journal_clear(&job->disk);
+    journal_add(&job->disk,0,st.st_size - 1);
+  }
+  while((f = job->followers)) {
+    job->followers = f->next_follower;
+    f->leader = NULL;
+    job->ctx->nfollowing--;
+    if(job->state == STATE_ABORT)
+      continue;
+    if(!done)
+      rejoin(f);
+    else if(!catch_up(f,job) || ftruncate(f->o_desc,st.st_size) == -1) {
+      fprintf(stderr,"%s: Cannot copy from %s: %s\n",f->path,job->path,
+              strerror(errno));
+      finish(f,CURLE_WRITE_ERROR);
+    }
+    else
+      finish(f,CURLE_OK);
+  }
+}
+
+static void launch(struct ctx *ctx, struct record *record)
+{
+  register struct job *job = xmalloc(sizeof(struct job));
+  struct job *leader;
+  double limit = 0.;
+  int priority;
+  bool ok;
+
+  memset(job,0,sizeof(struct job));
+  job->ctx    = ctx;
+  job->record = record;
+  job->opts   = record->opts ? record->opts : &ctx->opts;
+  job->url    = record->url;
+  job->o_desc = -1;
+  job->seed_fd = -1;
+  job->tee_fd = -1;
+  job->digest.fd = -1;
+  job->metalink.size = -1;
+  progress_init(&job->snapshot);
+  rate_init(&job->rate,RATE_WINDOW);
+  journal_init(&job->journal,job->jrn_path);
+  /* each step of priority doubles the share */
+  priority = job->opts->priority;
+  priority = priority > PRIORITY_MAX ? PRIORITY_MAX : priority;
+  priority = priority < -PRIORITY_MAX ? -PRIORITY_MAX : priority;
+  job->weight = ldexp(1.,priority);
+  if(job->opts->limit)
+    bandwidth_parse(job->opts->limit,&limit);
+  bucket_init(&job->bucket,limit,monotonic());
+  job->host = bandwidth_host(&ctx->bandwidth,record->host,monotonic());
+  if(limit > 0.)
+    shape(ctx);
+  job->next = ctx->jobs;
+  ctx->jobs = job;
+  ctx->njobs++;
+  if(!setup_mirrors(job) || !setup_delta(job)) {
+    add_row(job);
+    conclude(job,CURLE_READ_ERROR);
+    return;
+  }
+  set_path(job);
+  if(cached(job)) {
+    add_row(job);
+    conclude(job,CURLE_OK);
+    return;
+  }
+  leader = in_flight(job);
+  ok = load(job) && (leader || setup_writer(job)) && setup_digest(job);
+  add_row(job);
+  if(!ok) {
+    conclude(job,CURLE_WRITE_ERROR);
+    return;
+  }
+  if(ctx->window)
+    gtk_window_set_title(GTK_WINDOW(ctx->window),job->title);
+  if(leader)
+    follow(job,leader);
+  else
+    start(job);
+}
+
+/* A job may only be suspended when all it has left are ranges, they are
+   taken back from where they stopped. */
+static bool preemptible(const struct job *job)
+{
+  register const struct segment *seg;
+
+  if(job->state != STATE_RUN || job->finished || job->suspended ||
+     !job->nsegs)
+    return false;
+  for(seg = job->segs ; seg < job->segs + job->nsegs ; seg++)
+    if(!seg->over && seg->end < 0)
+      return false;
+  return true;
+}
+
+/* Stop the transfers of a job and free its connections. What was
+   received is in the writer stage or on disk already, a paused chunk
+   is requested again. */
+static void suspend(struct job *job)
+{
+  register struct segment *seg;
+
+  for(seg = job->segs ; seg < job->segs + job->nsegs ; seg++) {
+    if(!seg->curl)
+      continue;
+    if(seg->throttle)
+      g_source_remove(seg->throttle);
+    seg->throttle = 0;
+    seg->paused   = false;
+    engine_remove(&job->ctx->engine,seg->curl);
+    curl_easy_cleanup(seg->curl);
+    seg->curl = NULL;
+    if(seg->mirror)
+      seg->mirror->active--;
+  }
+  job->active    = 0;
+  job->suspended = true;
+  job->state     = STATE_WAIT;
+  job->ctx->nsuspended++;
+  show_state(job);
+  if(job->opts->verbose)
+    fprintf(stderr,"%s: suspended\n",job->path);
+}
+
+static void wake(struct job *job)
+{
+  job->suspended = false;
+  job->state     = STATE_RUN;
+  dispatch(job);
+  job->ctx->nsuspended--;
+  show_state(job);
+  if(job->opts->verbose)
+    fprintf(stderr,"%s: resumed\n",job->path);
+}
+
+/* The suspended job to take back first. */
+static struct job *suspended(struct ctx *ctx)
+{
+  register struct job *job,*best = NULL;
+  for(job = ctx->jobs ; job ; job = job->next)
+    if(job->suspended &&
+       (!best || job->opts->priority > best->opts->priority))
+      best = job;
+  return best;
+}
+
+/* The running job of lowest priority which may be suspended. */
+static struct job *victim(struct ctx *ctx)
+{
+  register struct job *job,*best = NULL;
+  for(job = ctx->jobs ; job ; job = job->next)
+    if(preemptible(job) &&
+       (!best || job->opts->priority < best->opts->priority))
+      best = job;
+  return best;
+}
+
+/* Start jobs until every slot is taken or the queue has nothing that
+   may start now. Free slots go to the records and the suspended jobs by
+   priority, a suspended job before the records of its own. Without a
+   free slot, a record of higher priority than a running job takes its
+   place if that job can be resumed later. */
+static void fill(struct ctx *ctx)
+{
+  struct record *record;
+  struct job *job;
+
+  while(!ctx->abort_transfer) {
+    /* a follower takes no slot, it only copies */
+    if(ctx->njobs - ctx->nsuspended - ctx->nfollowing < ctx->parallel) {
+      job    = suspended(ctx);
+      record = queue_next(&ctx->queue,job ? job->opts->priority : INT_MIN);
+      if(record)
+        launch(ctx,record);
+      else if(job)
+        wake(job);
+      else
+        break;
+    }
+    else if((job = victim(ctx)) &&
+            (record = queue_next(&ctx->queue,job->opts->priority))) {
+      suspend(job);
+      launch(ctx,record);
+    }
+    else
+      break;
+  }
+  if(!ctx->jobs && (ctx->abort_transfer || queue_empty(&ctx->queue)))
+    stop(ctx);
+}
+
+static gboolean callback_fill(gpointer data)
+{
+  CTX_T(data)->filler = 0;
+  fill(CTX_T(data));
+  return false;
+}
+
+static void abort_jobs(struct ctx *ctx)
+{
+  register struct job *job,*next;
+  ctx->abort_transfer = true;
+  for(job = ctx->jobs ; job ; job = next) {
+    next = job->next;
+    finish(job,CURLE_ABORTED_BY_CALLBACK);
+  }
+}
+
+/* Jobs left once the main loop is over, waiting for a hash. */
+static void free_jobs(struct ctx *ctx)
+{
+  while(ctx->jobs) {
+    ctx->jobs->state = STATE_ABORT;
+    release(ctx->jobs);
+  }
+  if(ctx->filler)
+    g_source_remove(ctx->filler);
+  ctx->filler = 0;
+}
+
+static gboolean callback_signal(gpointer data)
+{
+  abort_jobs(CTX_T(data));
+  quit(CTX_T(data));
+  return true;
+}
+
+static gboolean callback_init(gpointer data)
+{
+  fill(CTX_T(data));
+  return false;
+}
+
+static gboolean callback_throttle(gpointer data)
+{
+  SEG_T(data)->throttle = 0;
+  curl_easy_pause(SEG_T(data)->curl,CURLPAUSE_CONT);
+  return false;
+}
+
+/* Let a chunk through the buckets of the process, of the host, of the
+   job and of the segment, or pause the segment until the first one in
+   debt is paid back. */
+static bool admit(struct segment *seg, size_t len)
+{
+  register struct job *job = seg->job;
+  struct bucket *buckets[] = { &job->ctx->bandwidth.global,
+                               job->host ? &job->host->bucket : NULL,
+                               &job->bucket,
+                               &seg->bucket };
+  double now = monotonic(),wait;
+  int i;
+
+  for(i = 0 ; i < sizeof(buckets) / sizeof(struct bucket *) ; i++) {
+    if(!buckets[i] || bucket_ready(buckets[i],now))
+      continue;
+    seg->starved = seg->starved || buckets[i] == &seg->bucket;
+    /* the rates may go up with the next schedule */
+    wait = bucket_wait(buckets[i]) * 1000.;
+    wait = wait < SCHED_DELTA ? wait : SCHED_DELTA;
+    seg->throttle = g_timeout_add(wait + 1.,callback_throttle,seg);
+    return false;
+  }
+  for(i = 0 ; i < sizeof(buckets) / sizeof(struct bucket *) ; i++)
+    if(buckets[i])
+      bucket_spend(buckets[i],len);
+  return true;
+}
+
+/* Count what came from the network and measure the throughput of a
+   mirror as it goes. */
+static void credit(struct segment *seg, size_t len)
+{
+  seg->job->fetched += len;
+  if(!seg->mirror)
+    return;
+  seg->mirror->received += len;
+  rate_sample(&seg->mirror->rate,monotonic(),seg->mirror->received);
+}
+
+/* Write the bytes of a part where they go. Only the parts asked are
+   taken, a server which merges them falls back to single ranges. */
+static bool store_part(void *data, const char *buf, size_t len,
+                       off_t offset)
+{
+  register struct segment *seg = SEG_T(data);
+  register struct batch *batch = seg->batch;
+  register int i;
+  ssize_t wt;
+
+  for(i = 0 ; i < batch->nparts ; i++)
+    if(offset >= batch->parts[i].begin && offset <= batch->parts[i].end)
+      break;
+  if(i == batch->nparts ||
+     offset + (off_t)len - 1 > batch->parts[i].end ||
+     offset != batch->parts[i].begin + batch->got[i]) {
+    single_ranges(seg->job);
+    return false;
+  }
+  batch->got[i] += len;
+  seg->offset   += len;
+  credit(seg,len);
+  for( ; len ; buf += wt, len -= wt, offset += wt) {
+    wt = pwrite(seg->job->o_desc,buf,len,offset);
+    if(wt == -1) {
+      perror("Cannot write");
+      return false;
+    }
+  }
+  return true;
+}
+
+static size_t receive_batch(struct segment *seg, void *buffer, size_t len)
+{
+  if(!seg->batch->multipart) {
+    single_ranges(seg->job);
+    return 0;
+  }
+  if(seg->job->ctx->shaping && !admit(seg,len))
+    return CURL_WRITEFUNC_PAUSE;
+  return multipart_feed(&seg->batch->mp,buffer,len,store_part,seg) ? len : 0;
+}
+
+static size_t receive(struct segment *seg, void *buffer, size_t size,
+                      size_t nmemb)
+{
+  register struct job *job = seg->job;
+  size_t len = size*nmemb;
+  off_t offset = seg->offset;
+  curl_off_t length = -1;
+  ssize_t wt;
+  long code;
+
+  if(!seg->checked && seg->end < 0) {
+    /* a single stream only knows its length with the first data, the
+       one going on after a failure was sized before */
+    curl_easy_getinfo(seg->curl,CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,&length);
+    if(!seg->offset && !allocate(job,(off_t)length))
+      return 0;
+  }
+  else if(!seg->checked) {
+    /* a plain 200 would write the whole file at our offset */
+    curl_easy_getinfo(seg->curl,CURLINFO_RESPONSE_CODE,&code);
+    if(code != 206) {
+      /* with If-Range a full response means the file changed */
+      if(job->journal_on && seg->mirror == job->probe.mirror) {
+        fprintf(stderr,"Remote file changed, journal discarded\n");
+        job->changed = true;
+      }
+      else if(seg->batch)
+        single_ranges(job);
+      else if(seg->mirror)
+        seg->reject = "ignored the range request";
+      else
+        fprintf(stderr,"Server ignored range request\n");
+      return 0;
+    }
+    if(seg->reject)
+      return 0;
+  }
+  seg->checked = true;
+  if(seg->batch)
+    return receive_batch(seg,buffer,len);
+  if(seg->end >= 0 && seg->offset + (off_t)len > seg->end + 1) {
+    if(!seg->cut) {
+      if(seg->mirror)
+        seg->reject = "sent more than the range";
+      else
+        fprintf(stderr,"Server sent more than the requested range\n");
+      return 0;
+    }
+    /* another connection took the rest, stop at the new end */
+    len = seg->end + 1 - seg->offset;
+    if(!len)
+      return 0;
+  }
+  if(job->ctx->shaping && !admit(seg,len))
+    return CURL_WRITEFUNC_PAUSE;
+
+  if(job->writer_on) {
+    if(writer_push(&job->writer,buffer,len,seg->offset)) {
+      seg->offset += len;
+      credit(seg,len);
+      return len == size*nmemb ? len : 0;
+    }
+    /* the error itself is reported when the transfer ends */
+    if(writer_error(&job->writer))
+      return 0;
+    seg->paused = true;
+    if(job->ctx->histograms)
+      seg->paused_at = nanotime();
+    return CURL_WRITEFUNC_PAUSE;
+  }
+
+  while(len) {
+    wt = pwrite(job->o_desc,buffer,len,seg->offset);
+    if(wt == -1) {
+      perror("Cannot write");
+      return 0;
+    }
+    seg->offset += wt;
+    buffer = (char *)buffer + wt;
+    len -= wt;
+  }
+  if(job->digest_stream)
+    digest_feed(&job->digest,seg->offset);
+  credit(seg,seg->offset - offset);
+  return seg->offset - offset == size*nmemb ? size*nmemb : 0;
+}
+
+static size_t callback_data(void *buffer, size_t size,
+                            size_t nmemb, void *userp)
+{
+  register struct segment *seg = SEG_T(userp);
+  register struct hot *hot = &seg->job->hot;
+  uint64_t begin;
+  size_t ret;
+
+  if(!seg->job->ctx->histograms)
+    return receive(seg,buffer,size,nmemb);
+  begin = nanotime();
+  if(seg->last_data)
+    histogram_add(&hot->gap,begin - seg->last_data);
+  ret = receive(seg,buffer,size,nmemb);
+  seg->last_data = nanotime();
+  histogram_add(&hot->data,seg->last_data - begin);
+  histogram_add(&hot->bytes,size * nmemb);
+  return ret;
+}
+
+/* Only publish the progress, the GUI samples it in callback_timer. */
+static void publish(void *clientp, double dltotal, double dlnow)
+{
+  /* FIXME: dltotal is quit buggy use wrote byte instead ?*/
+  register struct job *job = SEG_T(clientp)->job;
+  register int i;
+  struct progress_data data;
+
+  SEG_T(clientp)->dlnow = SEG_T(clientp)->carry + dlnow;
+  /* the body of a batch has the headers of its parts */
+  if(SEG_T(clientp)->batch)
+    SEG_T(clientp)->dlnow = SEG_T(clientp)->offset - SEG_T(clientp)->from;
+  /* a range which was cut receives more than it keeps */
+  if(SEG_T(clientp)->cut &&
+     SEG_T(clientp)->dlnow > SEG_T(clientp)->end + 1 - SEG_T(clientp)->from)
+    SEG_T(clientp)->dlnow = SEG_T(clientp)->end + 1 - SEG_T(clientp)->from;
+  if(job->nsegs > 1 || SEG_T(clientp)->end >= 0) {
+    /* the whole file is split across the segments */
+    dltotal = (double)job->length;
+    for(dlnow = (double)job->saved, i = 0 ; i < job->nsegs ; i++)
+      dlnow += job->segs[i].dlnow;
+  }
+  else {
+    /* curl counts a stream which went on after a failure from where it
+       went on */
+    if(job->length > 0)
+      dltotal = (double)job->length;
+    else if(dltotal > 0.)
+      dltotal += SEG_T(clientp)->carry;
+    dlnow = (double)job->saved + SEG_T(clientp)->dlnow;
+  }
+  rate_sample(&job->rate,monotonic(),dlnow);
+  data.dlnow  = dlnow;
+  data.dltot  = dltotal;
+  data.speed  = job->rate.instant;
+  data.smooth = job->rate.smooth;
+  data.eta    = dltotal > 0. ? rate_eta(&job->rate,dltotal - dlnow) : -1.;
+  progress_publish(&job->snapshot,&data);
+}
+
+static int callback_progress(void *clientp, double dltotal,
+                             double dlnow, double ultotal,
+                             double ulnow)
+{
+  register struct job *job = SEG_T(clientp)->job;
+  uint64_t begin;
+
+  if(job->ctx->abort_transfer)
+    return -1;
+  if(!job->ctx->histograms) {
+    publish(clientp,dltotal,dlnow);
+    return 0;
+  }
+  begin = nanotime();
+  publish(clientp,dltotal,dlnow);
+  histogram_add(&job->hot.progress,nanotime() - begin);
+  return 0;
+}
+
+static gboolean callback_delete(GtkWidget *widget, GdkEvent *event,
+                                gpointer data)
+{
+  abort_jobs(CTX_T(data));
+  gtk_main_quit();
+  return false;
+}
+
+/* Sum the snapshots of the running jobs with what the jobs already over
+   transferred. The ETA of a single job comes from its own estimator. */
+static void sample(struct ctx *ctx, struct progress_data *snap)
+{
+  register struct job *job;
+  struct progress_data data;
+
+  snap->dlnow  = ctx->done_now;
+  snap->dltot  = ctx->done_tot;
+  snap->speed  = 0.;
+  snap->smooth = 0.;
+  snap->eta    = -1.;
+  for(job = ctx->jobs ; job ; job = job->next) {
+    progress_read(&job->snapshot,&data);
+    snap->dlnow  += data.dlnow;
+    snap->dltot  += data.dltot;
+    snap->speed  += data.speed;
+    snap->smooth += data.smooth;
+    snap->eta     = data.eta;
+  }
+  if(ctx->njobs != 1 || ctx->done_tot > 0.)
+    snap->eta = snap->smooth > 0. && snap->dltot >= snap->dlnow ?
+      (snap->dltot - snap->dlnow) / snap->smooth : -1.;
+}
+
+/* Sample the progress snapshots once per frame and only touch the
+   widgets when there is something new to show. */
+static gboolean callback_timer(gpointer data)
+{
+  struct progress_data snap;
+  gdouble pct;
+  bool tick;
+
+  tick = !(CTX_T(data)->frames++ % (STATUS_DELTA / FRAME_DELTA));
+  if(CTX_T(data)->store)
+    update_rows(CTX_T(data),tick);
+  if(!CTX_T(data)->progress && !CTX_T(data)->status)
+    return true;
+  sample(CTX_T(data),&snap);
+  if(snap.dlnow > snap.dltot)
+    pct = 1.;
+  else
+    pct = snap.dlnow / snap.dltot;
+  if(CTX_T(data)->progress &&
+     fabs(pct - CTX_T(data)->pct) > PCT_EPS) {
+    CTX_T(data)->pct = pct;
+    snprintf(CTX_T(data)->pct_progress,STRLEN_MAX,"%3.0f%%",100.*pct);
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(CTX_T(data)->gui_progress),
+                                  pct);
+    gtk_progress_bar_set_text(GTK_PROGRESS_BAR(CTX_T(data)->gui_progress),
+                              CTX_T(data)->pct_progress);
+  }
+
+  if(!CTX_T(data)->status || !tick)
+    return true;
+  format_nbr(CTX_T(data),CTX_T(data)->speed_status, "ps",
+             snap.smooth);
+  format_nbr(CTX_T(data),CTX_T(data)->dlnow_status, "",
+             snap.dlnow);
+  format_nbr(CTX_T(data),CTX_T(data)->dltot_status, "",
+             snap.dltot);
+  format_eta(CTX_T(data)->eta_status,snap.eta);
+  snprintf(CTX_T(data)->txt_status,STRLEN_MAX,"%s (%s/%s) ETA %s",
+           CTX_T(data)->speed_status,
+           CTX_T(data)->dlnow_status,
+           CTX_T(data)->dltot_status,
+           CTX_T(data)->eta_status);
+  gtk_label_set_text(GTK_LABEL(CTX_T(data)->gui_status),
+                     CTX_T(data)->txt_status);
+  return true;
+}
+
+static void setup_curl(struct ctx *ctx)
+{
+  curl_global_init(CURL_GLOBAL_ALL);
+  if(engine_init(&ctx->engine,callback_done,ctx->pool,
+                 ctx->http2 ? ctx->streams : 0,ctx->h2c))
+    return;
+  fprintf(stderr,"Cannot initialize curl\n");
+  free_ctx(ctx);
+  exit(EXIT_FAILURE);
+}
+
+/* Without GUI the transfers run from a plain GLib main loop and the
+   progress goes to a file descriptor. */
+static void setup_headless(struct ctx *ctx)
+{
+  ctx->report = fdopen(ctx->report_fd,"w");
+  if(!ctx->report) {
+    perror("Cannot open report descriptor");
+    free_ctx(ctx);
+    exit(EXIT_FAILURE);
+  }
+  ctx->loop = g_main_loop_new(NULL,false);
+  g_idle_add(callback_init,ctx);
+  /* a record is also written when each transfer ends */
+  if(ctx->interval > 0)
+    ctx->timer = g_timeout_add(ctx->interval,callback_report,ctx);
+}
+
+static void add_column(struct ctx *ctx, const char *title,
+                       GtkCellRenderer *cell, const char *attr, int col,
+                       int width)
+{
+  GtkTreeViewColumn *column;
+
+  column = gtk_tree_view_column_new_with_attributes(title,cell,attr,col,NULL);
+  /* fixed sizes so that an update does not measure every row */
+  gtk_tree_view_column_set_sizing(column,GTK_TREE_VIEW_COLUMN_FIXED);
+  gtk_tree_view_column_set_fixed_width(column,width);
+  gtk_tree_view_column_set_resizable(column,true);
+  gtk_tree_view_append_column(GTK_TREE_VIEW(ctx->view),column);
+}
+
+static void setup_list(struct ctx *ctx, GtkWidget *vbox)
+{
+  GtkWidget *scroll;
+
+  ctx->store = gtk_list_store_new(COL_N,G_TYPE_POINTER,G_TYPE_STRING,
+                                  G_TYPE_INT,G_TYPE_STRING,G_TYPE_STRING,
+                                  G_TYPE_STRING,G_TYPE_STRING);
+  ctx->view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(ctx->store));
+  g_object_unref(ctx->store);
+  add_column(ctx,"File",gtk_cell_renderer_text_new(),"text",COL_FILE,200);
+  add_column(ctx,"Progress",gtk_cell_renderer_progress_new(),"value",
+             COL_PCT,100);
+  add_column(ctx,"Size",gtk_cell_renderer_text_new(),"text",COL_SIZE,140);
+  add_column(ctx,"Speed",gtk_cell_renderer_text_new(),"text",COL_SPEED,80);
+  add_column(ctx,"ETA",gtk_cell_renderer_text_new(),"text",COL_ETA,60);
+  add_column(ctx,"State",gtk_cell_renderer_text_new(),"text",COL_STATE,80);
+  gtk_tree_view_set_fixed_height_mode(GTK_TREE_VIEW(ctx->view),true);
+
+  scroll = gtk_scrolled_window_new(NULL,NULL);
+  gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scroll),
+                                 GTK_POLICY_AUTOMATIC,GTK_POLICY_AUTOMATIC);
+  gtk_container_add(GTK_CONTAINER(scroll),ctx->view);
+  gtk_box_pack_start(GTK_BOX(vbox),scroll,true,true,0);
+  gtk_widget_show(ctx->view);
+  gtk_widget_show(scroll);
+}
+
+static void setup_gui(struct ctx *ctx)
+{
+  GtkWidget *window,*vbox;
+
+  gtk_init_add(callback_init,ctx);
+
+  window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+  g_signal_connect(G_OBJECT(window),"delete_event",
+                   G_CALLBACK(callback_delete),ctx);
+  gtk_window_set_role(GTK_WINDOW(window),"gdownload");
+  /* the title follows the last job started */
+  gtk_window_set_title(GTK_WINDOW(window),PACKAGE "-" VERSION);
+  /* a list of downloads for a queue or an instance which takes more */
+  ctx->list = ctx->input || ctx->single;
+  if(ctx->width && ctx->height)
+    gtk_window_set_default_size(GTK_WINDOW(window),ctx->width,ctx->height);
+  else if(ctx->list)
+    gtk_window_set_default_size(GTK_WINDOW(window),
+                                LIST_WIDTH_DEF,LIST_HEIGHT_DEF);
+  gtk_window_set_position(GTK_WINDOW(window),POSITION_DEF);
+  gtk_window_set_resizable(GTK_WINDOW(window),!ctx->fixed);
+  gtk_window_set_icon_from_file(GTK_WINDOW(window),ICON_PATH,NULL);
+  vbox = gtk_vbox_new(false,0);
+  gtk_container_add(GTK_CONTAINER(window),vbox);
+
+  if(ctx->list)
+    setup_list(ctx,vbox);
+
+  if(ctx->progress) {
+    ctx->gui_progress = gtk_progress_bar_new();
+    gtk_box_pack_start(GTK_BOX(vbox),ctx->gui_progress,true,true,0);
+    gtk_widget_show(ctx->gui_progress);
+  }
+
+  if(ctx->status) {
+    ctx->gui_status = gtk_label_new("waiting");
+    gtk_label_set_justify(GTK_LABEL(ctx->gui_status),GTK_JUSTIFY_CENTER);
+    gtk_box_pack_start(GTK_BOX(vbox),ctx->gui_status,true,true,0);
+    gtk_widget_show(ctx->gui_status);
+  }
+
+  if(ctx->progress || ctx->status || ctx->list)
+    ctx->timer = g_timeout_add(FRAME_DELTA,callback_timer,ctx);
+
+  gtk_widget_show(vbox);
+  gtk_widget_show(window);
+  ctx->window = window;
+}
+
+/* The download of a metalink stands in the queue for its first URL
+   unless one is given. Another instance needs the full path of the
+   file as it runs in another directory. */
+static void setup_metalink(struct ctx *ctx)
+{
+  struct metalink metalink;
+  char *path;
+
+  if(!ctx->opts.metalink)
+    return;
+  if(ctx->input) {
+    fprintf(stderr,"Cannot use a metalink with an input list\n");
+    free_ctx(ctx);
+    exit(EXIT_FAILURE);
+  }
+  if(!metalink_load(&metalink,ctx->opts.metalink)) {
+    metalink_free(&metalink);
+    free_ctx(ctx);
+    exit(EXIT_FAILURE);
+  }
+  if(!ctx->url) {
+    ctx->cmd_args = add_str(ctx->cmd_args,
+                            g_ptr_array_index(metalink.urls,0));
+    ctx->url = ctx->cmd_args->string;
+  }
+  metalink_free(&metalink);
+  if((path = realpath(ctx->opts.metalink,NULL))) {
+    ctx->cmd_args = add_str(ctx->cmd_args,path);
+    ctx->opts.metalink = ctx->cmd_args->string;
+    free(path);
+  }
+}
+
+/* Like a metalink, a zsync file stands for its URL unless one is
+   given. */
+static void setup_zsync(struct ctx *ctx)
+{
+  struct zsync zsync;
+  char *path;
+
+  if(!ctx->opts.zsync)
+    return;
+  if(ctx->input) {
+    fprintf(stderr,"Cannot use a zsync file with an input list\n");
+    free_ctx(ctx);
+    exit(EXIT_FAILURE);
+  }
+  if(!zsync_load(&zsync,ctx->opts.zsync)) {
+    zsync_free(&zsync);
+    free_ctx(ctx);
+    exit(EXIT_FAILURE);
+  }
+  if(!ctx->url && !zsync.url) {
+    fprintf(stderr,"No absolute URL in the zsync file, give one\n");
+    zsync_free(&zsync);
+    free_ctx(ctx);
+    exit(EXIT_FAILURE);
+  }
+  if(!ctx->url) {
+    ctx->cmd_args = add_str(ctx->cmd_args,zsync.url);
+    ctx->url = ctx->cmd_args->string;
+  }
+  zsync_free(&zsync);
+  if((path = realpath(ctx->opts.zsync,NULL))) {
+    ctx->cmd_args = add_str(ctx->cmd_args,path);
+    ctx->opts.zsync = ctx->cmd_args->string;
+    free(path);
+  }
+  if(ctx->opts.seed && (path = realpath(ctx->opts.seed,NULL))) {
+    ctx->cmd_args = add_str(ctx->cmd_args,path);
+    ctx->opts.seed = ctx->cmd_args->string;
+    free(path);
+  }
+}
+
+/* The cookie files are read by the instance the download may be handed
+   to, which runs in another directory. */
+static void setup_cookies(struct ctx *ctx)
+{
+  register struct s_list *l;
+  char *path;
+
+  for(l = ctx->opts.cks_path ; l ; l = l->next) {
+    if(!(path = realpath(l->string,NULL)))
+      continue;
+    free(l->string);
+    l->string = path;
+  }
+}
+
+/* The download given on the command line goes before the input list. */
+static void setup_queue(struct ctx *ctx)
+{
+  struct digest digest;
+  double limit;
+
+  if(ctx->opts.checksum && !digest_parse(&digest,ctx->opts.checksum)) {
+    fprintf(stderr,"Invalid checksum, expected "
+            "<md5|sha1|sha256|sha512>:<hex digest>\n");
+    free_ctx(ctx);
+    exit(EXIT_FAILURE);
+  }
+  if(ctx->opts.limit && !bandwidth_parse(ctx->opts.limit,&limit)) {
+    fprintf(stderr,"Invalid rate, expected <bytes per second>[k|m|g]\n");
+    free_ctx(ctx);
+    exit(EXIT_FAILURE);
+  }
+  if(ctx->interactive && ctx->input && !strcmp(ctx->input,"-")) {
+    fprintf(stderr,"Cannot read both options and input list from stdin\n");
+    free_ctx(ctx);
+    exit(EXIT_FAILURE);
+  }
+  if(ctx->parallel < 1)
+    ctx->parallel = 1;
+  if(ctx->streams < 1)
+    ctx->streams = 1;
+  if(!queue_init(&ctx->queue,ctx->input,ctx->per_host,ctx->opts.priority,
+                 destroy_opts,
+                 callback_fill,ctx)) {
+    free_ctx(ctx);
+    exit(EXIT_FAILURE);
+  }
+  if(ctx->url)
+    queue_push(&ctx->queue,ctx->url,NULL,NULL,ctx->opts.priority);
+}
+
+static void setup_bandwidth(struct ctx *ctx)
+{
+  if(!bandwidth_init(&ctx->bandwidth,ctx->max_rate,ctx->host_rate,
+                     monotonic())) {
+    fprintf(stderr,"Invalid limit, expected <bytes per second>[k|m|g] "
+            "or HH:MM=<rate>,... in the order of the day\n");
+    free_ctx(ctx);
+    exit(EXIT_FAILURE);
+  }
+  if(bandwidth_on(&ctx->bandwidth))
+    shape(ctx);
+}
+
+static void setup_cache(struct ctx *ctx)
+{
+  double size = 0.;
+
+  if(ctx->cache_size && !bandwidth_parse(ctx->cache_size,&size)) {
+    fprintf(stderr,"Invalid cache size, expected <bytes>[k|m|g]\n");
+    free_ctx(ctx);
+    exit(EXIT_FAILURE);
+  }
+  if(ctx->cache_dir && !cache_open(&ctx->cache,ctx->cache_dir,(off_t)size)) {
+    free_ctx(ctx);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* The running jobs, then the totals with them. */
+static gboolean callback_dump(gpointer data)
+{
+  register struct ctx *ctx = CTX_T(data);
+  register struct job *job;
+  struct hot hot = ctx->hot;
+
+  for(job = ctx->jobs ; job ; job = job->next) {
+    dump_hot(ctx,job->path,&job->hot);
+    merge_hot(&hot,&job->hot);
+  }
+  dump_hot(ctx,NULL,&hot);
+  return true;
+}
+
+static void cache_stats(struct ctx *ctx, FILE *fp)
+{
+  register const struct cache *cache = &ctx->cache;
+
+  fprintf(fp,"{\"cache\":{\"hits\":%ld,\"revalidated\":%ld,"
+          "\"misses\":%ld,\"stored\":%ld,\"evicted\":%ld,"
+          "\"served\":%lld}}\n",
+          cache->hits,cache->revalidated,cache->misses,cache->stored,
+          cache->evicted,(long long)cache->served);
+}
+
+/* Where the time went over all the transfers. The times are summed, the
+   speed is the one of a connection on average. */
+static void summary_stats(struct ctx *ctx)
+{
+  register struct timing *sum = &ctx->sum;
+
+  fprintf(ctx->stats,"{\"totals\":{\"transfers\":%ld,\"failed\":%ld,"
+          "\"connects\":%ld,\"reused\":%ld,\"namelookup\":%.6f,"
+          "\"connect\":%.6f,\"appconnect\":%.6f,\"starttransfer\":%.6f,"
+          "\"total\":%.6f,\"size\":%lld,\"speed\":%lld,"
+          "\"redirects\":%ld}}\n",
+          ctx->stats_count,ctx->stats_failed,sum->connects,ctx->stats_reused,
+          sum->namelookup,sum->connect,sum->appconnect,sum->starttransfer,
+          sum->total,(long long)sum->size,
+          sum->total > 0. ? (long long)(sum->size / sum->total) : 0LL,
+          sum->redirects);
+  if(ctx->cache.dir)
+    cache_stats(ctx,ctx->stats);
+  fflush(ctx->stats);
+}
+
+/* Tell whether the transfers could use the connections of the
+   previous ones. */
+static void summary(struct ctx *ctx)
+{
+  register struct engine *engine = &ctx->engine;
+
+  if(ctx->stats)
+    summary_stats(ctx);
+  if(ctx->histograms)
+    dump_hot(ctx,NULL,&ctx->hot);
+  if(ctx->headless) {
+    fprintf(ctx->report,"{\"transfers\":%ld,\"connects\":%ld,"
+            "\"reused\":%ld,\"joined\":%ld,\"retries\":%ld,"
+            "\"lost\":%.1f}\n",
+            engine->transfers,engine->connects,engine->reused,ctx->joined,
+            ctx->retries,ctx->lost);
+    if(ctx->cache.dir)
+      cache_stats(ctx,ctx->report);
+    fflush(ctx->report);
+  }
+  else if(ctx->opts.verbose) {
+    fprintf(stderr,"%ld transfers, %ld connections opened, %ld reused\n",
+            engine->transfers,engine->connects,engine->reused);
+    if(ctx->joined)
+      fprintf(stderr,"%ld downloads taken from another one\n",ctx->joined);
+    if(ctx->retries)
+      fprintf(stderr,"%ld transfers tried again, %.1f s lost\n",
+              ctx->retries,ctx->lost);
+    if(ctx->cache.dir)
+      fprintf(stderr,"cache: %ld hits (%ld revalidated), %ld misses, "
+              "%ld stored, %ld evicted\n",ctx->cache.hits,
+              ctx->cache.revalidated,ctx->cache.misses,ctx->cache.stored,
+              ctx->cache.evicted);
+  }
+}
+
+static void proceed(struct ctx *ctx)
+{
+  if(ctx->headless)
+    g_main_loop_run(ctx->loop);
+  else
+    gtk_main();
+}
+
+static void handle_signal(struct ctx *ctx)
+{
+  /* signals are dispatched from the main loop like any other event */
+  const int sig[] = { SIGTERM,
+                      SIGINT,
+                      SIGHUP,
+                      0 };
+  const register int * signum;
+  for(signum = sig ; *signum ; signum++)
+    g_unix_signal_add(*signum,callback_signal,ctx);
+}
+
+static void null_cmd(const char *arg, void *ptr) { return; }
+static void true_cmd(const char *arg, void *ptr) { *(bool *)ptr = true; }
+static void false_cmd(const char *arg, void *ptr) { *(bool *)ptr = false; }
+static void arg_cmd(const char *arg, void *ptr) { *(const char **)ptr = arg; }
+static void int_cmd(const char *arg, void *ptr) { *(int *)ptr = atoi(arg); }
+static void copy_cmd(const char *arg, void *ptr)
+{
+  strncpy(*(char **)ptr, arg, STRLEN_MAX);
+}
+static void append_cmd(const char *arg, void *ptr)
+{
+*(struct s_list **)ptr = add_str(*(struct s_list **)ptr,arg);
+}
+static void ipv4_cmd(const char *arg, void *ptr)
+{
+  *(int *)ptr = CURL_IPRESOLVE_V4;
+}
+static void ipv6_cmd(const char *arg, void *ptr)
+{
+  *(int *)ptr = CURL_IPRESOLVE_V6;
+}
+
+/* Apply a "<name> <value>" line to the settings of a download. */
+static bool opts_cmd(struct opts *opts, const char *cmd, const char *arg)
+{
+  struct cmd cmds[] =
+    {
+      {"verbose", true_cmd, &opts->verbose},
+      {"user-agent", copy_cmd, &opts->user_agent},
+      {"referer", arg_cmd, &opts->referer},
+      {"auth", arg_cmd, &opts->http_crd},
+      {"cookie", append_cmd, &opts->cookies},
+      {"cookies-file", append_cmd, &opts->cks_path},
+      {"proxy", arg_cmd, &opts->proxy},
+      {"proxy-auth", arg_cmd, &opts->proxy_crd},
+      {"intf", arg_cmd, &opts->intf},
+      {"ipv4", ipv4_cmd, &opts->dns},
+      {"ipv6", ipv6_cmd, &opts->dns},
+      {"segments", int_cmd, &opts->segments},
+      {"continue", true_cmd, &opts->resume},
+      {"buffer", int_cmd, &opts->buffer},
+      {"no-prealloc", false_cmd, &opts->prealloc},
+      {"checksum", arg_cmd, &opts->checksum},
+      {"rate", arg_cmd, &opts->limit},
+      {"priority", int_cmd, &opts->priority},
+      {"retries", int_cmd, &opts->retries},
+      {"stall", int_cmd, &opts->stall},
+      {"mirror", append_cmd, &opts->mirrors},
+      {"metalink", arg_cmd, &opts->metalink},
+      {"zsync", arg_cmd, &opts->zsync},
+      {"seed", arg_cmd, &opts->seed},
+      {NULL,null_cmd,NULL}
+    };
+  register struct cmd *c;
+  for(c = cmds ; c->name ; c++) {
+    if(!strcmp(cmd,c->name)) {
+      opts->args = add_str(opts->args,arg);
+      c->action(opts->args->string,c->ptr);
+      return true;
+    }
+  }
+  return false;
+}
+
+/* The inverse of opts_cmd, to forward a download. */
+static void send_opts(GString *out, const struct opts *opts)
+{
+  register struct s_list *l;
+
+  g_string_append_printf(out,"user-agent %s\n",opts->user_agent);
+  if(opts->verbose)
+    g_string_append(out,"verbose\n");
+  if(opts->referer)
+    g_string_append_printf(out,"referer %s\n",opts->referer);
+  if(opts->http_crd)
+    g_string_append_printf(out,"auth %s\n",opts->http_crd);
+  for(l = opts->cookies ; l ; l = l->next)
+    g_string_append_printf(out,"cookie %s\n",l->string);
+  for(l = opts->cks_path ; l ; l = l->next)
+    g_string_append_printf(out,"cookies-file %s\n",l->string);
+  if(opts->proxy)
+    g_string_append_printf(out,"proxy %s\n",opts->proxy);
+  if(opts->proxy_crd)
+    g_string_append_printf(out,"proxy-auth %s\n",opts->proxy_crd);
+  if(opts->intf)
+    g_string_append_printf(out,"intf %s\n",opts->intf);
+  if(opts->dns == CURL_IPRESOLVE_V4)
+    g_string_append(out,"ipv4\n");
+  else if(opts->dns == CURL_IPRESOLVE_V6)
+    g_string_append(out,"ipv6\n");
+  g_string_append_printf(out,"segments %d\n",opts->segments);
+  if(opts->resume)
+    g_string_append(out,"continue\n");
+  g_string_append_printf(out,"buffer %d\n",opts->buffer);
+  if(!opts->prealloc)
+    g_string_append(out,"no-prealloc\n");
+  if(opts->checksum)
+    g_string_append_printf(out,"checksum %s\n",opts->checksum);
+  if(opts->limit)
+    g_string_append_printf(out,"rate %s\n",opts->limit);
+  g_string_append_printf(out,"priority %d\n",opts->priority);
+  g_string_append_printf(out,"retries %d\n",opts->retries);
+  g_string_append_printf(out,"stall %d\n",opts->stall);
+  for(l = opts->mirrors ; l ; l = l->next)
+    g_string_append_printf(out,"mirror %s\n",l->string);
+  if(opts->metalink)
+    g_string_append_printf(out,"metalink %s\n",opts->metalink);
+  if(opts->zsync)
+    g_string_append_printf(out,"zsync %s\n",opts->zsync);
+  if(opts->seed)
+    g_string_append_printf(out,"seed %s\n",opts->seed);
+}
+
+static void parse_stdin(struct ctx *ctx)
+{
+  char buf[STRLEN_MAX];
+  const char *cmd,*arg;
+  struct cmd cmds[] =
     {
       /* url, output (bug with cmdline)*/
-      {"verbose", true_cmd, &ctx->verbose},
       {"status", true_cmd, &ctx->status},
       {"progress", true_cmd, &ctx->progress},
       {"binary", true_cmd, &ctx->binary},
@@ -747,16 +4211,21 @@ static void parse_stdin(struct ctx *ctx)
       {"width", int_cmd, &ctx->width},
       {"height", int_cmd, &ctx->height},
       {"fixed", true_cmd, &ctx->fixed},
-      {"user-agent", copy_cmd, &ctx->user_agent},
-      {"referer", arg_cmd, &ctx->referer},
-      {"auth", arg_cmd, &ctx->http_crd},
-      {"cookie", append_cmd, &ctx->cookies},
-      {"cookies-file", append_cmd, &ctx->cks_path},
-      {"proxy", arg_cmd, &ctx->proxy},
-      {"proxy-auth", arg_cmd, &ctx->proxy_crd},
-      {"intf", arg_cmd, &ctx->intf},
-      {"ipv4", ipv4_cmd, &ctx->dns},
-      {"ipv6", ipv6_cmd, &ctx->dns},
+      {"headless", true_cmd, &ctx->headless},
+      {"report-fd", int_cmd, &ctx->report_fd},
+      {"interval", int_cmd, &ctx->interval},
+      {"input-file", arg_cmd, &ctx->input},
+      {"parallel", int_cmd, &ctx->parallel},
+      {"per-host", int_cmd, &ctx->per_host},
+      {"pool", int_cmd, &ctx->pool},
+      {"http2", true_cmd, &ctx->http2},
+      {"streams", int_cmd, &ctx->streams},
+      {"h2c", arg_cmd, &ctx->h2c},
+      {"single-instance", true_cmd, &ctx->single},
+      {"limit", arg_cmd, &ctx->max_rate},
+      {"host-limit", arg_cmd, &ctx->host_rate},
+      {"stats-json", arg_cmd, &ctx->stats_path},
+      {"histograms", true_cmd, &ctx->histograms},
       {"url", arg_cmd, &ctx->url},
       {"output", arg_cmd, &ctx->output},
       {NULL,null_cmd,NULL}
@@ -770,6 +4239,8 @@ static void parse_stdin(struct ctx *ctx)
     if(strpbrk(cmd,"\n\r\v\f"))
       continue;
     arg = arg ? arg : "";
+    if(opts_cmd(&ctx->opts,cmd,arg))
+      continue;
     ctx->cmd_args = add_str(ctx->cmd_args,arg);
     for(c = cmds ; c->name ; c++) {
       if(!strcmp(cmd,c->name)) {
@@ -782,33 +4253,150 @@ static void parse_stdin(struct ctx *ctx)
   }
 }
 
+/* A download forwarded by another instance, one option per line. */
+static bool callback_request(gpointer data, char **lines)
+{
+  register struct ctx *ctx = CTX_T(data);
+  struct opts *opts = g_malloc(sizeof(struct opts));
+  const char *url = NULL,*output = NULL;
+  struct digest digest;
+  double limit;
+  char *cmd,*arg;
+
+  init_opts(opts);
+  for( ; *lines ; lines++) {
+    cmd = *lines;
+    arg = strchr(cmd,' ');
+    if(arg)
+      *arg++ = '\0';
+    else
+      arg = "";
+    if(!strcmp(cmd,"url"))
+      url = arg;
+    else if(!strcmp(cmd,"output"))
+      output = arg;
+    else if(!opts_cmd(opts,cmd,arg))
+      break;
+  }
+  if(*lines || !url || !output ||
+     (opts->checksum && !digest_parse(&digest,opts->checksum)) ||
+     (opts->limit && !bandwidth_parse(opts->limit,&limit))) {
+    destroy_opts(opts);
+    return false;
+  }
+  if(opts->verbose)
+    fprintf(stderr,"Forwarded %s\n",url);
+  queue_push(&ctx->queue,url,output,opts,opts->priority);
+  refill(ctx);
+  return true;
+}
+
+/* Hand the download to the running instance. The output is made
+   absolute as the instance runs in another directory. */
+static bool forward(struct ctx *ctx)
+{
+  char path[SOCKET_PATH_MAX],cwd[PATH_MAX];
+  GString *out;
+  bool ok;
+
+  if(!ctx->url || ctx->input)
+    return false;
+  server_path(path);
+  out = g_string_new(NULL);
+  g_string_append_printf(out,"url %s\n",ctx->url);
+  if(ctx->output[0] == '/' || !getcwd(cwd,PATH_MAX))
+    g_string_append_printf(out,"output %s\n",ctx->output);
+  else
+    g_string_append_printf(out,"output %s/%s\n",cwd,ctx->output);
+  send_opts(out,&ctx->opts);
+  g_string_append_c(out,'\n');
+  ok = server_forward(path,out->str);
+  g_string_free(out,true);
+  return ok;
+}
+
+static void setup_stats(struct ctx *ctx)
+{
+  if(ctx->histograms)
+    g_unix_signal_add(SIGUSR1,callback_dump,ctx);
+  if(!ctx->stats_path)
+    return;
+  if(!strcmp(ctx->stats_path,"-"))
+    ctx->stats = stdout;
+  else
+    ctx->stats = fopen(ctx->stats_path,"w");
+  if(!ctx->stats) {
+    perror("Cannot open stats file");
+    free_ctx(ctx);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Without a running instance this one takes the requests of the next
+   ones. */
+static void setup_server(struct ctx *ctx)
+{
+  char path[SOCKET_PATH_MAX];
+
+  if(!ctx->single)
+    return;
+  server_path(path);
+  if(server_listen(&ctx->server,path,callback_request,ctx))
+    return;
+  /* another instance started at the same time and listens now */
+  if(forward(ctx)) {
+    free_ctx(ctx);
+    exit(EXIT_SUCCESS);
+  }
+  fprintf(stderr,"Cannot listen on %s, running alone\n",path);
+}
+
 int main(int argc, char *argv[])
 {
   struct ctx ctx;
   const char *name;
+  bool done;
   name = (const char *)strrchr(argv[0],'/');
   name = name ? (name + 1) : argv[0];
   init_ctx(&ctx,name);
   handle_signal(&ctx);
-  gtk_init(&argc,&argv);
+  /* the display is only opened once we know we need it */
+  gtk_parse_args(&argc,&argv);
   cmdline(argc,argv,&ctx);
   if(ctx.interactive)
     parse_stdin(&ctx);
+  setup_metalink(&ctx);
+  setup_zsync(&ctx);
+  setup_cookies(&ctx);
+  if(ctx.single && forward(&ctx)) {
+    free_ctx(&ctx);
+    exit(EXIT_SUCCESS);
+  }
 
-  load(&ctx);
-  setup_gui(&ctx);
+  setup_server(&ctx);
+  setup_queue(&ctx);
+  setup_bandwidth(&ctx);
+  setup_stats(&ctx);
+  setup_cache(&ctx);
+  if(ctx.headless)
+    setup_headless(&ctx);
+  else {
+    gtk_init(&argc,&argv);
+    setup_gui(&ctx);
+  }
   setup_curl(&ctx);
 
-  gdk_threads_enter();
-  gtk_main();
-  gdk_threads_leave();
+  proceed(&ctx);
 
-  if(ctx.curl_thread)
-    g_thread_join(ctx.curl_thread);
-  curl_easy_cleanup(ctx.curl);
+  done = !ctx.jobs && !ctx.nfailed && queue_empty(&ctx.queue);
+  server_free(&ctx.server);
+  free_jobs(&ctx);
+  summary(&ctx);
+  engine_free(&ctx.engine);
   curl_global_cleanup();
 
-  unload(&ctx);
+  if(ctx.loop)
+    g_main_loop_unref(ctx.loop);
   free_ctx(&ctx);
-  exit(EXIT_SUCCESS);
+  exit(done ? EXIT_SUCCESS : EXIT_FAILURE);
 }
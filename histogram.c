@@ -0,0 +1,107 @@
+/* File: histogram.c
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "histogram.h"
+
+static int bucket(uint64_t value)
+{
+  register int i;
+  for(i = 0 ; value && i < HISTOGRAM_BUCKETS - 1 ; i++)
+    value >>= 1;
+  return i;
+}
+
+/* Largest value of a bucket. */
+static uint64_t upper(int i)
+{
+  return i ? ((uint64_t)1 << (i - 1) << 1) - 1 : 0;
+}
+
+void histogram_init(struct histogram *histogram)
+{
+  memset(histogram,0,sizeof(struct histogram));
+}
+
+void histogram_add(struct histogram *histogram, uint64_t value)
+{
+  histogram->buckets[bucket(value)]++;
+  histogram->count++;
+  histogram->sum += value;
+  if(value > histogram->max)
+    histogram->max = value;
+}
+
+void histogram_merge(struct histogram *to, const struct histogram *from)
+{
+  register int i;
+  for(i = 0 ; i < HISTOGRAM_BUCKETS ; i++)
+    to->buckets[i] += from->buckets[i];
+  to->count += from->count;
+  to->sum   += from->sum;
+  if(from->max > to->max)
+    to->max = from->max;
+}
+
+/* Upper bound of the bucket of the quantile, at most the largest
+   value. */
+uint64_t histogram_quantile(const struct histogram *histogram, double q)
+{
+  register int i;
+  uint64_t rank,seen = 0;
+
+  if(!histogram->count)
+    return 0;
+  rank = (uint64_t)(q * (double)histogram->count);
+  if(rank >= histogram->count)
+    rank = histogram->count - 1;
+  for(i = 0 ; i < HISTOGRAM_BUCKETS ; i++) {
+    seen += histogram->buckets[i];
+    if(seen > rank)
+      break;
+  }
+  return upper(i) < histogram->max ? upper(i) : histogram->max;
+}
+
+/* As an object with the buckets in use given by their upper bound. */
+void histogram_json(FILE *fp, const struct histogram *histogram)
+{
+  register int i;
+  bool first = true;
+
+  fprintf(fp,"{\"count\":%llu,\"sum\":%llu,\"max\":%llu,\"p50\":%llu,"
+          "\"p90\":%llu,\"p99\":%llu,\"buckets\":[",
+          (unsigned long long)histogram->count,
+          (unsigned long long)histogram->sum,
+          (unsigned long long)histogram->max,
+          (unsigned long long)histogram_quantile(histogram,.5),
+          (unsigned long long)histogram_quantile(histogram,.9),
+          (unsigned long long)histogram_quantile(histogram,.99));
+  for(i = 0 ; i < HISTOGRAM_BUCKETS ; i++) {
+    if(!histogram->buckets[i])
+      continue;
+    fprintf(fp,"%s[%llu,%llu]",first ? "" : ",",
+            (unsigned long long)upper(i),
+            (unsigned long long)histogram->buckets[i]);
+    first = false;
+  }
+  fprintf(fp,"]}");
+}
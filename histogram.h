@@ -0,0 +1,43 @@
+/* File: histogram.h
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+enum histogram_max { HISTOGRAM_BUCKETS = 64 };
+
+/* Counts of values by powers of two. Bucket 0 holds the zeros and
+   bucket i the values from 2^(i-1) to 2^i - 1, so adding a value never
+   allocates and two histograms merge bucket by bucket. */
+struct histogram
+{
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+void histogram_init(struct histogram *histogram);
+void histogram_add(struct histogram *histogram, uint64_t value);
+void histogram_merge(struct histogram *to, const struct histogram *from);
+uint64_t histogram_quantile(const struct histogram *histogram, double q);
+void histogram_json(FILE *fp, const struct histogram *histogram);
+
+#endif /* _HISTOGRAM_H_ */
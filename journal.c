@@ -0,0 +1,198 @@
+/* File: journal.c
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+enum jrn_max { LINE_MAX_JRN = 1024 };
+
+void journal_init(struct journal *jrn, const char *path)
+{
+  memset(jrn,0,sizeof(struct journal));
+  jrn->path = path;
+}
+
+void journal_free(struct journal *jrn)
+{
+  free(jrn->ranges);
+  jrn->ranges  = NULL;
+  jrn->nranges = 0;
+  jrn->size    = 0;
+}
+
+void journal_clear(struct journal *jrn)
+{
+  jrn->nranges = 0;
+}
+
+static void copy_value(char *dst, const char *src)
+{
+  strncpy(dst,src,VALIDATOR_MAX - 1);
+  dst[VALIDATOR_MAX - 1] = '\0';
+}
+
+bool journal_load(struct journal *jrn)
+{
+  char buf[LINE_MAX_JRN];
+  const char *key,*arg;
+  long long begin,end;
+  FILE *fp = fopen(jrn->path,"r");
+
+  if(!fp)
+    return false;
+  journal_clear(jrn);
+  while(fgets(buf,LINE_MAX_JRN,fp)) {
+    if(buf[0] == '#')
+      continue;
+    key = strtok(buf," \t\n");
+    arg = strtok(NULL,"\n");
+    if(!key || !arg)
+      continue;
+    if(!strcmp(key,"length"))
+      jrn->length = (off_t)atoll(arg);
+    else if(!strcmp(key,"etag"))
+      copy_value(jrn->etag,arg);
+    else if(!strcmp(key,"modified"))
+      copy_value(jrn->modified,arg);
+    else if(!strcmp(key,"range") &&
+            sscanf(arg,"%lld %lld",&begin,&end) == 2)
+      journal_add(jrn,(off_t)begin,(off_t)end);
+  }
+  fclose(fp);
+  return jrn->length > 0;
+}
+
+bool journal_save(const struct journal *jrn)
+{
+  char tmp[LINE_MAX_JRN];
+  register int i;
+  FILE *fp;
+
+  /* write aside and rename so that a crash leaves either journal */
+  snprintf(tmp,LINE_MAX_JRN,"%s.tmp",jrn->path);
+  fp = fopen(tmp,"w");
+  if(!fp) {
+    perror("Cannot write journal");
+    return false;
+  }
+  fprintf(fp,"# gdownload journal\n");
+  fprintf(fp,"length %lld\n",(long long)jrn->length);
+  if(jrn->etag[0])
+    fprintf(fp,"etag %s\n",jrn->etag);
+  if(jrn->modified[0])
+    fprintf(fp,"modified %s\n",jrn->modified);
+  for(i = 0 ; i < jrn->nranges ; i++)
+    fprintf(fp,"range %lld %lld\n",
+            (long long)jrn->ranges[i].begin,
+            (long long)jrn->ranges[i].end);
+  if(fflush(fp) || fsync(fileno(fp)) == -1) {
+    perror("Cannot sync journal");
+    fclose(fp);
+    unlink(tmp);
+    return false;
+  }
+  fclose(fp);
+  if(rename(tmp,jrn->path) == -1) {
+    perror("Cannot replace journal");
+    unlink(tmp);
+    return false;
+  }
+  return true;
+}
+
+void journal_remove(const struct journal *jrn)
+{
+  unlink(jrn->path);
+}
+
+void journal_add(struct journal *jrn, off_t begin, off_t end)
+{
+  register int i,j;
+  struct range *r;
+
+  if(end < begin)
+    return;
+  /* find the first range that may touch the new one */
+  for(i = 0 ; i < jrn->nranges && jrn->ranges[i].end + 1 < begin ; i++);
+  for(j = i ;
+      j < jrn->nranges && jrn->ranges[j].begin <= end + 1 ;
+      j++) {
+    if(jrn->ranges[j].begin < begin)
+      begin = jrn->ranges[j].begin;
+    if(jrn->ranges[j].end > end)
+      end = jrn->ranges[j].end;
+  }
+
+  if(i == j) {
+    /* no overlap, insert a new range at i */
+    if(jrn->nranges == jrn->size) {
+      jrn->size = jrn->size ? jrn->size * 2 : 8;
+      r = realloc(jrn->ranges,jrn->size * sizeof(struct range));
+      if(!r) {
+        perror("Cannot grow journal");
+        exit(EXIT_FAILURE);
+      }
+      jrn->ranges = r;
+    }
+    memmove(jrn->ranges + i + 1,jrn->ranges + i,
+            (jrn->nranges - i) * sizeof(struct range));
+    jrn->nranges++;
+  }
+  else {
+    /* merge ranges i..j-1 into i */
+    memmove(jrn->ranges + i + 1,jrn->ranges + j,
+            (jrn->nranges - j) * sizeof(struct range));
+    jrn->nranges -= j - i - 1;
+  }
+  jrn->ranges[i].begin = begin;
+  jrn->ranges[i].end   = end;
+}
+
+bool journal_hole(const struct journal *jrn, off_t from,
+                  off_t *begin, off_t *end)
+{
+  register int i;
+
+  for(i = 0 ; i < jrn->nranges ; i++) {
+    if(jrn->ranges[i].end < from)
+      continue;
+    if(jrn->ranges[i].begin <= from) {
+      from = jrn->ranges[i].end + 1;
+      continue;
+    }
+    break;
+  }
+  if(from >= jrn->length)
+    return false;
+  *begin = from;
+  *end   = i < jrn->nranges ? jrn->ranges[i].begin - 1 : jrn->length - 1;
+  return true;
+}
+
+off_t journal_done(const struct journal *jrn)
+{
+  register int i;
+  off_t done = 0;
+  for(i = 0 ; i < jrn->nranges ; i++)
+    done += jrn->ranges[i].end - jrn->ranges[i].begin + 1;
+  return done;
+}
@@ -0,0 +1,57 @@
+/* File: journal.h
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+enum jrn { VALIDATOR_MAX = 256 };
+
+struct range
+{
+  off_t begin;
+  off_t end;    /* inclusive */
+};
+
+/* The journal records which byte ranges of the output are on disk and
+   synced along with the validators of the remote file. It lives next to
+   the output and is replaced atomically on each save. */
+struct journal
+{
+  const char *path;
+  off_t length;
+  char etag[VALIDATOR_MAX];
+  char modified[VALIDATOR_MAX];
+  struct range *ranges;  /* sorted and merged */
+  int nranges;
+  int size;
+};
+
+void journal_init(struct journal *jrn, const char *path);
+void journal_free(struct journal *jrn);
+bool journal_load(struct journal *jrn);
+bool journal_save(const struct journal *jrn);
+void journal_remove(const struct journal *jrn);
+void journal_clear(struct journal *jrn);
+void journal_add(struct journal *jrn, off_t begin, off_t end);
+bool journal_hole(const struct journal *jrn, off_t from,
+                  off_t *begin, off_t *end);
+off_t journal_done(const struct journal *jrn);
+
+#endif /* _JOURNAL_H_ */
@@ -0,0 +1,232 @@
+/* File: metalink.c
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <glib.h>
+
+#include "metalink.h"
+
+#define PARSER_T(ptr) ((struct parser *)ptr)
+
+enum metalink_type { TYPE_MAX = 16 };
+
+struct source
+{
+  int priority;    /* lower is better */
+  guint index;     /* in the file, between equals */
+  char *url;
+};
+
+struct parser
+{
+  struct metalink *metalink;
+  GArray *sources;
+  GString *text;
+  int files;
+  bool file;       /* inside the first file */
+  bool pieces;
+  int strength;    /* of the checksum so far */
+  char type[TYPE_MAX];
+  char piece_type[TYPE_MAX];
+  int priority;
+};
+
+/* Hash types we can check from the weakest, as in -k. */
+static int strength(const char *type)
+{
+  const char *types[] = { "md5", "sha1", "sha256", "sha512", NULL };
+  register int i;
+
+  for(i = 0 ; types[i] ; i++)
+    if(!strcmp(types[i],type))
+      return i + 1;
+  return 0;
+}
+
+/* "SHA-256" as "sha256". */
+static void hash_type(char *type, const char *name)
+{
+  register int i = 0;
+
+  for(*type = '\0' ; name && *name && i < TYPE_MAX - 1 ; name++)
+    if(*name != '-')
+      type[i++] = tolower((unsigned char)*name);
+  type[i] = '\0';
+}
+
+static const char *attribute(const char *name, const char **names,
+                             const char **values)
+{
+  for(; *names ; names++, values++)
+    if(!strcmp(*names,name))
+      return *values;
+  return NULL;
+}
+
+static void start_element(GMarkupParseContext *context, const char *name,
+                          const char **names, const char **values,
+                          gpointer data, GError **err)
+{
+  register struct parser *parser = PARSER_T(data);
+  const char *value;
+
+  if(!strcmp(name,"file") && !parser->files++)
+    parser->file = true;
+  if(!parser->file)
+    return;
+  g_string_truncate(parser->text,0);
+  if(!strcmp(name,"pieces")) {
+    parser->pieces = true;
+    hash_type(parser->piece_type,attribute("type",names,values));
+    value = attribute("length",names,values);
+    parser->metalink->piece_length = value ? strtoll(value,NULL,10) : 0;
+  }
+  else if(!strcmp(name,"hash"))
+    hash_type(parser->type,attribute("type",names,values));
+  else if(!strcmp(name,"url")) {
+    /* 4.0 has a priority from 1, 3.0 a preference up to 100 */
+    if((value = attribute("priority",names,values)))
+      parser->priority = atoi(value);
+    else if((value = attribute("preference",names,values)))
+      parser->priority = 101 - atoi(value);
+    else
+      parser->priority = 999999;
+    value = attribute("type",names,values);
+    if(value && strcmp(value,"http") && strcmp(value,"https") &&
+       strcmp(value,"ftp"))
+      parser->priority = -1;
+  }
+}
+
+static void end_element(GMarkupParseContext *context, const char *name,
+                        gpointer data, GError **err)
+{
+  register struct parser *parser = PARSER_T(data);
+  register struct metalink *metalink = parser->metalink;
+  struct source source;
+  char *text;
+
+  if(!parser->file)
+    return;
+  text = g_strstrip(parser->text->str);
+  if(!strcmp(name,"file"))
+    parser->file = false;
+  else if(!strcmp(name,"pieces"))
+    parser->pieces = false;
+  else if(!strcmp(name,"size"))
+    metalink->size = strtoll(text,NULL,10);
+  else if(!strcmp(name,"hash") && parser->pieces) {
+    if(strength(parser->piece_type))
+      g_ptr_array_add(metalink->pieces,
+                      g_strdup_printf("%s:%s",parser->piece_type,text));
+  }
+  else if(!strcmp(name,"hash")) {
+    if(strength(parser->type) > parser->strength && *text &&
+       strlen(parser->type) + strlen(text) + 2 <= METALINK_HASH_MAX) {
+      parser->strength = strength(parser->type);
+      sprintf(metalink->checksum,"%s:%s",parser->type,text);
+    }
+  }
+  else if(!strcmp(name,"url") && parser->priority >= 0 && *text) {
+    source.priority = parser->priority;
+    source.index    = parser->sources->len;
+    source.url      = g_strdup(text);
+    g_array_append_val(parser->sources,source);
+  }
+}
+
+static void text(GMarkupParseContext *context, const char *text, gsize len,
+                 gpointer data, GError **err)
+{
+  if(PARSER_T(data)->file)
+    g_string_append_len(PARSER_T(data)->text,text,len);
+}
+
+static gint compare_sources(gconstpointer a, gconstpointer b)
+{
+  register const struct source *x = a, *y = b;
+  if(x->priority != y->priority)
+    return x->priority < y->priority ? -1 : 1;
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+bool metalink_load(struct metalink *metalink, const char *path)
+{
+  const GMarkupParser markup = { start_element, end_element, text,
+                                 NULL, NULL };
+  struct parser parser;
+  GMarkupParseContext *context;
+  GError *err = NULL;
+  char *content;
+  gsize len;
+  bool ok;
+  guint i;
+
+  memset(metalink,0,sizeof(struct metalink));
+  metalink->size   = -1;
+  metalink->pieces = g_ptr_array_new_with_free_func(g_free);
+  metalink->urls   = g_ptr_array_new_with_free_func(g_free);
+  if(!g_file_get_contents(path,&content,&len,&err)) {
+    fprintf(stderr,"Cannot read metalink: %s\n",err->message);
+    g_error_free(err);
+    return false;
+  }
+  memset(&parser,0,sizeof(struct parser));
+  parser.metalink = metalink;
+  parser.sources  = g_array_new(false,false,sizeof(struct source));
+  parser.text     = g_string_new(NULL);
+  context = g_markup_parse_context_new(&markup,0,&parser,NULL);
+  ok = g_markup_parse_context_parse(context,content,len,&err) &&
+       g_markup_parse_context_end_parse(context,&err);
+  g_markup_parse_context_free(context);
+  g_string_free(parser.text,true);
+  g_free(content);
+
+  g_array_sort(parser.sources,compare_sources);
+  for(i = 0 ; i < parser.sources->len ; i++)
+    g_ptr_array_add(metalink->urls,
+                    g_array_index(parser.sources,struct source,i).url);
+  g_array_free(parser.sources,true);
+
+  if(!ok) {
+    fprintf(stderr,"Invalid metalink: %s\n",err->message);
+    g_error_free(err);
+  }
+  else if(!metalink->urls->len) {
+    fprintf(stderr,"Invalid metalink: no URL\n");
+    ok = false;
+  }
+  /* pieces which do not cover the file cannot be checked */
+  if(metalink->piece_length <= 0 || metalink->size < 0 ||
+     (metalink->size + metalink->piece_length - 1) / metalink->piece_length
+     != metalink->pieces->len)
+    g_ptr_array_set_size(metalink->pieces,0);
+  return ok;
+}
+
+void metalink_free(struct metalink *metalink)
+{
+  if(metalink->pieces)
+    g_ptr_array_free(metalink->pieces,true);
+  if(metalink->urls)
+    g_ptr_array_free(metalink->urls,true);
+  memset(metalink,0,sizeof(struct metalink));
+}
@@ -0,0 +1,41 @@
+/* File: metalink.h
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _METALINK_H_
+#define _METALINK_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <glib.h>
+
+enum metalink_max { METALINK_HASH_MAX = 144 };
+
+/* First file of a Metalink (RFC 5854 or the older 3.0 format). The
+   hashes are given as "<type>:<hex digest>" like with -k. */
+struct metalink
+{
+  off_t size;                       /* -1 when not given */
+  char checksum[METALINK_HASH_MAX]; /* strongest one, empty without */
+  off_t piece_length;
+  GPtrArray *pieces;                /* hash of each piece in order */
+  GPtrArray *urls;                  /* preferred first */
+};
+
+bool metalink_load(struct metalink *metalink, const char *path);
+void metalink_free(struct metalink *metalink);
+
+#endif /* _METALINK_H_ */
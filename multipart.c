@@ -0,0 +1,137 @@
+/* File: multipart.c
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "multipart.h"
+
+enum part_state { PART_BETWEEN,
+                  PART_HEADERS,
+                  PART_DATA,
+                  PART_END,
+                  PART_ERROR };
+
+/* Take the boundary from "multipart/byteranges; boundary=..." where it
+   may be quoted. */
+bool multipart_init(struct multipart *mp, const char *type)
+{
+  register const char *p;
+  register size_t len;
+
+  memset(mp,0,sizeof(struct multipart));
+  mp->state = PART_ERROR;
+  if(strncasecmp(type,"multipart/byteranges",20))
+    return false;
+  for(p = type + 20 ; (p = strchr(p,';')) ; ) {
+    for(p++ ; *p == ' ' || *p == '\t' ; p++);
+    if(strncasecmp(p,"boundary=",9))
+      continue;
+    p  += 9;
+    len = *p == '"' ? strcspn(++p,"\"") : strcspn(p,"; \t");
+    if(!len || len > BOUNDARY_MAX)
+      return false;
+    strcpy(mp->delimiter,"--");
+    memcpy(mp->delimiter + 2,p,len);
+    mp->delimiter[len + 2] = '\0';
+    mp->state = PART_BETWEEN;
+    return true;
+  }
+  return false;
+}
+
+/* A whole line out of the part data, without its end. */
+static void line(struct multipart *mp)
+{
+  register const char *l = mp->line;
+  register size_t n = strlen(mp->delimiter);
+  long long begin,end;
+
+  switch(mp->state) {
+    case PART_BETWEEN:
+      /* the preamble, the end of the previous part and the epilogue */
+      if(strncmp(l,mp->delimiter,n))
+        break;
+      if(!strcmp(l + n,"--"))
+        mp->state = PART_END;
+      else if(!l[n]) {
+        mp->state = PART_HEADERS;
+        mp->range = false;
+      }
+      break;
+    case PART_HEADERS:
+      if(!*l) {
+        mp->state = mp->range ? PART_DATA : PART_ERROR;
+        break;
+      }
+      if(strncasecmp(l,"Content-Range:",14))
+        break;
+      for(l += 14 ; *l == ' ' ; l++);
+      if(sscanf(l,"bytes %lld-%lld/",&begin,&end) != 2 || begin < 0 ||
+         end < begin) {
+        mp->state = PART_ERROR;
+        break;
+      }
+      mp->offset = (off_t)begin;
+      mp->left   = (off_t)(end - begin + 1);
+      mp->range  = true;
+      break;
+  }
+}
+
+/* Hand the bytes of the parts to func as they come, false when the body
+   is not one of byte ranges or func stopped. */
+bool multipart_feed(struct multipart *mp, const char *buf, size_t len,
+                    part_func func, void *data)
+{
+  register size_t n;
+
+  while(len && mp->state != PART_ERROR) {
+    if(mp->state == PART_DATA) {
+      n = (off_t)len < mp->left ? len : (size_t)mp->left;
+      if(!func(data,buf,n,mp->offset))
+        return false;
+      mp->offset += n;
+      mp->left   -= n;
+      buf += n;
+      len -= n;
+      if(!mp->left)
+        mp->state = PART_BETWEEN;
+      continue;
+    }
+    if(mp->state == PART_END)
+      return true;
+    if(*buf != '\n') {
+      /* a line longer than the buffer cannot be a delimiter or a range */
+      if(mp->len < PART_LINE_MAX - 1)
+        mp->line[mp->len++] = *buf;
+      buf++;
+      len--;
+      continue;
+    }
+    if(mp->len && mp->line[mp->len - 1] == '\r')
+      mp->len--;
+    mp->line[mp->len] = '\0';
+    mp->len = 0;
+    buf++;
+    len--;
+    line(mp);
+  }
+  return mp->state != PART_ERROR;
+}
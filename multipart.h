@@ -0,0 +1,47 @@
+/* File: multipart.h
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _MULTIPART_H_
+#define _MULTIPART_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+enum multipart_max { BOUNDARY_MAX = 72,
+                     PART_LINE_MAX = 256 };
+
+/* Bytes of a part at their offset in the file, false to stop. */
+typedef bool (*part_func)(void *data, const char *buf, size_t len,
+                          off_t offset);
+
+/* Parser of a multipart/byteranges body (RFC 7233) as it comes. */
+struct multipart
+{
+  char delimiter[BOUNDARY_MAX + 3]; /* "--" and the boundary */
+  int state;
+  bool range;          /* the part has a Content-Range */
+  off_t offset;        /* in the file of the next byte of the part */
+  off_t left;          /* bytes of the part still to come */
+  char line[PART_LINE_MAX];
+  size_t len;
+};
+
+bool multipart_init(struct multipart *mp, const char *type);
+bool multipart_feed(struct multipart *mp, const char *buf, size_t len,
+                    part_func func, void *data);
+
+#endif /* _MULTIPART_H_ */
@@ -0,0 +1,64 @@
+/* File: progress.c
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <string.h>
+
+#include "progress.h"
+
+void progress_init(struct progress *progress)
+{
+  memset(progress,0,sizeof(struct progress));
+  progress->data.eta = -1.;
+}
+
+/* The fields are copied one by one as relaxed atomics, the sequence
+   number tells the reader whether it got a torn copy. */
+static void copy(struct progress_data *dst, const struct progress_data *src)
+{
+  double v;
+#define COPY(field) \
+  __atomic_load(&src->field,&v,__ATOMIC_RELAXED); \
+  __atomic_store(&dst->field,&v,__ATOMIC_RELAXED)
+  COPY(dlnow);
+  COPY(dltot);
+  COPY(speed);
+  COPY(smooth);
+  COPY(eta);
+#undef COPY
+}
+
+void progress_publish(struct progress *progress,
+                      const struct progress_data *data)
+{
+  unsigned int seq = __atomic_load_n(&progress->seq,__ATOMIC_RELAXED);
+
+  __atomic_store_n(&progress->seq,seq + 1,__ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  copy(&progress->data,data);
+  __atomic_store_n(&progress->seq,seq + 2,__ATOMIC_RELEASE);
+}
+
+void progress_read(struct progress *progress, struct progress_data *data)
+{
+  unsigned int seq;
+
+  do {
+    seq = __atomic_load_n(&progress->seq,__ATOMIC_ACQUIRE);
+    copy(data,&progress->data);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while((seq & 1) || seq != __atomic_load_n(&progress->seq,__ATOMIC_RELAXED));
+}
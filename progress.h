@@ -0,0 +1,44 @@
+/* File: progress.h
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _PROGRESS_H_
+#define _PROGRESS_H_
+
+struct progress_data
+{
+  double dlnow;
+  double dltot;
+  double speed;    /* bytes per second over the last few seconds */
+  double smooth;   /* averaged speed */
+  double eta;      /* seconds, negative when unknown */
+};
+
+/* Progress snapshot guarded by a sequence lock. The transfer side
+   publishes without ever waiting and any thread may take a consistent
+   copy at its own pace. There must be only one publisher at a time. */
+struct progress
+{
+  unsigned int seq;   /* odd while an update is being published */
+  struct progress_data data;
+};
+
+void progress_init(struct progress *progress);
+void progress_publish(struct progress *progress,
+                      const struct progress_data *data);
+void progress_read(struct progress *progress, struct progress_data *data);
+
+#endif /* _PROGRESS_H_ */
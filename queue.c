@@ -0,0 +1,266 @@
+/* File: queue.c
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "queue.h"
+
+#define QUEUE_T(ptr) ((struct queue *)ptr)
+
+/* Lower case host part of an URL, without credentials nor port. */
+static void extract_host(const char *url, char *host)
+{
+  register const char *p,*end,*at;
+  register size_t len;
+
+  p = strstr(url,"://");
+  p = p ? p + 3 : url;
+  end = p + strcspn(p,"/?#");
+  for(at = p ; at < end ; at++)
+    if(*at == '@')
+      p = at + 1;
+  if(*p == '[')
+    for(at = p ; at < end && *at != ']' ; at++);
+  else
+    for(at = p ; at < end && *at != ':' ; at++);
+  len = at - p + (*at == ']');
+  if(len >= HOST_MAX)
+    len = HOST_MAX - 1;
+  for(host[len] = '\0' ; len-- ; )
+    host[len] = tolower((unsigned char)p[len]);
+}
+
+static struct record *new_record(const char *url, const char *output,
+                                 gpointer opts, int priority)
+{
+  register struct record *record = g_malloc(sizeof(struct record));
+  record->url      = g_strdup(url);
+  record->output   = g_strdup(output);
+  record->opts     = opts;
+  record->priority = priority;
+  record->next     = NULL;
+  extract_host(url,record->host);
+  return record;
+}
+
+static void free_record(struct queue *queue, struct record *record)
+{
+  if(record->opts && queue->free_opts)
+    queue->free_opts(record->opts);
+  g_free(record->url);
+  g_free(record->output);
+  g_free(record);
+}
+
+/* After the records of the same priority. */
+static void defer(struct queue *queue, struct record *record)
+{
+  register struct record **r;
+
+  if(!queue->last || queue->last->priority >= record->priority)
+    r = queue->last ? &queue->last->next : &queue->deferred;
+  else
+    for(r = &queue->deferred ; (*r)->priority >= record->priority ;
+        r = &(*r)->next);
+  record->next = *r;
+  *r = record;
+  if(!record->next)
+    queue->last = record;
+  queue->ndeferred++;
+}
+
+static void undefer(struct queue *queue, struct record *record)
+{
+  register struct record **r,*prev = NULL;
+
+  for(r = &queue->deferred ; *r != record ; prev = *r, r = &(*r)->next);
+  *r = record->next;
+  if(queue->last == record)
+    queue->last = prev;
+  queue->ndeferred--;
+  record->next = NULL;
+}
+
+static bool room(struct queue *queue, const struct record *record)
+{
+  int n = GPOINTER_TO_INT(g_hash_table_lookup(queue->hosts,record->host));
+  return queue->per_host <= 0 || n < queue->per_host;
+}
+
+/* Take a slot for the host of the record. */
+static void take(struct queue *queue, const struct record *record)
+{
+  int n = GPOINTER_TO_INT(g_hash_table_lookup(queue->hosts,record->host));
+  g_hash_table_replace(queue->hosts,g_strdup(record->host),
+                       GINT_TO_POINTER(n + 1));
+}
+
+static gboolean callback_input(GIOChannel *channel, GIOCondition cond,
+                               gpointer data)
+{
+  QUEUE_T(data)->watch = 0;
+  QUEUE_T(data)->ready(QUEUE_T(data)->data);
+  return false;
+}
+
+/* Read the next "url [output]" line, NULL when there is none for now. */
+static struct record *read_record(struct queue *queue)
+{
+  struct record *record = NULL;
+  GError *err = NULL;
+  GIOStatus status;
+  char *line,*url,*output;
+  gsize len;
+
+  while(!record && !queue->eof) {
+    status = g_io_channel_read_line(queue->input,&line,&len,NULL,&err);
+    if(status == G_IO_STATUS_AGAIN) {
+      if(!queue->watch)
+        queue->watch = g_io_add_watch(queue->input,G_IO_IN | G_IO_HUP,
+                                      callback_input,queue);
+      break;
+    }
+    if(status != G_IO_STATUS_NORMAL) {
+      if(err) {
+        fprintf(stderr,"Cannot read input list: %s\n",err->message);
+        g_error_free(err);
+      }
+      queue->eof = true;
+      break;
+    }
+    url = g_strstrip(line);
+    if(*url && *url != '#') {
+      output = url + strcspn(url," \t");
+      if(*output)
+        *output++ = '\0';
+      output = g_strchug(output);
+      record = new_record(url,*output ? output : NULL,NULL,queue->priority);
+    }
+    g_free(line);
+  }
+  return record;
+}
+
+bool queue_init(struct queue *queue, const char *path, int per_host,
+                int priority, GDestroyNotify free_opts, GSourceFunc ready,
+                gpointer data)
+{
+  GError *err = NULL;
+
+  memset(queue,0,sizeof(struct queue));
+  queue->per_host  = per_host;
+  queue->priority  = priority;
+  queue->free_opts = free_opts;
+  queue->ready     = ready;
+  queue->data      = data;
+  queue->hosts     = g_hash_table_new_full(g_str_hash,g_str_equal,
+                                           g_free,NULL);
+  if(!path) {
+    queue->eof = true;
+    return true;
+  }
+  if(!strcmp(path,"-"))
+    queue->input = g_io_channel_unix_new(STDIN_FILENO);
+  else
+    queue->input = g_io_channel_new_file(path,"r",&err);
+  if(!queue->input) {
+    fprintf(stderr,"Cannot open input list: %s\n",err->message);
+    g_error_free(err);
+    return false;
+  }
+  /* URLs are bytes, and a pipe must not block the main loop */
+  g_io_channel_set_encoding(queue->input,NULL,NULL);
+  g_io_channel_set_flags(queue->input,G_IO_FLAG_NONBLOCK,NULL);
+  return true;
+}
+
+void queue_free(struct queue *queue)
+{
+  register struct record *record,*next;
+  if(queue->watch)
+    g_source_remove(queue->watch);
+  if(queue->input)
+    g_io_channel_unref(queue->input);
+  for(record = queue->deferred ; record ; record = next) {
+    next = record->next;
+    free_record(queue,record);
+  }
+  if(queue->hosts)
+    g_hash_table_destroy(queue->hosts);
+  memset(queue,0,sizeof(struct queue));
+}
+
+/* Records given on the command line or forwarded by another instance
+   go before the input list. The queue owns the options. */
+void queue_push(struct queue *queue, const char *url, const char *output,
+                gpointer opts, int priority)
+{
+  defer(queue,new_record(url,output,opts,priority));
+}
+
+/* Next record of a priority above the given one which may start now.
+   Its host slot is taken until queue_done. */
+struct record *queue_next(struct queue *queue, int above)
+{
+  register struct record *best,*record = NULL;
+
+  for(best = queue->deferred ; best && best->priority > above ;
+      best = best->next)
+    if(room(queue,best))
+      break;
+  if(best && best->priority <= above)
+    best = NULL;
+  /* the input list goes before the deferred records of lower priority */
+  if((!best || best->priority < queue->priority) &&
+     queue->priority > above) {
+    while(queue->ndeferred < DEFER_MAX && (record = read_record(queue))) {
+      if(room(queue,record))
+        break;
+      defer(queue,record);
+      record = NULL;
+    }
+  }
+  if(record)
+    take(queue,record);
+  else if((record = best)) {
+    undefer(queue,record);
+    take(queue,record);
+  }
+  return record;
+}
+
+/* Give back the slot of a record and free it. */
+void queue_done(struct queue *queue, struct record *record)
+{
+  int n = GPOINTER_TO_INT(g_hash_table_lookup(queue->hosts,record->host));
+  if(n > 1)
+    g_hash_table_replace(queue->hosts,g_strdup(record->host),
+                         GINT_TO_POINTER(n - 1));
+  else
+    g_hash_table_remove(queue->hosts,record->host);
+  free_record(queue,record);
+}
+
+bool queue_empty(const struct queue *queue)
+{
+  return queue->eof && !queue->deferred;
+}
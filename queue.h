@@ -0,0 +1,71 @@
+/* File: queue.h
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+#include <stdbool.h>
+#include <glib.h>
+
+enum queue_max { HOST_MAX = 256,
+                 DEFER_MAX = 64 };
+
+/* One download to do. */
+struct record
+{
+  char *url;
+  char *output;            /* NULL for the default output */
+  gpointer opts;           /* NULL for the default options */
+  int priority;
+  char host[HOST_MAX];
+  struct record *next;
+};
+
+/* Download queue. The input list is read one line at a time only when
+   a slot is free, so its length does not matter. Records whose host
+   already has its share of slots wait in a short deferred list; once it
+   is full the input is not read any further until a slot frees up. The
+   deferred list is kept by priority, the records of the input list all
+   have the default one. The ready callback is scheduled on the main
+   loop when a blocking input has new lines. */
+struct queue
+{
+  GIOChannel *input;
+  guint watch;
+  bool eof;
+  int per_host;            /* 0 for no limit */
+  int priority;            /* of the records of the input list */
+  GHashTable *hosts;       /* running jobs per host */
+  struct record *deferred; /* highest priority first */
+  struct record *last;
+  int ndeferred;
+  GDestroyNotify free_opts;
+  GSourceFunc ready;
+  gpointer data;
+};
+
+bool queue_init(struct queue *queue, const char *path, int per_host,
+                int priority, GDestroyNotify free_opts, GSourceFunc ready,
+                gpointer data);
+void queue_free(struct queue *queue);
+void queue_push(struct queue *queue, const char *url, const char *output,
+                gpointer opts, int priority);
+struct record *queue_next(struct queue *queue, int above);
+void queue_done(struct queue *queue, struct record *record);
+bool queue_empty(const struct queue *queue);
+
+#endif /* _QUEUE_H_ */
@@ -0,0 +1,80 @@
+/* File: rate.c
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <string.h>
+#include <math.h>
+
+#include "rate.h"
+
+#define SAMPLE(rate,i) ((rate)->samples[((rate)->first + (i)) % RATE_SAMPLES])
+
+void rate_init(struct rate *rate, double window)
+{
+  memset(rate,0,sizeof(struct rate));
+  rate->window = window;
+}
+
+void rate_sample(struct rate *rate, double now, double bytes)
+{
+  struct rate_sample *last,*oldest;
+  double delta;
+
+  if(rate->count) {
+    last = &SAMPLE(rate,rate->count - 1);
+    /* a transfer that starts over invalidates the history */
+    if(bytes < last->bytes || now < last->time) {
+      rate->count   = 0;
+      rate->instant = 0.;
+      rate->smooth  = 0.;
+    }
+    /* coalesce samples so that the ring always covers the window */
+    else if(now - last->time < rate->window / RATE_SAMPLES)
+      return;
+  }
+  delta = rate->count ? now - SAMPLE(rate,rate->count - 1).time : 0.;
+
+  if(rate->count == RATE_SAMPLES) {
+    rate->first = (rate->first + 1) % RATE_SAMPLES;
+    rate->count--;
+  }
+  SAMPLE(rate,rate->count).time  = now;
+  SAMPLE(rate,rate->count).bytes = bytes;
+  rate->count++;
+
+  /* keep at least two samples even when they are older than the window */
+  while(rate->count > 2 && now - SAMPLE(rate,1).time >= rate->window) {
+    rate->first = (rate->first + 1) % RATE_SAMPLES;
+    rate->count--;
+  }
+  if(rate->count < 2)
+    return;
+
+  oldest = &SAMPLE(rate,0);
+  rate->instant = (bytes - oldest->bytes) / (now - oldest->time);
+  if(rate->smooth == 0.)
+    rate->smooth = rate->instant;
+  else
+    rate->smooth += (1. - exp(-delta / rate->window)) *
+                    (rate->instant - rate->smooth);
+}
+
+double rate_eta(const struct rate *rate, double remaining)
+{
+  if(rate->smooth <= 0. || remaining < 0.)
+    return -1.;
+  return remaining / rate->smooth;
+}
@@ -0,0 +1,47 @@
+/* File: rate.h
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _RATE_H_
+#define _RATE_H_
+
+enum rate_max { RATE_SAMPLES = 64 };
+
+struct rate_sample
+{
+  double time;
+  double bytes;
+};
+
+/* Throughput estimator fed with timestamped byte counts. The
+   instantaneous rate spans a sliding window of recent samples and the
+   smoothed rate is an exponential moving average of it with the window
+   as time constant. */
+struct rate
+{
+  struct rate_sample samples[RATE_SAMPLES];
+  int first;
+  int count;
+  double window;   /* seconds */
+  double instant;  /* bytes per second over the window */
+  double smooth;   /* bytes per second, averaged */
+};
+
+void rate_init(struct rate *rate, double window);
+void rate_sample(struct rate *rate, double now, double bytes);
+double rate_eta(const struct rate *rate, double remaining);
+
+#endif /* _RATE_H_ */
@@ -0,0 +1,232 @@
+/* File: server.c
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <glib.h>
+
+#include "server.h"
+
+#define SERVER_T(ptr) ((struct server *)ptr)
+#define CLIENT_T(ptr) ((struct client *)ptr)
+
+struct client
+{
+  struct server *server;
+  GIOChannel *channel;
+  guint watch;
+  GPtrArray *lines;
+};
+
+static void free_client(struct client *client)
+{
+  client->server->clients = g_slist_remove(client->server->clients,client);
+  if(client->watch)
+    g_source_remove(client->watch);
+  g_io_channel_unref(client->channel);
+  g_ptr_array_free(client->lines,true);
+  g_free(client);
+}
+
+static void reply(struct client *client, bool ok)
+{
+  register const char *answer = ok ? "ok\n" : "error\n";
+  /* a few bytes on a fresh socket, this does not block */
+  if(write(g_io_channel_unix_get_fd(client->channel),
+           answer,strlen(answer)) == -1)
+    perror("Cannot answer request");
+}
+
+static gboolean callback_client(GIOChannel *channel, GIOCondition cond,
+                                gpointer data)
+{
+  register struct client *client = CLIENT_T(data);
+  GIOStatus status;
+  char *line;
+  gsize len,term;
+
+  while(1) {
+    status = g_io_channel_read_line(channel,&line,&len,&term,NULL);
+    if(status == G_IO_STATUS_AGAIN)
+      return true;
+    if(status != G_IO_STATUS_NORMAL)
+      break;
+    line[term] = '\0';
+    if(!*line) {
+      /* the request is complete */
+      g_free(line);
+      g_ptr_array_add(client->lines,NULL);
+      reply(client,client->server->request(client->server->data,
+                                           (char **)client->lines->pdata));
+      break;
+    }
+    g_ptr_array_add(client->lines,line);
+  }
+  client->watch = 0;
+  free_client(client);
+  return false;
+}
+
+static gboolean callback_accept(GIOChannel *channel, GIOCondition cond,
+                                gpointer data)
+{
+  register struct client *client;
+  int fd;
+
+  fd = accept(SERVER_T(data)->fd,NULL,NULL);
+  if(fd == -1)
+    return true;
+  client = g_malloc(sizeof(struct client));
+  client->server  = SERVER_T(data);
+  client->lines   = g_ptr_array_new_with_free_func(g_free);
+  client->channel = g_io_channel_unix_new(fd);
+  g_io_channel_set_close_on_unref(client->channel,true);
+  g_io_channel_set_encoding(client->channel,NULL,NULL);
+  g_io_channel_set_flags(client->channel,G_IO_FLAG_NONBLOCK,NULL);
+  client->watch   = g_io_add_watch(client->channel,G_IO_IN | G_IO_HUP,
+                                   callback_client,client);
+  SERVER_T(data)->clients = g_slist_prepend(SERVER_T(data)->clients,client);
+  return true;
+}
+
+static int connect_to(const char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  fd = socket(AF_UNIX,SOCK_STREAM,0);
+  if(fd == -1)
+    return -1;
+  memset(&addr,0,sizeof(struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path,path,sizeof(addr.sun_path) - 1);
+  if(!connect(fd,(struct sockaddr *)&addr,sizeof(struct sockaddr_un)))
+    return fd;
+  close(fd);
+  return -1;
+}
+
+static bool alive(const char *path)
+{
+  int fd = connect_to(path);
+  if(fd == -1)
+    return false;
+  close(fd);
+  return true;
+}
+
+/* The runtime directory is private to the user. */
+void server_path(char *path)
+{
+  snprintf(path,SOCKET_PATH_MAX,"%s/gdownload.sock",
+           g_get_user_runtime_dir());
+}
+
+bool server_listen(struct server *server, const char *path,
+                   server_request_t request, gpointer data)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  memset(server,0,sizeof(struct server));
+  server->fd = -1;
+  memset(&addr,0,sizeof(struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+  if(snprintf(addr.sun_path,sizeof(addr.sun_path),"%s.%d",path,
+              (int)getpid()) >= (int)sizeof(addr.sun_path))
+    return false;
+  fd = socket(AF_UNIX,SOCK_STREAM,0);
+  if(fd == -1)
+    return false;
+  unlink(addr.sun_path);
+  if(bind(fd,(struct sockaddr *)&addr,sizeof(struct sockaddr_un)) == -1 ||
+     listen(fd,SOMAXCONN) == -1) {
+    unlink(addr.sun_path);
+    close(fd);
+    return false;
+  }
+  /* only published once it listens, the instances starting at the same
+     time find it alive and forward to it */
+  if(link(addr.sun_path,path) == -1) {
+    /* a socket nobody listens to is left by a crashed instance */
+    if(errno != EEXIST || alive(path) ||
+       unlink(path) == -1 || link(addr.sun_path,path) == -1) {
+      unlink(addr.sun_path);
+      close(fd);
+      return false;
+    }
+  }
+  unlink(addr.sun_path);
+  server->fd      = fd;
+  server->request = request;
+  server->data    = data;
+  strncpy(server->path,path,SOCKET_PATH_MAX - 1);
+  server->channel = g_io_channel_unix_new(fd);
+  server->watch   = g_io_add_watch(server->channel,G_IO_IN,
+                                   callback_accept,server);
+  return true;
+}
+
+/* Stop listening, the next instance will listen in turn. */
+void server_free(struct server *server)
+{
+  if(server->fd == -1)
+    return;
+  while(server->clients)
+    free_client(CLIENT_T(server->clients->data));
+  g_source_remove(server->watch);
+  g_io_channel_unref(server->channel);
+  unlink(server->path);
+  close(server->fd);
+  server->fd = -1;
+}
+
+/* Hand a request to the running instance, false when there is none or
+   it did not take it. */
+bool server_forward(const char *path, const char *request)
+{
+  struct timeval timeout = { REPLY_TIMEOUT, 0 };
+  char answer[8];
+  size_t len = strlen(request);
+  ssize_t n;
+  int fd;
+
+  fd = connect_to(path);
+  if(fd == -1)
+    return false;
+  setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(struct timeval));
+  while(len) {
+    n = write(fd,request,len);
+    if(n == -1)
+      break;
+    request += n;
+    len -= n;
+  }
+  n = len ? -1 : read(fd,answer,sizeof(answer) - 1);
+  close(fd);
+  if(n <= 0)
+    return false;
+  answer[n] = '\0';
+  return !strcmp(answer,"ok\n");
+}
@@ -0,0 +1,52 @@
+/* File: server.h
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include <stdbool.h>
+#include <glib.h>
+
+enum server_max { SOCKET_PATH_MAX = 108,
+                  REPLY_TIMEOUT = 2 };
+
+/* Called from the main loop with the lines of a request, without the
+   empty line which ends it. The lines may be modified. */
+typedef bool (*server_request_t)(gpointer data, char **lines);
+
+/* Single instance server. The first instance listens on a Unix socket
+   in the runtime directory of the user, the next ones send it their
+   download as "<name> <value>" lines ended by an empty line and leave
+   once it answered. */
+struct server
+{
+  int fd;
+  char path[SOCKET_PATH_MAX];
+  GIOChannel *channel;
+  guint watch;
+  GSList *clients;
+  server_request_t request;
+  gpointer data;
+};
+
+void server_path(char *path);
+bool server_listen(struct server *server, const char *path,
+                   server_request_t request, gpointer data);
+void server_free(struct server *server);
+bool server_forward(const char *path, const char *request);
+
+#endif /* _SERVER_H_ */
@@ -0,0 +1,219 @@
+/* File: writer.c
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <glib.h>
+
+#include "writer.h"
+
+#define WRITER_T(ptr) ((struct writer *)ptr)
+#define CHUNK(writer,i) ((writer)->chunks[((writer)->first + (i)) % CHUNKS_MAX])
+
+/* Write a region of the ring that may wrap around its end. */
+static int write_ring(struct writer *writer, uint64_t pos, size_t len,
+                      off_t offset)
+{
+  struct iovec iov[2];
+  register struct iovec *v = iov;
+  size_t at = pos % writer->size;
+  ssize_t wt;
+  int cnt = 1;
+
+  iov[0].iov_base = writer->ring + at;
+  iov[0].iov_len  = len;
+  if(at + len > writer->size) {
+    iov[0].iov_len  = writer->size - at;
+    iov[1].iov_base = writer->ring;
+    iov[1].iov_len  = len - iov[0].iov_len;
+    cnt = 2;
+  }
+  while(len) {
+    wt = pwritev(writer->fd,v,cnt,offset);
+    if(wt == -1) {
+      if(errno == EINTR)
+        continue;
+      return errno;
+    }
+    len    -= wt;
+    offset += wt;
+    /* short write, skip what is done */
+    for( ; cnt && (size_t)wt >= v->iov_len ; v++, cnt--)
+      wt -= v->iov_len;
+    if(cnt) {
+      v->iov_base = (char *)v->iov_base + wt;
+      v->iov_len -= wt;
+    }
+  }
+  return 0;
+}
+
+static gpointer proceed_writer(gpointer data)
+{
+  register struct writer *writer = WRITER_T(data);
+  register int n;
+  uint64_t pos;
+  off_t offset;
+  size_t len;
+  int err;
+
+  g_mutex_lock(&writer->lock);
+  while(1) {
+    while(!writer->count && !writer->stop)
+      g_cond_wait(&writer->filled,&writer->lock);
+    if(!writer->count)
+      break;
+
+    /* chunks are contiguous in the ring, merge those also contiguous
+       in the file in one batch */
+    pos    = writer->tail;
+    offset = CHUNK(writer,0).offset;
+    len    = CHUNK(writer,0).len;
+    for(n = 1 ;
+        n < writer->count &&
+          CHUNK(writer,n).offset == offset + (off_t)len &&
+          len + CHUNK(writer,n).len <= BATCH_MAX ;
+        n++)
+      len += CHUNK(writer,n).len;
+    g_mutex_unlock(&writer->lock);
+
+    err = write_ring(writer,pos,len,offset);
+
+    g_mutex_lock(&writer->lock);
+    if(err && !writer->error)
+      writer->error = err;
+    writer->tail  += len;
+    writer->first  = (writer->first + n) % CHUNKS_MAX;
+    writer->count -= n;
+    if(writer->written)
+      writer->written(writer->data,writer->tail);
+    if(writer->waiting) {
+      writer->waiting = false;
+      g_idle_add(writer->resume,writer->data);
+    }
+    g_cond_broadcast(&writer->drained);
+  }
+  g_mutex_unlock(&writer->lock);
+  return NULL;
+}
+
+bool writer_init(struct writer *writer, int fd, size_t size,
+                 GSourceFunc resume, gpointer data)
+{
+  memset(writer,0,sizeof(struct writer));
+  writer->fd     = fd;
+  writer->size   = size;
+  writer->resume = resume;
+  writer->data   = data;
+  writer->ring   = malloc(size);
+  if(!writer->ring)
+    return false;
+  g_mutex_init(&writer->lock);
+  g_cond_init(&writer->filled);
+  g_cond_init(&writer->drained);
+  writer->thread = g_thread_new("writer",proceed_writer,writer);
+  return true;
+}
+
+void writer_free(struct writer *writer)
+{
+  if(!writer->ring)
+    return;
+  g_mutex_lock(&writer->lock);
+  writer->stop = true;
+  g_cond_signal(&writer->filled);
+  g_mutex_unlock(&writer->lock);
+  g_thread_join(writer->thread);
+  g_mutex_clear(&writer->lock);
+  g_cond_clear(&writer->filled);
+  g_cond_clear(&writer->drained);
+  free(writer->ring);
+  writer->ring = NULL;
+}
+
+/* Copy a chunk in the ring, false when there is no room for it. */
+bool writer_push(struct writer *writer, const void *buf, size_t len,
+                 off_t offset)
+{
+  size_t at,part;
+
+  g_mutex_lock(&writer->lock);
+  if(writer->error) {
+    g_mutex_unlock(&writer->lock);
+    return false;
+  }
+  if(writer->size - (writer->head - writer->tail) < len ||
+     writer->count == CHUNKS_MAX) {
+    writer->waiting = true;
+    g_mutex_unlock(&writer->lock);
+    return false;
+  }
+  at   = writer->head % writer->size;
+  part = len < writer->size - at ? len : writer->size - at;
+  memcpy(writer->ring + at,buf,part);
+  memcpy(writer->ring,(const char *)buf + part,len - part);
+  CHUNK(writer,writer->count).offset = offset;
+  CHUNK(writer,writer->count).len    = len;
+  writer->count++;
+  writer->head += len;
+  g_cond_signal(&writer->filled);
+  g_mutex_unlock(&writer->lock);
+  return true;
+}
+
+/* Wait until everything pushed is written, return the first error. */
+int writer_flush(struct writer *writer)
+{
+  int err;
+  g_mutex_lock(&writer->lock);
+  while(writer->count)
+    g_cond_wait(&writer->drained,&writer->lock);
+  err = writer->error;
+  g_mutex_unlock(&writer->lock);
+  return err;
+}
+
+int writer_error(struct writer *writer)
+{
+  int err;
+  g_mutex_lock(&writer->lock);
+  err = writer->error;
+  g_mutex_unlock(&writer->lock);
+  return err;
+}
+
+uint64_t writer_pushed(struct writer *writer)
+{
+  uint64_t head;
+  g_mutex_lock(&writer->lock);
+  head = writer->head;
+  g_mutex_unlock(&writer->lock);
+  return head;
+}
+
+uint64_t writer_done(struct writer *writer)
+{
+  uint64_t tail;
+  g_mutex_lock(&writer->lock);
+  tail = writer->tail;
+  g_mutex_unlock(&writer->lock);
+  return tail;
+}
@@ -0,0 +1,72 @@
+/* File: writer.h
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _WRITER_H_
+#define _WRITER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <glib.h>
+
+enum writer_max { CHUNKS_MAX = 4096,
+                  BATCH_MAX  = 1048576 };
+
+struct chunk
+{
+  off_t offset;
+  size_t len;
+};
+
+/* Writer stage. The receive path copies the data in a bounded ring and
+   a dedicated thread flushes it to the output in large batches, so that
+   a slow disk never stalls the sockets. When the ring is full the push
+   fails and the resume callback is scheduled on the main loop once
+   there is room again. */
+struct writer
+{
+  int fd;
+  char *ring;
+  size_t size;
+  uint64_t head;    /* bytes pushed */
+  uint64_t tail;    /* bytes written */
+  struct chunk chunks[CHUNKS_MAX];
+  int first;
+  int count;
+  bool waiting;     /* a push was refused */
+  bool stop;
+  int error;        /* errno of the first failed write */
+  GSourceFunc resume;
+  void (*written)(gpointer data, uint64_t done);  /* from the thread */
+  gpointer data;
+  GThread *thread;
+  GMutex lock;
+  GCond filled;
+  GCond drained;
+};
+
+bool writer_init(struct writer *writer, int fd, size_t size,
+                 GSourceFunc resume, gpointer data);
+void writer_free(struct writer *writer);
+bool writer_push(struct writer *writer, const void *buf, size_t len,
+                 off_t offset);
+int writer_flush(struct writer *writer);
+int writer_error(struct writer *writer);
+uint64_t writer_pushed(struct writer *writer);
+uint64_t writer_done(struct writer *writer);
+
+#endif /* _WRITER_H_ */
@@ -0,0 +1,471 @@
+/* File: zsync.c
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "journal.h"
+#include "zsync.h"
+
+enum zsync_scan { MD4_SIZE = 16,
+                  SCAN_CHUNK = 1048576,
+                  COPY_CHUNK = 65536 };
+
+#define NONE UINT32_MAX
+
+/* MD4 as in RFC 1320, only used on whole blocks. */
+#define F(x,y,z) (((x) & (y)) | (~(x) & (z)))
+#define G(x,y,z) (((x) & (y)) | ((x) & (z)) | ((y) & (z)))
+#define H(x,y,z) ((x) ^ (y) ^ (z))
+#define ROTL(x,n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void md4_block(uint32_t *state, const unsigned char *p)
+{
+  static const int order[] = { 0, 2, 1, 3 };
+  uint32_t x[16],a,b,c,d;
+  register int i,k;
+
+  for(i = 0 ; i < 16 ; i++)
+    x[i] = p[4*i] | p[4*i+1] << 8 | p[4*i+2] << 16 |
+           (uint32_t)p[4*i+3] << 24;
+  a = state[0]; b = state[1]; c = state[2]; d = state[3];
+  for(i = 0 ; i < 16 ; i += 4) {
+    a = ROTL(a + F(b,c,d) + x[i],3);
+    d = ROTL(d + F(a,b,c) + x[i+1],7);
+    c = ROTL(c + F(d,a,b) + x[i+2],11);
+    b = ROTL(b + F(c,d,a) + x[i+3],19);
+  }
+  for(i = 0 ; i < 4 ; i++) {
+    a = ROTL(a + G(b,c,d) + x[i] + 0x5a827999,3);
+    d = ROTL(d + G(a,b,c) + x[i+4] + 0x5a827999,5);
+    c = ROTL(c + G(d,a,b) + x[i+8] + 0x5a827999,9);
+    b = ROTL(b + G(c,d,a) + x[i+12] + 0x5a827999,13);
+  }
+  for(i = 0 ; i < 4 ; i++) {
+    k = order[i];
+    a = ROTL(a + H(b,c,d) + x[k] + 0x6ed9eba1,3);
+    d = ROTL(d + H(a,b,c) + x[k+8] + 0x6ed9eba1,9);
+    c = ROTL(c + H(d,a,b) + x[k+4] + 0x6ed9eba1,11);
+    b = ROTL(b + H(c,d,a) + x[k+12] + 0x6ed9eba1,15);
+  }
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+}
+
+static void md4(const unsigned char *data, size_t len, unsigned char *digest)
+{
+  uint32_t state[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+  uint64_t bits = (uint64_t)len * 8;
+  unsigned char tail[128];
+  size_t rest,n;
+  register int i;
+
+  for( ; len >= 64 ; data += 64, len -= 64)
+    md4_block(state,data);
+  rest = len;
+  n = rest < 56 ? 64 : 128;
+  memcpy(tail,data,rest);
+  memset(tail + rest,0,n - rest);
+  tail[rest] = 0x80;
+  for(i = 0 ; i < 8 ; i++)
+    tail[n - 8 + i] = (unsigned char)(bits >> (8 * i));
+  md4_block(state,tail);
+  if(n == 128)
+    md4_block(state,tail + 64);
+  for(i = 0 ; i < 16 ; i++)
+    digest[i] = (unsigned char)(state[i / 4] >> (8 * (i % 4)));
+}
+
+/* The rolling checksum of zsync: a is the sum of the bytes and b the
+   sum of the bytes weighted from the block size down to 1, both on 16
+   bits. They are kept on 32 bits and cut when compared. */
+static void rsum_block(const unsigned char *p, size_t len,
+                       uint32_t *a, uint32_t *b)
+{
+  for(*a = *b = 0 ; len ; len--, p++) {
+    *a += *p;
+    *b += (uint32_t)len * *p;
+  }
+}
+
+static uint32_t rsum_key(const struct zsync *zsync, uint32_t a, uint32_t b)
+{
+  uint32_t key = (a & 0xffff) << 16 | (b & 0xffff);
+  return zsync->rsum_bytes == 4 ? key :
+         key & ((1U << (8 * zsync->rsum_bytes)) - 1);
+}
+
+static const unsigned char *block_sum(const struct zsync *zsync, off_t i)
+{
+  return zsync->sums + i * (zsync->rsum_bytes + zsync->checksum_bytes);
+}
+
+static uint32_t block_key(const struct zsync *zsync, off_t i)
+{
+  register const unsigned char *p = block_sum(zsync,i);
+  register int k;
+  uint32_t key = 0;
+
+  for(k = 0 ; k < zsync->rsum_bytes ; k++)
+    key = key << 8 | p[k];
+  return key;
+}
+
+static bool power_of_two(long n)
+{
+  return n > 0 && !(n & (n - 1));
+}
+
+bool zsync_load(struct zsync *zsync, const char *path)
+{
+  char line[4096],*value;
+  size_t len,size;
+  bool ok = false;
+  FILE *fp;
+
+  memset(zsync,0,sizeof(struct zsync));
+  zsync->length         = -1;
+  zsync->seq_matches    = 1;
+  zsync->rsum_bytes     = 4;
+  zsync->checksum_bytes = MD4_SIZE;
+  if(!(fp = fopen(path,"rb"))) {
+    perror("Cannot open zsync file");
+    return false;
+  }
+  while(fgets(line,sizeof(line),fp)) {
+    len = strlen(line);
+    while(len && (line[len-1] == '\n' || line[len-1] == '\r'))
+      line[--len] = '\0';
+    if(!len) {
+      ok = true;
+      break;
+    }
+    if(!(value = strchr(line,':')))
+      continue;
+    for(*value++ = '\0' ; *value == ' ' ; value++);
+    if(!strcmp(line,"Length"))
+      zsync->length = strtoll(value,NULL,10);
+    else if(!strcmp(line,"Blocksize"))
+      zsync->blocksize = atoi(value);
+    else if(!strcmp(line,"Hash-Lengths"))
+      sscanf(value,"%d,%d,%d",&zsync->seq_matches,&zsync->rsum_bytes,
+             &zsync->checksum_bytes);
+    else if(!strcmp(line,"URL") && !zsync->url && strstr(value,"://"))
+      zsync->url = g_strdup(value);
+    else if(!strcmp(line,"SHA-1") && strlen(value) == 40)
+      snprintf(zsync->checksum,ZSYNC_HASH_MAX,"sha1:%s",value);
+  }
+  if(!ok || zsync->length < 0 || !power_of_two(zsync->blocksize) ||
+     zsync->seq_matches < 1 || zsync->seq_matches > 2 ||
+     zsync->rsum_bytes < 1 || zsync->rsum_bytes > 4 ||
+     zsync->checksum_bytes < 3 || zsync->checksum_bytes > MD4_SIZE) {
+    fprintf(stderr,"Invalid zsync file: bad header\n");
+    fclose(fp);
+    return false;
+  }
+  zsync->nblocks = (zsync->length + zsync->blocksize - 1) /
+                   zsync->blocksize;
+  if(zsync->nblocks >= NONE) {
+    fprintf(stderr,"Invalid zsync file: too many blocks\n");
+    fclose(fp);
+    return false;
+  }
+  size = (size_t)zsync->nblocks *
+         (zsync->rsum_bytes + zsync->checksum_bytes);
+  zsync->sums = g_malloc(size ? size : 1);
+  ok = fread(zsync->sums,1,size,fp) == size;
+  fclose(fp);
+  if(!ok)
+    fprintf(stderr,"Invalid zsync file: missing checksums\n");
+  return ok;
+}
+
+void zsync_free(struct zsync *zsync)
+{
+  g_free(zsync->url);
+  g_free(zsync->sums);
+  memset(zsync,0,sizeof(struct zsync));
+}
+
+/* Blocks chained by their weak checksum. */
+struct table
+{
+  uint32_t *keys;
+  uint32_t *head;
+  uint32_t *next;
+  uint32_t mask;
+};
+
+static uint32_t slot(const struct table *table, uint32_t key)
+{
+  return (key * 2654435761U) & table->mask;
+}
+
+static void table_init(struct table *table, const struct zsync *zsync)
+{
+  register uint32_t i,s;
+  size_t n = zsync->nblocks ? zsync->nblocks : 1;
+
+  for(table->mask = 15 ; table->mask < zsync->nblocks ; )
+    table->mask = table->mask << 1 | 1;
+  table->keys = g_malloc(n * sizeof(uint32_t));
+  table->next = g_malloc(n * sizeof(uint32_t));
+  table->head = g_malloc((table->mask + 1) * sizeof(uint32_t));
+  memset(table->head,0xff,(table->mask + 1) * sizeof(uint32_t));
+  /* backwards so that each chain is in the order of the file */
+  for(i = (uint32_t)zsync->nblocks ; i-- ; ) {
+    table->keys[i] = block_key(zsync,i);
+    s = slot(table,table->keys[i]);
+    table->next[i] = table->head[s];
+    table->head[s] = i;
+  }
+}
+
+static void table_free(struct table *table)
+{
+  g_free(table->keys);
+  g_free(table->head);
+  g_free(table->next);
+}
+
+/* Whether block i is at p, by its weak then its strong checksum. */
+static bool same_block(const struct zsync *zsync, const struct table *table,
+                       uint32_t i, const unsigned char *p)
+{
+  unsigned char digest[MD4_SIZE];
+  uint32_t a,b;
+
+  rsum_block(p,zsync->blocksize,&a,&b);
+  if(rsum_key(zsync,a,b) != table->keys[i])
+    return false;
+  md4(p,zsync->blocksize,digest);
+  return !memcmp(digest,block_sum(zsync,i) + zsync->rsum_bytes,
+                 zsync->checksum_bytes);
+}
+
+/* Find the blocks of the target in a local file by sliding the rolling
+   checksum one byte at a time, or one block after a match. The file is
+   padded with zeros like the last block. The offset of each block in
+   the file is returned, -1 for the ones missing, or NULL when the file
+   cannot be read or the scan was stopped. */
+off_t *zsync_match(const struct zsync *zsync, int fd,
+                   const volatile bool *stop)
+{
+  register size_t bs = zsync->blocksize;
+  size_t span = bs * zsync->seq_matches;
+  size_t size = (SCAN_CHUNK > 16 * bs ? SCAN_CHUNK : 16 * bs) + span;
+  unsigned char *buf,*p,digest[MD4_SIZE];
+  struct table table;
+  off_t *map,base = 0;
+  off_t last_block = -1,last_pos = -1,found;
+  size_t pos = 0,len = 0;
+  uint32_t a = 0,b = 0,a2 = 0,b2 = 0,key,i;
+  int shift = 0;
+  bool eof = false,valid = false,next = false,hashed,follows,ok;
+  ssize_t rd;
+
+  while((1UL << shift) < bs)
+    shift++;
+  map = g_malloc((zsync->nblocks + 1) * sizeof(off_t));
+  for(i = 0 ; i < zsync->nblocks ; i++)
+    map[i] = -1;
+  table_init(&table,zsync);
+  buf = g_malloc(size);
+
+  for(;;) {
+    if(pos + span >= len && !eof) {
+      /* keep the window and read after it, the byte past it is needed
+         to roll */
+      memmove(buf,buf + pos,len - pos);
+      base += pos;
+      len  -= pos;
+      pos   = 0;
+      if(*stop)
+        break;
+      rd = read(fd,buf + len,size - len);
+      if(rd == -1 && errno == EINTR)
+        continue;
+      if(rd == -1) {
+        perror("Cannot read the local file");
+        break;
+      }
+      if(!rd) {
+        eof = true;
+        memset(buf + len,0,span);
+        len += span;
+      }
+      len += rd;
+      continue;
+    }
+    if(pos + bs > len)
+      break;
+    p = buf + pos;
+    if(!valid) {
+      rsum_block(p,bs,&a,&b);
+      valid = true;
+    }
+    /* with two blocks in a row the next one is rolled along */
+    if(zsync->seq_matches == 2 && !next && pos + 2 * bs <= len) {
+      rsum_block(p + bs,bs,&a2,&b2);
+      next = true;
+    }
+    key    = rsum_key(zsync,a,b);
+    hashed = false;
+    found  = -1;
+    for(i = table.head[slot(&table,key)] ; i != NONE ; i = table.next[i]) {
+      if(table.keys[i] != key)
+        continue;
+      /* a short checksum must be backed by the blocks around, the weak
+         one of the next block is enough to skip the MD4 */
+      follows = last_block == (off_t)i - 1 && last_pos == base + pos - bs;
+      if(zsync->seq_matches == 2 && i + 1 < zsync->nblocks && !follows &&
+         next && rsum_key(zsync,a2,b2) != table.keys[i + 1])
+        continue;
+      if(!hashed) {
+        md4(p,bs,digest);
+        hashed = true;
+      }
+      if(memcmp(digest,block_sum(zsync,i) + zsync->rsum_bytes,
+                zsync->checksum_bytes))
+        continue;
+      ok = zsync->seq_matches == 1 || i + 1 == zsync->nblocks || follows ||
+           (pos + 2 * bs <= len && same_block(zsync,&table,i + 1,p + bs));
+      if(!ok)
+        continue;
+      if(map[i] == -1)
+        map[i] = base + pos;
+      if(found == -1)
+        found = i;
+    }
+    if(found != -1) {
+      last_block = found;
+      last_pos   = base + pos;
+      pos  += bs;
+      valid = false;
+      next  = false;
+      continue;
+    }
+    if(pos + bs >= len) {
+      /* nothing past the window to roll with, the sum is taken again */
+      valid = false;
+      next  = false;
+      pos++;
+      continue;
+    }
+    /* roll over one byte */
+    if(next && pos + 2 * bs < len) {
+      a2 += p[2 * bs] - p[bs];
+      b2 += a2 - ((uint32_t)p[bs] << shift);
+    }
+    else
+      next = false;
+    a += p[bs] - p[0];
+    b += a - ((uint32_t)p[0] << shift);
+    pos++;
+  }
+  g_free(buf);
+  table_free(&table);
+  if(*stop || !eof) {
+    g_free(map);
+    return NULL;
+  }
+  return map;
+}
+
+/* Copy without going through user space when the kernel can, sharing
+   the extents on filesystems which support it. The local file may be
+   shorter than the block matched in its padding, the rest is zeros. */
+static bool copy_range(int from, off_t src, int to, off_t dst, size_t len)
+{
+  static bool plain = false;
+  char buf[COPY_CHUNK];
+  ssize_t n;
+
+  while(len && !plain) {
+    n = copy_file_range(from,&src,to,&dst,len,0);
+    if(n == -1 && errno == EINTR)
+      continue;
+    if(n == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                   errno == EOPNOTSUPP)) {
+      plain = true;
+      break;
+    }
+    if(n == -1)
+      return false;
+    if(!n)
+      break;
+    len -= n;
+  }
+  while(len) {
+    n = pread(from,buf,len < COPY_CHUNK ? len : COPY_CHUNK,src);
+    if(n == -1 && errno == EINTR)
+      continue;
+    if(n == -1)
+      return false;
+    if(!n) {
+      n = len < COPY_CHUNK ? len : COPY_CHUNK;
+      memset(buf,0,n);
+    }
+    if(pwrite(to,buf,n,dst) != n)
+      return false;
+    src += n;
+    dst += n;
+    len -= n;
+  }
+  return true;
+}
+
+/* Copy the blocks found into the target, the ones next to each other in
+   both files at once. The ranges of the target copied are appended to
+   ranges, merged, and their size returned. */
+off_t zsync_copy(const struct zsync *zsync, const off_t *map, int from,
+                 int to, GArray *ranges, const volatile bool *stop)
+{
+  register off_t i,j,bs = zsync->blocksize;
+  struct range range;
+  off_t begin,end,copied = 0;
+
+  for(i = 0 ; i < zsync->nblocks && !*stop ; i = j) {
+    if(map[i] == -1) {
+      j = i + 1;
+      continue;
+    }
+    for(j = i + 1 ; j < zsync->nblocks && map[j] == map[i] + (j - i) * bs ;
+        j++);
+    begin = i * bs;
+    end   = j * bs < zsync->length ? j * bs : zsync->length;
+    if(!copy_range(from,map[i],to,begin,end - begin)) {
+      perror("Cannot copy from the local file");
+      continue;
+    }
+    copied += end - begin;
+    if(ranges->len &&
+       g_array_index(ranges,struct range,ranges->len - 1).end == begin - 1)
+      g_array_index(ranges,struct range,ranges->len - 1).end = end - 1;
+    else {
+      range.begin = begin;
+      range.end   = end - 1;
+      g_array_append_val(ranges,range);
+    }
+  }
+  return copied;
+}
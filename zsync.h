@@ -0,0 +1,51 @@
+/* File: zsync.h
+
+   Copyright (C) 2010 David Hauweele <david@hauweele.net>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _ZSYNC_H_
+#define _ZSYNC_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <glib.h>
+
+enum zsync_max { ZSYNC_HASH_MAX = 48 };
+
+/* Control file of zsync. The target is cut in blocks of the same size,
+   the last one padded with zeros, each given by the last bytes of its
+   rolling checksum and the first bytes of its MD4. With few bytes a
+   block only counts as found when the next one is found right after. */
+struct zsync
+{
+  off_t length;
+  int blocksize;                 /* a power of two */
+  int seq_matches;
+  int rsum_bytes;
+  int checksum_bytes;
+  char checksum[ZSYNC_HASH_MAX]; /* "sha1:<hex>" like -k, empty without */
+  char *url;                     /* NULL without an absolute one */
+  off_t nblocks;
+  unsigned char *sums;           /* rsum_bytes + checksum_bytes a block */
+};
+
+bool zsync_load(struct zsync *zsync, const char *path);
+void zsync_free(struct zsync *zsync);
+off_t *zsync_match(const struct zsync *zsync, int fd,
+                   const volatile bool *stop);
+off_t zsync_copy(const struct zsync *zsync, const off_t *map, int from,
+                 int to, GArray *ranges, const volatile bool *stop);
+
+#endif /* _ZSYNC_H_ */